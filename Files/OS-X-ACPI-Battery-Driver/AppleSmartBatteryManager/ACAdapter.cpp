@@ -10,9 +10,17 @@
 #include <IOKit/pwr_mgt/RootDomain.h>
 #include <IOKit/pwr_mgt/IOPMPowerSource.h>
 #include <IOKit/IOCommandGate.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOInterruptEventSource.h>
 #include "IOPMPrivate.h"
 #include "ACAdapter.h"
 
+enum
+{
+    kPSRRetryDelayMin = 250,        // ms after a failed _PSR, doubling per failure
+    kPSRRetryDelayMax = 30000,      // ms, retried this often until it succeeds
+};
+
 static IOPMPowerState myTwoStates[2] = {
     {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
     {1, kIOPMPowerOn, kIOPMPowerOn, kIOPMPowerOn, 0, 0, 0, 0, 0, 0, 0, 0}
@@ -29,6 +37,20 @@ bool ACPIACAdapter::init(OSDictionary* dict)
 
     fProvider = NULL;
     fACConnected = false;
+    fHasPSR = false;
+    fRetryTimer = NULL;
+    fPollPending = false;
+    fPendingPriority = kACPIPriorityTimer;
+    fRetryDelay = 0;
+    fWakePhase = 0;
+    fNotifyIntake = NULL;
+    fNotifyPendingTime = 0;
+    fNotifyDeferredTime = 0;
+    fNotifiesRaw = 0;
+    fNotifiesServiced = 0;
+    fNotifyLatencyTotal = 0;
+    fNotifyLatencyLast = 0;
+    fNotifyLatencyMax = 0;
     
     return true;
 }
@@ -48,8 +70,16 @@ bool ACPIACAdapter::start(IOService* provider)
         return false;
     }
     fProvider->retain();
+
+    // probe once; the result is reported to the manager's capability map
+    fHasPSR = kIOReturnSuccess == fProvider->validateObject("_PSR");
+    if (!fHasPSR)
+        AlwaysLog("ACPIACAdapter: no _PSR method, AC state will not be reported\n");
+
+    // ahead of the batteries' reads after wake, never overlapping them
+    fWakePhase = random() % kWakePhaseAdapterSpread;
     
-    IOWorkLoop *fWorkloop = getWorkLoop();
+    fWorkloop = getWorkLoop();
     if (!fWorkloop) {
         return false;
     }
@@ -62,6 +92,19 @@ bool ACPIACAdapter::start(IOService* provider)
     fWorkloop->addEventSource(fCommandGate);
     
     fLock = IORecursiveLockAlloc();
+
+    // runs a _PSR read deferred by the ACPI governor or to the wake phase
+    fRetryTimer = IOTimerEventSource::timerEventSource(this,
+        OSMemberFunctionCast(IOTimerEventSource::Action, this, &ACPIACAdapter::retryTimeOut));
+    if (!fRetryTimer || kIOReturnSuccess != fWorkloop->addEventSource(fRetryTimer))
+        return false;
+
+    // Notify is only recorded on the ACPI notify thread; _PSR is read here
+    fNotifyIntake = IOInterruptEventSource::interruptEventSource(this,
+        OSMemberFunctionCast(IOInterruptEventSource::Action, this, &ACPIACAdapter::notifyIntakeOccurred));
+    if (!fNotifyIntake || kIOReturnSuccess != fWorkloop->addEventSource(fNotifyIntake))
+        return false;
+
     fBatteryServices = OSSet::withCapacity(1);
 
     OSDictionary * serviceMatch = serviceMatching("AppleSmartBattery");
@@ -110,6 +153,19 @@ void ACPIACAdapter::stop(IOService* provider)
     
     fWorkloop->removeEventSource(fCommandGate);
     OSSafeReleaseNULL(fCommandGate);
+
+    if (fRetryTimer)
+    {
+        fRetryTimer->cancelTimeout();
+        fWorkloop->removeEventSource(fRetryTimer);
+        OSSafeReleaseNULL(fRetryTimer);
+    }
+
+    if (fNotifyIntake)
+    {
+        fWorkloop->removeEventSource(fNotifyIntake);
+        OSSafeReleaseNULL(fNotifyIntake);
+    }
     
     if (NULL != fLock)
     {
@@ -126,9 +182,16 @@ IOReturn ACPIACAdapter::setPowerState(unsigned long state, IOService* device)
 {
     DebugLog("ACPIACAdapter::setPowerState: state: %u, device: %s\n", (unsigned int) state, device->getName());
 
-    // System wake-up
-    if (state)
-        pollState();
+    // System wake-up: read _PSR at this adapter's phase, through the retry
+    // timer so it merges with a read the governor deferred
+    if (state && fHasPSR && fRetryTimer)
+    {
+        IORecursiveLockLock(fLock);
+        fPollPending = true;
+        fPendingPriority = kACPIPriorityWake;
+        fRetryTimer->setTimeoutMS(fWakePhase);
+        IORecursiveLockUnlock(fLock);
+    }
 
     return kIOPMAckImplied;
 }
@@ -137,12 +200,91 @@ IOReturn ACPIACAdapter::message(UInt32 type, IOService* provider, void* argument
 {
     DebugLog("ACPIACAdapter::message: type: %08X provider: %s\n", (unsigned int)type, provider->getName());
 
-    if (type == kIOACPIMessageDeviceNotification)
-        pollState();
+    // don't hold the ACPI notify thread for a _PSR round trip
+    if (type == kIOACPIMessageDeviceNotification && fNotifyIntake)
+    {
+        OSIncrementAtomic(&fNotifiesRaw);
+        OSCompareAndSwap64(0, GetUptimeUS(), &fNotifyPendingTime);
+        fNotifyIntake->interruptOccurred(NULL, this, 0);
+    }
 
     return kIOReturnSuccess;
 }
 
+/******************************************************************************
+ * ACPIACAdapter::notifyIntakeOccurred
+ * Workloop side of message: one _PSR read for every Notify recorded since
+ * the last call. A read the governor defers or that fails is serviced by
+ * the retry that eventually gets _PSR, and counted then.
+ ******************************************************************************/
+
+void ACPIACAdapter::notifyIntakeOccurred(IOInterruptEventSource* sender, int count)
+{
+    UInt64 queued;
+    do
+        queued = fNotifyPendingTime;
+    while (queued && !OSCompareAndSwap64(queued, 0, &fNotifyPendingTime));
+    if (!queued)
+        return;
+
+    IORecursiveLockLock(fLock);
+    if (!fNotifyDeferredTime)
+        fNotifyDeferredTime = queued;
+    pollState(kACPIPriorityNotify);
+    IORecursiveLockUnlock(fLock);
+}
+
+/******************************************************************************
+ * ACPIACAdapter::noteNotifyServiced
+ * pollState read _PSR: count the Notifies waiting since fNotifyDeferredTime
+ * as serviced. Caller must hold fLock.
+ ******************************************************************************/
+
+void ACPIACAdapter::noteNotifyServiced(void)
+{
+    if (!fNotifyDeferredTime)
+        return;
+    uint64_t latency = GetUptimeUS() - fNotifyDeferredTime;
+    fNotifyDeferredTime = 0;
+    fNotifyLatencyLast = (uint32_t)latency;
+    if (fNotifyLatencyLast > fNotifyLatencyMax)
+        fNotifyLatencyMax = fNotifyLatencyLast;
+    fNotifyLatencyTotal += latency;
+    ++fNotifiesServiced;
+    publishNotifyStatistics();
+}
+
+/******************************************************************************
+ * ACPIACAdapter::publishNotifyStatistics
+ *
+ ******************************************************************************/
+
+void ACPIACAdapter::publishNotifyStatistics(void)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(5);
+    if (!dict)
+        return;
+
+    struct { const char* key; uint32_t value; } stats[] =
+    {
+        { "Raw", (uint32_t)fNotifiesRaw },
+        { "Serviced", fNotifiesServiced },
+        { "LatencyLast", fNotifyLatencyLast },
+        { "LatencyMax", fNotifyLatencyMax },
+        { "LatencyAverage", fNotifiesServiced ? (uint32_t)(fNotifyLatencyTotal / fNotifiesServiced) : 0 },
+    };
+    for (unsigned i = 0; i < sizeof(stats)/sizeof(stats[0]); i++)
+    {
+        if (OSNumber* num = OSNumber::withNumber(stats[i].value, 32))
+        {
+            dict->setObject(stats[i].key, num);
+            num->release();
+        }
+    }
+    setProperty("Notify Statistics", dict);
+    dict->release();
+}
+
 void ACPIACAdapter::gatedHandler(IOService* newService, IONotifier * notifier)
 {
     AppleSmartBattery*  battery = OSDynamicCast(AppleSmartBattery, newService);
@@ -152,9 +294,11 @@ void ACPIACAdapter::gatedHandler(IOService* newService, IONotifier * notifier)
             DebugLog("%s: Notification consumer published: %s\n", getName(), battery->getName());
             
             fBatteryServices->setObject(battery);
+            if (AppleSmartBatteryManager* governor = getGovernor())
+                governor->setACPIMethod(kACPIMethodPSR, fHasPSR);
             
             // Ensure the newly registered battery is updated with the latest AC connection state
-            pollState();
+            pollState(kACPIPriorityWake);
         }
         
         if (notifier == fTerminateNotify) {
@@ -173,14 +317,70 @@ bool ACPIACAdapter::notificationHandler(void * refCon, IOService * newService, I
     return true;
 }
 
-void ACPIACAdapter::pollState()
+/******************************************************************************
+ * ACPIACAdapter::getGovernor
+ * ACPI governor lives in the battery manager; none until a battery is published
+ ******************************************************************************/
+
+AppleSmartBatteryManager* ACPIACAdapter::getGovernor(void)
+{
+    AppleSmartBatteryManager* manager = NULL;
+    OSCollectionIterator* i = OSCollectionIterator::withCollection(fBatteryServices);
+    if (i != NULL) {
+        if (AppleSmartBattery* battery = OSDynamicCast(AppleSmartBattery, i->getNextObject()))
+            manager = OSDynamicCast(AppleSmartBatteryManager, battery->getProvider());
+        i->release();
+    }
+    return manager;
+}
+
+void ACPIACAdapter::retryTimeOut(void)
+{
+    IORecursiveLockLock(fLock);
+    if (fPollPending)
+        pollState(fPendingPriority);
+    IORecursiveLockUnlock(fLock);
+}
+
+void ACPIACAdapter::pollState(int priority)
 {
     UInt32 acpi = 0;
+
+    if (!fHasPSR)
+        return;
     
     IORecursiveLockLock(fLock);
+
+    // merge with a read the governor refused or a retry after a failure
+    if (fPollPending && fPendingPriority > priority)
+        priority = fPendingPriority;
+
+    AppleSmartBatteryManager* governor = getGovernor();
+    uint32_t retry = 0;
+    if (governor && !governor->requestACPIBudget(priority, 1, &retry))
+    {
+        DebugLog("ACPIACAdapter::pollState deferred %ums by governor\n", (unsigned)retry);
+        if (fPollPending)
+            governor->noteACPIRequestMerged();
+        fPollPending = true;
+        fPendingPriority = priority;
+        fRetryTimer->setTimeoutMS(retry);
+        IORecursiveLockUnlock(fLock);
+        return;
+    }
+    fPollPending = false;
+    fPendingPriority = kACPIPriorityTimer;
+    fRetryTimer->cancelTimeout();
     
-    if (fProvider && kIOReturnSuccess == fProvider->evaluateInteger("_PSR", &acpi))
+    bool success = fProvider && kIOReturnSuccess == fProvider->evaluateInteger("_PSR", &acpi);
+    if (success)
     {
+        if (fRetryDelay)
+            AlwaysLog("ACPIACAdapter: ACPI method _PSR recovered\n");
+        fRetryDelay = 0;
+        // a Notify counts as serviced only once _PSR has actually been read
+        noteNotifyServiced();
+
         DebugLog("ACPIACAdapter::message setting AC %s\n", (acpi ? "connected" : "disconnected"));
         
         fACConnected = acpi;
@@ -190,7 +390,7 @@ void ACPIACAdapter::pollState()
         
         if (i != NULL) {
             while (AppleSmartBattery* battery = OSDynamicCast(AppleSmartBattery, i->getNextObject()))  {
-                //fCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, battery, &AppleSmartBattery::notifyConnectedState), (void*)fACConnected);
+                // runs under the battery's own gate
                 battery->notifyConnectedState(fACConnected);
             }
         }
@@ -205,7 +405,18 @@ void ACPIACAdapter::pollState()
     }
     else
     {
-        AlwaysLog("ACPIACAdapter: ACPI method _PSR failed\n");
+        // nothing else knows the AC state: keep the read pending and retry
+        // with backoff, logging only the first failure in a row
+        if (!fRetryDelay)
+            AlwaysLog("ACPIACAdapter: ACPI method _PSR failed, retrying\n");
+        else
+            DebugLog("ACPIACAdapter: ACPI method _PSR failed again, retry in %ums\n", (unsigned)fRetryDelay);
+        fRetryDelay = fRetryDelay ? fRetryDelay * 2 : kPSRRetryDelayMin;
+        if (fRetryDelay > kPSRRetryDelayMax)
+            fRetryDelay = kPSRRetryDelayMax;
+        fPollPending = true;
+        fPendingPriority = priority;
+        fRetryTimer->setTimeoutMS(fRetryDelay);
     }
 
     IORecursiveLockUnlock(fLock);
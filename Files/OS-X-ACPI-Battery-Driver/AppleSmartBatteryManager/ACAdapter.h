@@ -20,6 +20,8 @@ private:
     IOWorkLoop*             fWorkloop;
     IOCommandGate*          fCommandGate;
     IORecursiveLock*        fLock;
+    IOTimerEventSource*     fRetryTimer;
+    IOInterruptEventSource* fNotifyIntake;      // see message
     
     IONotifier*             fPublishNotify;
     IONotifier*             fTerminateNotify;
@@ -27,10 +29,27 @@ private:
     OSSet*                  fBatteryServices;
     
     bool                    fACConnected;
+    bool                    fHasPSR;            // probed once at start
+    bool                    fPollPending;       // _PSR read waiting on fRetryTimer (governor or wake phase)
+    int                     fPendingPriority;
+    uint32_t                fRetryDelay;        // ms, backoff after a failed _PSR, 0 if it last succeeded
+    uint32_t                fWakePhase;         // ms after wake to read _PSR
+    volatile UInt64         fNotifyPendingTime; // us, oldest Notify not yet taken, 0 if none
+    uint64_t                fNotifyDeferredTime; // us, oldest Notify taken but left to fRetryTimer, 0 if none
+    volatile SInt32         fNotifiesRaw;
+    uint32_t                fNotifiesServiced;
+    uint64_t                fNotifyLatencyTotal; // us
+    uint32_t                fNotifyLatencyLast;  // us
+    uint32_t                fNotifyLatencyMax;   // us
 
     void                    gatedHandler(IOService* newService, IONotifier * notifier);
     bool                    notificationHandler(void * refCon, IOService * newService, IONotifier * notifier);
-    void                    pollState();
+    void                    pollState(int priority);
+    void                    retryTimeOut(void);
+    void                    notifyIntakeOccurred(IOInterruptEventSource* sender, int count);
+    void                    noteNotifyServiced(void);
+    void                    publishNotifyStatistics(void);
+    AppleSmartBatteryManager* getGovernor(void);
 public:
     virtual bool            init(OSDictionary* dict);
     virtual bool            start(IOService* provider);
@@ -51,10 +51,13 @@
 
 #include <IOKit/IOTimerEventSource.h>
 #include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOCommandGate.h>
+#include <IOKit/IOUserClient.h>
 #include <IOKit/IOTimerEventSource.h>
 #include <IOKit/pwr_mgt/RootDomain.h>
 //#include <IOKit/pwr_mgt/IOPMPrivate.h>    //rehabman: I don't have this header in latest xcode
 #include <libkern/c++/OSObject.h>
+#include <libkern/libkern.h>
 
 #include "AppleSmartBatteryManager.h"
 #include "AppleSmartBattery.h"
@@ -74,26 +77,63 @@ enum
     kPostDischargeWaitSeconds   = 120
 };
 
-enum 
-{
-    kDefaultPollInterval = 0,
-    kQuickPollInterval = 1
-};
 
 #define kErrorRetryAttemptsExceeded         "Read Retry Attempts Exceeded"
 #define kErrorOverallTimeoutExpired         "Overall Read Timeout Expired"
 #define kErrorZeroCapacity                  "Capacity Read Zero"
 #define kErrorPermanentFailure              "Permanent Battery Failure"
 #define kErrorNonRecoverableStatus          "Non-recoverable status failure"
+#define kErrorMethodFailed                  "ACPI Method Failed"
+#define kErrorMethodTimeout                 "ACPI Method Timeout Expired"
 
 // Polling intervals
-// The battery kext switches between polling frequencies depending on
-// battery load
+// The poll scheduler picks an interval between these bounds depending on
+// how fast the battery is charging/discharging and how close it is to
+// the warning/low levels (overridable via Configuration)
+
+enum
+{
+    kDefaultPollingIntervalMin  = 1000,     // quick 1 second polling
+    kDefaultPollingIntervalMax  = 30000,    // regular 30 second polling
+    kDefaultPollingLeewayPercent = 10,      // timer may be deferred 10% to coalesce wakeups
+    kLateWakeupSlack            = 5,        // fired later than this (ms) == deferred by the kernel
+    kDefaultNotifyWatchdogInterval = 600000, // 10 minute watchdog poll in notify driven mode
+    kDefaultACSettleDelay       = 1000,     // charger switch-over time before reading _BST after AC change
+    kACSettleAttempts           = 3,        // _BST reads waiting for it to reflect an AC change
+    kDefaultBatteryAbsentCheckInterval = 3600000, // hourly _STA check while dormant
+    kDefaultNotifyCoalesceWindow = 500,     // one Notify read per half second at most
+    kDefaultStaticInfoRefreshInterval = 600000, // re-read _BIF/_BIX every 10 minutes without Notify 0x81
+    kBurstIntervalMin           = 100,      // fastest burst sampling, if the EC declares nothing slower
+    kBurstSecondsMax            = 600,
+    kBurstSamplesMax            = 6000,
+    kFreshReadTimeout           = 5000,     // longest a read with max age waits for its poll
+    kDefaultACPIMethodTimeout   = 2000,     // a healthy EC answers within tens of ms
+    kReadWatchdogSlack          = 1000,     // on top of the per-method deadlines
+    kRetryDelayMin              = 250,      // first retry of a failed read, doubled per attempt
+    kRetryDelayMax              = 30000
+};
 
-static uint32_t milliSecPollingTable[2] =
-{ 
-	30000,    // 0 == Regular 30 second polling
-	1000      // 1 == Quick 1 second polling
+#define kStatusMethods (ACPIMethodBit(kACPIMethodBST) | ACPIMethodBit(kACPIMethodEC))
+
+// Routed fields (see routeFields): where each can come from and how old it may
+// get by default before a method is read just for it
+static const struct
+{
+    const char* name;
+    int         group;          // interest group, -1 if always published
+    UInt32      sources;        // ACPIMethodBit()s
+    uint32_t    maxAge;         // ms, 0 = every poll
+} routedFields[kRoutedFieldCount] =
+{
+    { "Temperature", kInterestGroupExtra,
+        ACPIMethodBit(kACPIMethodBIF) | ACPIMethodBit(kACPIMethodBBIX) | ACPIMethodBit(kACPIMethodSBS), 600000 },
+    { "CycleCount", -1,
+        ACPIMethodBit(kACPIMethodBIF) | ACPIMethodBit(kACPIMethodBIX) | ACPIMethodBit(kACPIMethodSBS), 600000 },
+    { "Current", kInterestGroupExtra, ACPIMethodBit(kACPIMethodBBIX) | ACPIMethodBit(kACPIMethodSBS), 0 },
+    { "AverageCurrent", kInterestGroupExtra, ACPIMethodBit(kACPIMethodBBIX) | ACPIMethodBit(kACPIMethodSBS), 0 },
+    { "RunTimeToEmpty", kInterestGroupExtra, ACPIMethodBit(kACPIMethodBBIX) | ACPIMethodBit(kACPIMethodSBS), 0 },
+    { "StateOfCharge", kInterestGroupExtra, ACPIMethodBit(kACPIMethodBBIX), 60000 },
+    { "Voltage", -1, kStatusMethods | ACPIMethodBit(kACPIMethodBBIX) | ACPIMethodBit(kACPIMethodSBS), 0 },
 };
 
 // Keys we use to publish battery state in our IOPMPowerSource::properties array
@@ -205,7 +245,9 @@ bool AppleSmartBattery::loadConfiguration()
 
     // allow overrides from RMCF ACPI method
     OSDictionary* merged = NULL;
-    OSDictionary* custom = fProvider->getConfigurationOverride("RMCF");
+    OSDictionary* custom = NULL;
+    if (fProvider->hasACPIMethod(kACPIMethodRMCF))
+        custom = fProvider->getConfigurationOverride("RMCF");
     if (custom)
     {
         DebugOnly(fProvider->setProperty("Configuration.Override", custom));
@@ -229,10 +271,27 @@ bool AppleSmartBattery::loadConfiguration()
     }
     else
     {
-        fPollingInterval = kDefaultPollInterval;
+        fPollingInterval = 0;
         fPollingOverridden = false;
     }
 
+    // Get bounds for the adaptive polling interval
+    fPollingIntervalMin = kDefaultPollingIntervalMin;
+    if (OSNumber* pollingIntervalMin = OSDynamicCast(OSNumber, config->getObject(kPollingIntervalMinimum)))
+        fPollingIntervalMin = pollingIntervalMin->unsigned32BitValue();
+    fPollingIntervalMax = kDefaultPollingIntervalMax;
+    if (OSNumber* pollingIntervalMax = OSDynamicCast(OSNumber, config->getObject(kPollingIntervalMaximum)))
+        fPollingIntervalMax = pollingIntervalMax->unsigned32BitValue();
+    if (!fPollingIntervalMin)
+        fPollingIntervalMin = kDefaultPollingIntervalMin;
+    fPollingLeewayPercent = kDefaultPollingLeewayPercent;
+    if (OSNumber* pollingLeeway = OSDynamicCast(OSNumber, config->getObject(kPollingLeewayPercent)))
+        fPollingLeewayPercent = pollingLeeway->unsigned32BitValue();
+    if (fPollingLeewayPercent > 100)
+        fPollingLeewayPercent = 100;
+    if (fPollingIntervalMax < fPollingIntervalMin)
+        fPollingIntervalMax = fPollingIntervalMin;
+
     // Check if we should use extended information in _BIX (ACPI 4.0) or older _BIF
     fUseBatteryExtendedInformation = false;
     if (OSBoolean* useExtendedInformation = OSDynamicCast(OSBoolean, config->getObject(kUseBatteryExtendedInfoKey)))
@@ -258,6 +317,112 @@ bool AppleSmartBattery::loadConfiguration()
     if (fUseBatteryExtraInformation)
         AlwaysLog("Using ACPI extra battery information method BBIX\n");
 
+    // Check if the bulk method BALL may replace the per-method reads (used when present)
+    fUseBatteryBulkInformation = true;
+    if (OSBoolean* useBulkInformation = OSDynamicCast(OSBoolean, config->getObject(kUseBatteryBulkInfoKey)))
+        fUseBatteryBulkInformation = useBulkInformation->isTrue();
+    if (useBulkMethod())
+        AlwaysLog("Using ACPI bulk battery information method BALL\n");
+
+    // Check if the Smart Battery System should be read directly instead of BBIX
+    fUseSmartBatterySystem = false;
+    if (OSBoolean* useSBS = OSDynamicCast(OSBoolean, config->getObject(kUseSmartBatterySystemKey)))
+        fUseSmartBatterySystem = fProvider->setSmartBatterySystem(useSBS->isTrue());
+    if (fUseSmartBatterySystem)
+        AlwaysLog("Using Smart Battery System registers\n");
+
+    // Get how old each routed field may get before a method is read just for it
+    OSDictionary* fieldMaxAge = OSDynamicCast(OSDictionary, config->getObject(kFieldMaxAgeKey));
+    for (int i = 0; i < kRoutedFieldCount; i++)
+    {
+        fFieldMaxAge[i] = routedFields[i].maxAge;
+        if (OSNumber* maxAge = fieldMaxAge ? OSDynamicCast(OSNumber, fieldMaxAge->getObject(routedFields[i].name)) : NULL)
+            fFieldMaxAge[i] = maxAge->unsigned32BitValue();
+    }
+
+    // Check if _BST fields may be read straight from EC registers (needs an RMCF map)
+    if (fProvider->setECRegisterMap(OSDynamicCast(OSDictionary, config->getObject(kECRegisterMapKey))))
+        AlwaysLog("Using EC register map instead of _BST\n");
+
+    // Check if poll reads may leave the workloop for the manager's worker thread
+    bool asyncReads = true;
+    if (OSBoolean* async = OSDynamicCast(OSBoolean, config->getObject(kAsyncACPIReadsKey)))
+        asyncReads = async->isTrue();
+    fProvider->setAsyncACPIReads(asyncReads);
+
+    // Check if we should program the _BTP trip point instead of polling quickly near thresholds
+    fUseBatteryTripPoint = false;
+    if (OSBoolean* useTripPoint = OSDynamicCast(OSBoolean, config->getObject(kUseBatteryTripPointKey)))
+    {
+        fUseBatteryTripPoint = useTripPoint->isTrue();
+        if (fUseBatteryTripPoint && kIOReturnSuccess != fProvider->validateBatteryBTP())
+            fUseBatteryTripPoint = false;
+    }
+    if (fUseBatteryTripPoint)
+        AlwaysLog("Using ACPI battery trip point method _BTP\n");
+
+    // Check if reads should be driven by Notify, with only a watchdog poll
+    fNotifyDriven = false;
+    if (OSBoolean* notifyDriven = OSDynamicCast(OSBoolean, config->getObject(kNotifyDrivenPollingKey)))
+        fNotifyDriven = notifyDriven->isTrue();
+    fNotifyWatchdogInterval = kDefaultNotifyWatchdogInterval;
+    if (OSNumber* notifyWatchdogInterval = OSDynamicCast(OSNumber, config->getObject(kNotifyWatchdogIntervalKey)))
+        fNotifyWatchdogInterval = notifyWatchdogInterval->unsigned32BitValue();
+    if (fNotifyWatchdogInterval < fPollingIntervalMax)
+        fNotifyWatchdogInterval = fPollingIntervalMax;
+    if (fNotifyDriven)
+        AlwaysLog("Using notify driven polling, watchdog %ums\n", (unsigned)fNotifyWatchdogInterval);
+    setProperty("Notify Driven", fNotifyDriven);
+
+    // Check if optional methods are read only for fields someone wants
+    fDemandDriven = false;
+    if (OSBoolean* demandDriven = OSDynamicCast(OSBoolean, config->getObject(kDemandDrivenRefreshKey)))
+        fDemandDriven = demandDriven->isTrue();
+
+    // Get the refresh interval for cached static info
+    fStaticInfoRefreshInterval = kDefaultStaticInfoRefreshInterval;
+    if (OSNumber* refreshInterval = OSDynamicCast(OSNumber, config->getObject(kStaticInfoRefreshIntervalKey)))
+        fStaticInfoRefreshInterval = refreshInterval->unsigned32BitValue();
+
+    // Get the ACPI evaluation budget shared with the AC adapter
+    UInt32 evaluationsPerMinute = 0;
+    if (OSNumber* budget = OSDynamicCast(OSNumber, config->getObject(kACPIEvaluationsPerMinuteKey)))
+        evaluationsPerMinute = budget->unsigned32BitValue();
+    fProvider->setACPIBudget(evaluationsPerMinute);
+
+    // Get delay for the charger to switch over after AC plug/unplug
+    fACSettleDelay = kDefaultACSettleDelay;
+    if (OSNumber* acSettleDelay = OSDynamicCast(OSNumber, config->getObject(kACSettleDelayKey)))
+        fACSettleDelay = acSettleDelay->unsigned32BitValue();
+
+    // Get the deadline for each ACPI method in a poll
+    fMethodTimeout = kDefaultACPIMethodTimeout;
+    if (OSNumber* methodTimeout = OSDynamicCast(OSNumber, config->getObject(kACPIMethodTimeoutKey)))
+        fMethodTimeout = methodTimeout->unsigned32BitValue();
+
+    // Get sanity check interval for when no battery is present
+    fBatteryAbsentCheckInterval = kDefaultBatteryAbsentCheckInterval;
+    if (OSNumber* absentCheckInterval = OSDynamicCast(OSNumber, config->getObject(kBatteryAbsentCheckIntervalKey)))
+        fBatteryAbsentCheckInterval = absentCheckInterval->unsigned32BitValue();
+
+    // Get the window for collapsing Notify storms
+    UInt32 notifyCoalesceWindow = kDefaultNotifyCoalesceWindow;
+    if (OSNumber* coalesceWindow = OSDynamicCast(OSNumber, config->getObject(kNotifyCoalesceWindowKey)))
+        notifyCoalesceWindow = coalesceWindow->unsigned32BitValue();
+    fProvider->setNotifyCoalesceWindow(notifyCoalesceWindow);
+
+    // Get firmware-side averaging to request through _BMA/_BMS
+    fRequestedAveragingInterval = 0;
+    if (OSNumber* averagingInterval = OSDynamicCast(OSNumber, config->getObject(kBatteryAveragingIntervalKey)))
+        fRequestedAveragingInterval = averagingInterval->unsigned32BitValue();
+    if (fRequestedAveragingInterval && kIOReturnSuccess != fProvider->validateBatteryBMA())
+        fRequestedAveragingInterval = 0;
+    fRequestedSamplingTime = 0;
+    if (OSNumber* samplingTime = OSDynamicCast(OSNumber, config->getObject(kBatterySamplingTimeKey)))
+        fRequestedSamplingTime = samplingTime->unsigned32BitValue();
+    if (fRequestedSamplingTime && kIOReturnSuccess != fProvider->validateBatteryBMS())
+        fRequestedSamplingTime = 0;
+
     OSBoolean* flag;
     // Check whether to use fDesignVoltage in _BST or fCurrentVoltage
     flag = OSDynamicCast(OSBoolean, config->getObject(kUseDesignVoltageForDesignCapacity));
@@ -345,6 +510,31 @@ bool AppleSmartBattery::start(IOService *provider)
         return false;
     }
 
+    fACSettleTimer = IOTimerEventSource::timerEventSource(this,
+        OSMemberFunctionCast(IOTimerEventSource::Action, this, &AppleSmartBattery::acSettleTimeOut));
+    if (!fACSettleTimer || kIOReturnSuccess != fWorkLoop->addEventSource(fACSettleTimer))
+        return false;
+
+    fReadTimer = IOTimerEventSource::timerEventSource(this,
+        OSMemberFunctionCast(IOTimerEventSource::Action, this, &AppleSmartBattery::incompleteReadTimeOut));
+    if (!fReadTimer || kIOReturnSuccess != fWorkLoop->addEventSource(fReadTimer))
+        return false;
+
+    fRetryTimer = IOTimerEventSource::timerEventSource(this,
+        OSMemberFunctionCast(IOTimerEventSource::Action, this, &AppleSmartBattery::retryTimeOut));
+    if (!fRetryTimer || kIOReturnSuccess != fWorkLoop->addEventSource(fRetryTimer))
+        return false;
+
+    fBurstTimer = IOTimerEventSource::timerEventSource(this,
+        OSMemberFunctionCast(IOTimerEventSource::Action, this, &AppleSmartBattery::burstTimeOut));
+    if (!fBurstTimer || kIOReturnSuccess != fWorkLoop->addEventSource(fBurstTimer))
+        return false;
+
+    // for requests from user space (setProperties)
+    fCommandGate = IOCommandGate::commandGate(this);
+    if (!fCommandGate || kIOReturnSuccess != fWorkLoop->addEventSource(fCommandGate))
+        return false;
+
     this->setName("AppleSmartBattery");
 	
     // Publish the intended period in seconds that our "time remaining"
@@ -359,212 +549,1633 @@ bool AppleSmartBattery::start(IOService *provider)
 	
     // zero out battery state with argument (do_set == true)
     fStartupFastPoll = 10;
-    fPollingInterval = kQuickPollInterval;
+    fQuickPoll = false;
+    fPendingPath = 0;
+    fPendingPriority = kACPIPriorityTimer;
+    fACChangeTime = 0;
+    fACSettleAttempts = 0;
+    fDormant = false;
+    setProperty("Dormant", false);
+    fBurstActive = false;
+    fBurstSamples = NULL;
+    for (int i = 0; i < kInterestGroupCount; i++)
+        fInterestCount[i] = 0;
+    publishInterest();
+    for (int i = 0; i < kRoutedFieldCount; i++)
+    {
+        fFieldRoute[i] = -1;
+        fFieldTime[i] = 0;
+        fFieldSources[i] = routedFields[i].sources;
+    }
+    fLatencyProbed = 0;
+    fLastSampleTime = 0;
+    fLastSampleCapacity = 0;
+    fLastSampleRate = 0;
+    fECRefresh.reset();
+    fPollDeadline = 0;
+    fPollLeeway = 0;
+    fWakePollPending = false;
+    fFullPollDeferred = false;
+    fTripPoint = 0;
+    fAveragingInterval = 0;
+    fSamplingTime = 0;
+    fNegotiateAveraging = true;
+    fMinSamplingTime = 0;
+    fMaxSamplingTime = 0;
+    fMinAveragingInterval = 0;
+    fMaxAveragingInterval = 0;
+    fMeasurementAccuracy = 0;
+    fPublished.valid = false;
+    fLateWakeups = 0;
+    fPollsAheadOfTimer = 0;
+    fSuppressedPublishes = 0;
+    fDarkWakeFastPaths = 0;
+    fOnTimeWakeups = 0;
+    fNotifies = 0;
+    fNotifiesThisInterval = 0;
+    fNotifiesLastInterval = 0;
+    fMissedNotifies = 0;
+    fACTransitions = 0;
+    fACTransitionLatency = 0;
+    fACTransitionLatencyMax = 0;
+    fACTransitionTimeouts = 0;
+    fDormantEntries = 0;
+    fSkippedEvaluations = 0;
+    fStaticInfoTime = 0;
+    fStaticExtraPending = true;
+    fStaticInfoRefreshes = 0;
+    fLastPollEvaluations = 0;
+    fPollEvaluations = 0;
+    fBulkPolls = 0;
+    bzero(&fRead, sizeof(fRead));
+    fReadInFlight = false;
+    fReadBurst = false;
+    fReadPath = 0;
+    fReadRefresh = false;
+    fReadSkipped[0] = 0;
+    fReadSkippedCount = 0;
+    fQueuedPath = 0;
+    fGateHoldDispatch = 0;
+    fGateHoldLast = 0;
+    fGateHoldMax = 0;
+    fACPIReadTimeLast = 0;
+    fACPIReadTimeMax = 0;
+    fCancelledReads = 0;
+    fWatchdogPending = false;
+    fNotifiesSinceRead = 0;
+    fReadTimedOut = false;
+    fRetryMethods = 0;
+    fRetryRefresh = false;
+    fReadRetries = 0;
+    fIncompleteReadRetries = 0;
+    fFailedReads = 0;
+    fRetriedReads = 0;
+    fRetriesExhausted = 0;
+    fIncompleteReads = 0;
+    fSampleTime = 0;
+    fFreshReads = 0;
+    fFreshReadPolls = 0;
+    fFreshReadWaits = 0;
+    fFreshReadTimeouts = 0;
+    // keep multiple battery instances from polling in lock step after wake,
+    // and clear of the adapter's _PSR
+    fPollPhase = kWakePhaseBatteryStart + random() % kWakePhaseBatterySpread;
     clearBatteryState(false);
 
     // some DSDT implementations aren't ready to read the EC yet, so avoid false reading
     IOSleep(fStartupDelay);
 
-    // Kick off the 30 second timer and do an initial poll
-    // specifics depend on macOS version (working around system bugs)
-    if (RunningKernel() < MakeKernelVersion(17,0,0))
+    // Kick off the 30 second timer and do an initial poll
+    // specifics depend on macOS version (working around system bugs)
+    if (RunningKernel() < MakeKernelVersion(17,0,0))
+    {
+        DebugLog("AppleSmartBattry: setting fFirstTimer=true, and doing immediate poll\n");
+        fFirstTimer = true;
+        requestBatteryPoll(kNewBatteryPath, kACPIPriorityWake);
+    }
+    else
+    {
+        DebugLog("AppleSmartBattery: setting fFirstTimer=false, and setting timer for %ums\n", (unsigned)fFirstPollDelay);
+        fFirstTimer = false;
+        fPollTimer->setTimeoutMS(fFirstPollDelay);
+    }
+    
+    registerService(0);
+
+    return true;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::stop
+ *
+ ******************************************************************************/
+
+void AppleSmartBattery::stop(IOService *provider)
+{
+    OSSafeReleaseNULL(fCellVoltages);
+
+    if (fACSettleTimer)
+    {
+        fACSettleTimer->cancelTimeout();
+        fWorkLoop->removeEventSource(fACSettleTimer);
+        OSSafeReleaseNULL(fACSettleTimer);
+    }
+    if (fBurstTimer)
+    {
+        fBurstTimer->cancelTimeout();
+        fWorkLoop->removeEventSource(fBurstTimer);
+        OSSafeReleaseNULL(fBurstTimer);
+    }
+    if (fReadTimer)
+    {
+        fReadTimer->cancelTimeout();
+        fWorkLoop->removeEventSource(fReadTimer);
+        OSSafeReleaseNULL(fReadTimer);
+    }
+    if (fRetryTimer)
+    {
+        fRetryTimer->cancelTimeout();
+        fWorkLoop->removeEventSource(fRetryTimer);
+        OSSafeReleaseNULL(fRetryTimer);
+    }
+    if (fBurstSamples)
+    {
+        IOFree(fBurstSamples, fBurstCapacity * sizeof(BurstSample));
+        fBurstSamples = NULL;
+    }
+    if (fCommandGate)
+    {
+        // readers waiting for a fresh read return before the gate goes
+        fCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &AppleSmartBattery::cancelFreshReads));
+        fWorkLoop->removeEventSource(fCommandGate);
+        OSSafeReleaseNULL(fCommandGate);
+    }
+
+    super::stop(provider);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::logReadError
+ *
+ ******************************************************************************/
+
+void AppleSmartBattery::logReadError(
+										  const char *error_type, 
+										  uint16_t additional_error,
+										  void *t)
+{
+    if(!error_type) return;
+	
+    setProperty((const char *)"LatestErrorType", error_type);
+	
+    AlwaysLog("Error: %s (%d)\n", error_type, additional_error);  
+	
+    return;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::setPollingInterval
+ *
+ ******************************************************************************/
+
+void AppleSmartBattery::setPollingInterval(
+												int milliSeconds)
+{
+    DebugLog("setPollingInterval: New interval = %d ms\n", milliSeconds);
+    
+    if (!fPollingOverridden) {
+        fPollingIntervalMax = milliSeconds;
+        if (fPollingIntervalMin > fPollingIntervalMax)
+            fPollingIntervalMin = fPollingIntervalMax;
+    }
+}
+
+// stronger of two poll paths (for merging deferred or queued polls); a
+// retry is covered by a full read, and by no less than that if merged
+// with a status read
+static int mergePollPath(int path, int other)
+{
+    if (kNewBatteryPath == path || kNewBatteryPath == other)
+        return kNewBatteryPath;
+    if (kExistingBatteryPath == path || kExistingBatteryPath == other)
+        return kExistingBatteryPath;
+    if (path != other)
+        return kExistingBatteryPath;
+    return path;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::pollBatteryState
+ *
+ * Asynchronously kicks off the register poll: plans which ACPI methods to
+ * read and hands them to the manager. completeBatteryRead decodes them.
+ ******************************************************************************/
+
+bool AppleSmartBattery::pollBatteryState(int path)
+{
+    DebugLog("pollBatteryState: path = %d\n", path);
+
+    // Ignore calls to pollBatteryState before first timer has expired
+    if (!fFirstTimer)
+    {
+        DebugLog("pollBatteryState: doing nothing due to !fFirstTimer\n");
+        return false;
+    }
+
+    // This must be called under workloop synchronization
+
+    // one read at a time; whatever comes in meanwhile runs right after it
+    if (fReadInFlight)
+    {
+        fQueuedPath = fQueuedPath ? mergePollPath(path, fQueuedPath) : path;
+        return true;
+    }
+
+    uint64_t holdStart = GetUptimeUS();
+    fRead.methods = 0;
+    fRead.bulkFlags = 0;
+    fRead.methodTimeout = fMethodTimeout;
+    fRead.cancelled = false;
+    fRead.notifyTime = fProvider->takeNotifyTime();
+    fReadTimedOut = false;
+    fReadPath = path;
+    // a read queued before sleep that this one covers
+    if (fQueuedPath && mergePollPath(path, fQueuedPath) == path)
+        fQueuedPath = 0;
+    fReadRefresh = false;
+    fReadSkipped[0] = 0;
+    fReadSkippedCount = 0;
+
+    if (kStatusOnlyBatteryPath == path)
+    {
+        // status only: presence, static info and extra info are unchanged
+        if (fBatteryPresent)
+            fRead.methods = fProvider->batteryStatusMethods();
+    }
+    else if (kRetryBatteryPath == path)
+    {
+        // only what failed, per method (BALL already fell back when it failed)
+        fRead.methods = fRetryMethods & ~ACPIMethodBit(kACPIMethodBALL);
+        if ((fRead.methods & ACPIMethodBit(kACPIMethodBIX)) && !fProvider->isACPIMethodUsable(kACPIMethodBIX)
+            && fProvider->hasACPIMethod(kACPIMethodBIF))
+            fRead.methods ^= ACPIMethodBit(kACPIMethodBIX) | ACPIMethodBit(kACPIMethodBIF);
+        if (!fProvider->isACPIMethodUsable(kACPIMethodBBIX))
+            fRead.methods &= ~ACPIMethodBit(kACPIMethodBBIX);
+        if (!fProvider->isACPIMethodUsable(kACPIMethodSBS))
+            fRead.methods &= ~ACPIMethodBit(kACPIMethodSBS);
+        if ((fRead.methods & ACPIMethodBit(kACPIMethodEC)) && !fProvider->isACPIMethodUsable(kACPIMethodEC))
+            fRead.methods = (fRead.methods & ~ACPIMethodBit(kACPIMethodEC)) | ACPIMethodBit(kACPIMethodBST);
+        fReadRefresh = fRetryRefresh;
+        fRetryMethods = 0;
+        fRetryRefresh = false;
+    }
+    else
+    {
+        // regular polls read the optional methods only for wanted fields;
+        // a new battery/wake/startup read always gets everything
+        bool everything = kNewBatteryPath == path;
+
+        // presence and static info are cached: re-read only for a new battery,
+        // wake, Notify 0x81 or the refresh interval
+        fReadRefresh = everything || isStaticInfoStale();
+        if (fReadRefresh)
+            fStaticExtraPending = true;
+
+        // while a breaker is open _BIX falls back to _BIF
+        bool extended = fUseBatteryExtendedInformation
+            && (fProvider->isACPIMethodUsable(kACPIMethodBIX) || !fProvider->hasACPIMethod(kACPIMethodBIF));
+
+        bool readSTA = fReadRefresh || !fBatteryPresent || fProvider->notifySTAPending();
+        UInt32 info = ACPIMethodBit(extended ? kACPIMethodBIX : kACPIMethodBIF);
+
+        fRead.methods = fProvider->batteryStatusMethods();
+        if (readSTA)
+            fRead.methods |= ACPIMethodBit(kACPIMethodSTA);
+        if (fReadRefresh || (fDemandDriven && isInterested(kInterestGroupInformation)))
+            fRead.methods |= info;
+
+        // BBIX and SBS (and _BIF/_BIX between refreshes) only for fields routed to them
+        routeFields(everything, extended ? kACPIMethodBIX : kACPIMethodBIF);
+        bool readInfo = fRead.methods & info;
+        bool readExtra = fRead.methods & ACPIMethodBit(kACPIMethodBBIX);
+        if (!readInfo)
+        {
+            strlcat(fReadSkipped, extended ? "_BIX " : "_BIF ", sizeof(fReadSkipped));
+            ++fReadSkippedCount;
+        }
+        if (!readExtra && fUseBatteryExtraInformation)
+        {
+            strlcat(fReadSkipped, "BBIX ", sizeof(fReadSkipped));
+            ++fReadSkippedCount;
+        }
+        if (!(fRead.methods & ACPIMethodBit(kACPIMethodSBS)) && fUseSmartBatterySystem)
+        {
+            strlcat(fReadSkipped, "SBS ", sizeof(fReadSkipped));
+            ++fReadSkippedCount;
+        }
+
+        // with the bulk method, all of the above plus _BST is a single AML
+        // entry; the per-method reads are the fallback if it fails
+        if (useBulkMethod() && (readSTA || readInfo || readExtra))
+        {
+            fRead.methods |= ACPIMethodBit(kACPIMethodBALL);
+            if (readInfo)
+                fRead.bulkFlags |= extended ? BALL_WANT_BIX : BALL_WANT_BIF;
+            if (readExtra)
+                fRead.bulkFlags |= BALL_WANT_BBIX;
+        }
+    }
+
+    fReadInFlight = true;
+    fGateHoldDispatch = (uint32_t)(GetUptimeUS() - holdStart);
+    // the workloop can only watch a read it isn't blocked in
+    if (fMethodTimeout && fReadTimer)
+        fReadTimer->setTimeoutMS(fMethodTimeout * __builtin_popcount(fRead.methods) + kReadWatchdogSlack);
+    fProvider->startBatteryRead(&fRead);
+    return true;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::completeBatteryRead
+ *
+ * Second half of pollBatteryState, once the manager has evaluated the
+ * methods: decode, update derived state and schedule the next poll.
+ * Caller must hold the gate.
+ ******************************************************************************/
+
+void AppleSmartBattery::completeBatteryRead(void)
+{
+    uint64_t holdStart = GetUptimeUS();
+    fReadInFlight = false;
+    if (fReadTimer)
+        fReadTimer->cancelTimeout();
+    if (fReadBurst)
+    {
+        completeBurstRead();
+        return;
+    }
+
+    bool applied = fProvider->applyBatteryRead(&fRead);
+    fACPIReadTimeLast = fRead.ioTime;
+    if (fACPIReadTimeLast > fACPIReadTimeMax)
+        fACPIReadTimeMax = fACPIReadTimeLast;
+    if (!applied)
+    {
+        fWatchdogPending = false;
+        if (fReadTimedOut)
+        {
+            // hung read finally returned: the state from before it is kept
+            fReadTimedOut = false;
+            if (int path = fQueuedPath)
+            {
+                fQueuedPath = 0;
+                pollBatteryState(path);
+            }
+            else
+                scheduleReadRetry(fRead.methods & ~ACPIMethodBit(kACPIMethodBALL), true);
+            return;
+        }
+        // sleep or stop: the read is queued again for when the system is back
+        // up (dropped if the wake read covers it), and fresh-read waiters
+        // fail now instead of sleeping through it
+        DebugLog("completeBatteryRead: read cancelled\n");
+        fQueuedPath = fQueuedPath ? mergePollPath(fReadPath, fQueuedPath) : fReadPath;
+        cancelFreshReads();
+        return;
+    }
+
+    fLastPollEvaluations = __builtin_popcount(fRead.evaluated);
+    if (kStatusOnlyBatteryPath != fReadPath)
+    {
+        if (fRead.evaluated & ACPIMethodBit(kACPIMethodBALL))
+        {
+            // its breaker takes polls back to per-method reads after repeated failures
+            if (fRead.failed & ACPIMethodBit(kACPIMethodBALL))
+                DebugLog("BALL failed (flags 0x%x), fell back to per-method reads\n", (unsigned)fRead.bulkFlags);
+            else
+                ++fBulkPolls;
+        }
+
+        if (fBatteryPresent && fDormant)
+        {
+            AlwaysLog("Battery present, leaving dormant state\n");
+            fDormant = false;
+            setProperty("Dormant", false);
+        }
+        if (fBatteryPresent)
+        {
+            UInt32 info = ACPIMethodBit(kACPIMethodBIF) | ACPIMethodBit(kACPIMethodBIX);
+            if (fReadRefresh && (fRead.methods & info) && !(fRead.failed & info))
+            {
+                fStaticInfoTime = GetUptimeMS();
+                ++fStaticInfoRefreshes;
+            }
+            fSkippedEvaluations += fReadSkippedCount;
+            // after _BIX, so requests can be clamped to the declared bounds
+            if (fNegotiateAveraging)
+                negotiateAveraging();
+        }
+        else if (!fDormant)
+        {
+            //rehabman: added to correct power source Battery if boot w/ no batteries
+            DebugLog("!fBatteryPresent\n");
+            setFullyCharged(false);
+            clearBatteryState(true);
+
+            // past the startup polls (slow ACPI may not report the battery yet),
+            // stop polling until Notify or the sanity check
+            if (!fStartupFastPoll && !fInitialPollCountdown)
+            {
+                AlwaysLog("No battery present, dormant until Notify\n");
+                fDormant = true;
+                ++fDormantEntries;
+                setProperty("Dormant", true);
+            }
+        }
+
+        if (fDemandDriven && kRetryBatteryPath != fReadPath)
+            setProperty("Skipped Methods", fBatteryPresent ? fReadSkipped : "");
+        if (fBatteryPresent)
+            publishFieldRouting();
+    }
+
+    // a failed method keeps its previous values and is retried on its own;
+    // a failed BALL already fell back to the per-method reads
+    UInt32 failed = fRead.failed & ~ACPIMethodBit(kACPIMethodBALL);
+    if (failed)
+    {
+        ++fFailedReads;
+        logReadError(fRead.timedOut ? kErrorMethodTimeout : kErrorMethodFailed, (uint16_t)failed, NULL);
+        scheduleReadRetry(failed, false);
+    }
+    else if (fRetryMethods && !(fRetryMethods &= ~fRead.methods))
+    {
+        // a later read covered everything a retry was pending for
+        fRetryTimer->cancelTimeout();
+        fRetryRefresh = false;
+    }
+    if (!failed && !fRetryMethods)
+    {
+        fReadRetries = 0;
+        fIncompleteReadRetries = 0;
+    }
+
+    fPollEvaluations += fLastPollEvaluations;
+    // the state is fresh only if this read got battery status (_BST, the EC
+    // registers or a complete BALL; either of a cross-checked pair will do)
+    // or found no battery; readers with a max age wait for the retry rather
+    // than get an old _BST, and a read of only static info doesn't count
+    UInt32 succeeded = fRead.evaluated & ~fRead.failed;
+    bool status = (succeeded & (ACPIMethodBit(kACPIMethodBST) | ACPIMethodBit(kACPIMethodEC) | ACPIMethodBit(kACPIMethodBALL)))
+                  || (!fBatteryPresent && (succeeded & ACPIMethodBit(kACPIMethodSTA)));
+    if (status)
+        noteSampleTime();
+    checkACTransition();
+    schedulePoll();
+    checkNotifyWatchdog();
+    fNotifiesSinceRead = 0;
+
+    // what the workloop was blocked for: with async reads the ACPI I/O isn't part of it
+    fGateHoldLast = fGateHoldDispatch + (uint32_t)(GetUptimeUS() - holdStart);
+    if (!fRead.async)
+        fGateHoldLast += fRead.ioTime;
+    if (fGateHoldLast > fGateHoldMax)
+        fGateHoldMax = fGateHoldLast;
+
+    if (int path = fQueuedPath)
+    {
+        fQueuedPath = 0;
+        pollBatteryState(path);
+    }
+}
+
+/******************************************************************************
+ * AppleSmartBattery::requestBatteryPoll
+ *
+ * Run a poll through the manager's ACPI governor. A refused poll is kept
+ * pending (merged with any poll already pending) and retried from the poll
+ * timer once the budget allows. Caller must hold the gate.
+ ******************************************************************************/
+
+bool AppleSmartBattery::requestBatteryPoll(int path, int priority)
+{
+    if (fPendingPath)
+    {
+        path = mergePollPath(path, fPendingPath);
+        if (fPendingPriority > priority)
+            priority = fPendingPriority;
+    }
+
+    uint32_t retry = 0;
+    if (!fFirstTimer || fProvider->requestACPIBudget(priority, pollCost(path), &retry))
+    {
+        fPendingPath = 0;
+        fPendingPriority = kACPIPriorityTimer;
+        return pollBatteryState(path);
+    }
+
+    DebugLog("requestBatteryPoll: path %d deferred %ums by governor\n", path, (unsigned)retry);
+    if (fPendingPath)
+        fProvider->noteACPIRequestMerged();
+    fPendingPath = path;
+    fPendingPriority = priority;
+
+    // retry when the budget allows, unless the timer fires sooner anyway
+    if (!fPollDeadline || GetUptimeMS() + retry < fPollDeadline)
+        armPollTimer(retry);
+    return false;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::pollCost
+ *
+ * Number of ACPI evaluations a poll on this path makes.
+ ******************************************************************************/
+
+UInt32 AppleSmartBattery::pollCost(int path)
+{
+    if (kRetryBatteryPath == path)
+        return __builtin_popcount(fRetryMethods & ~ACPIMethodBit(kACPIMethodBALL));
+    if (kStatusOnlyBatteryPath == path || useBulkMethod())
+        return 1;
+    // _BST (+ _STA and _BIF/_BIX on refresh, BBIX when read)
+    bool refresh = kNewBatteryPath == path || isStaticInfoStale();
+    UInt32 cost = 1;
+    if (refresh || !fBatteryPresent)
+        ++cost;
+    if (refresh || (fDemandDriven && isInterested(kInterestGroupInformation)))
+        ++cost;
+    if (fUseBatteryExtraInformation && (kNewBatteryPath == path || isInterested(kInterestGroupExtra)))
+        ++cost;
+    return cost;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::isStaticInfoStale
+ *
+ * Model, serial, type, OEM and design values don't change while a battery
+ * stays inserted; the firmware signals anything else with Notify 0x81.
+ ******************************************************************************/
+
+bool AppleSmartBattery::isStaticInfoStale(void)
+{
+    if (!fStaticInfoTime)
+        return true;
+    return fStaticInfoRefreshInterval && GetUptimeMS() - fStaticInfoTime >= fStaticInfoRefreshInterval;
+}
+
+bool AppleSmartBattery::useBulkMethod(void)
+{
+    return fUseBatteryBulkInformation && fProvider->isACPIMethodUsable(kACPIMethodBALL);
+}
+
+void AppleSmartBattery::invalidateStaticInfo(void)
+{
+    DebugLog("invalidateStaticInfo called\n");
+
+    // This must be called under workloop synchronization
+    fStaticInfoTime = 0;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::pollingIntervalFloor
+ *
+ * Shortest useful interval: polling faster than the firmware's minimum
+ * sampling time (_BIX) or averaging window (_BMA) only returns duplicates.
+ ******************************************************************************/
+
+uint32_t AppleSmartBattery::pollingIntervalFloor(void)
+{
+    return pollIntervalFloor(fPollingIntervalMin, fPollingIntervalMax, fMinSamplingTime,
+                             fAveragingInterval, fECRefresh.lockedPeriod());
+}
+
+/******************************************************************************
+ * AppleSmartBattery::nextPollingInterval
+ *
+ * Pick the time until the next poll from the state of the last sample (see
+ * pollIntervalForState), then keep it off the floor and in phase with the
+ * EC refresh.
+ ******************************************************************************/
+
+uint32_t AppleSmartBattery::nextPollingInterval(void)
+{
+    // at startup, polling is quick for slow to respond ACPI implementations
+    if (fStartupFastPoll)
+    {
+        DebugLog("fStartupFastPoll=%d\n", fStartupFastPoll);
+        --fStartupFastPoll;
+        return fPollingIntervalMin;
+    }
+
+    // inflow disabled discharge on AC (see setBatteryBST)
+    if (!fBatteryPresent)
+        return fPollingIntervalMax;
+    if (fQuickPoll)
+    {
+        uint32_t floor = pollingIntervalFloor();
+        return fECRefresh.align(GetUptimeMS(), floor, floor, fPollingIntervalMax);
+    }
+
+    // firmware notifies on every change; the timer is only a watchdog
+    if (fNotifyDriven)
+    {
+        fLastSampleTime = GetUptimeMS();
+        fLastSampleCapacity = fCurrentCapacity;
+        fLastSampleRate = fCurrentRate;
+        return fNotifyWatchdogInterval;
+    }
+
+    uint64_t now = GetUptimeMS();
+    PollState state = { fStatus, fCurrentRate, fAverageRate, fCurrentCapacity, fMaxCapacity,
+                        fCapacityWarning, fLowWarning, fTripPoint };
+    PollSample last = { fLastSampleTime, fLastSampleCapacity, fLastSampleRate };
+    uint64_t interval = pollIntervalForState(state, last, now, fPollingIntervalMax);
+
+    fLastSampleTime = now;
+    fLastSampleCapacity = fCurrentCapacity;
+    fLastSampleRate = fCurrentRate;
+
+    uint32_t floor = pollingIntervalFloor();
+    interval = clampPollInterval(interval, floor, fPollingIntervalMax);
+    interval = fECRefresh.align(now, (uint32_t)interval, floor, fPollingIntervalMax);
+
+    DebugLog("nextPollingInterval: fACConnected=%d, fStatus=0x%x, interval=%u\n", fACConnected, (unsigned)fStatus, (unsigned)interval);
+    return (uint32_t)interval;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::schedulePoll
+ *
+ * Re-arm the poll timer. Caller must hold the gate.
+ ******************************************************************************/
+
+void AppleSmartBattery::schedulePoll(void)
+{
+    // poll ran ahead of a pending timer that would have fired within its
+    // leeway anyway: the timer wakeup was folded into this one
+    uint64_t now = GetUptimeMS();
+    if (fPollDeadline && now + fPollLeeway >= fPollDeadline)
+        ++fPollsAheadOfTimer;
+    fPollDeadline = 0;
+
+    fPollTimer->cancelTimeout();
+    if (fPollingOverridden)
+    {
+        // restart timer with debug value
+        fPollTimer->setTimeoutMS(1000 * fPollingInterval);
+        return;
+    }
+
+    if (fDormant)
+    {
+        // no battery: no periodic ACPI traffic beyond the sanity check
+        setProperty("PollingInterval_msec", fBatteryAbsentCheckInterval, NUM_BITS);
+        if (fBatteryAbsentCheckInterval)
+            armPollTimer(fBatteryAbsentCheckInterval);
+        publishPollStatistics();
+        return;
+    }
+
+    uint32_t interval = nextPollingInterval();
+    setProperty("PollingInterval_msec", interval, NUM_BITS);
+    armPollTimer(interval);
+    publishPollStatistics();
+}
+
+/******************************************************************************
+ * AppleSmartBattery::armPollTimer
+ *
+ * Arm the poll timer with leeway so the kernel can coalesce it with other
+ * pending wakeups instead of waking the CPU at an exact deadline.
+ ******************************************************************************/
+
+void AppleSmartBattery::armPollTimer(uint32_t milliSeconds)
+{
+    // the burst timer drives reads until the burst ends
+    if (fBurstActive)
+        return;
+
+    uint64_t interval, leeway;
+    fPollLeeway = (uint64_t)milliSeconds * fPollingLeewayPercent / 100;
+    fPollDeadline = GetUptimeMS() + milliSeconds;
+
+    nanoseconds_to_absolutetime((uint64_t)milliSeconds * 1000000, &interval);
+    nanoseconds_to_absolutetime(fPollLeeway * 1000000, &leeway);
+    fPollTimer->cancelTimeout();
+    fPollTimer->setTimeout(kIOTimeOptionsWithLeeway, interval, leeway);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::publishPollStatistics
+ *
+ ******************************************************************************/
+
+void AppleSmartBattery::publishPollStatistics(void)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(2);
+    if (!dict)
+        return;
+
+    struct { const char* key; uint32_t value; } stats[] =
+    {
+        { "LateWakeups", fLateWakeups },
+        { "OnTimeWakeups", fOnTimeWakeups },
+        { "PollsAheadOfTimer", fPollsAheadOfTimer },
+        { "SuppressedPublishes", fSuppressedPublishes },
+        { "DarkWakeFastPaths", fDarkWakeFastPaths },
+        { "Notifies", fNotifies },
+        { "NotifiesLastInterval", fNotifiesLastInterval },
+        { "MissedNotifies", fMissedNotifies },
+        { "ECRefreshPeriod", fECRefresh.lockedPeriod() },
+        { "BSTSamples", fECRefresh.samples },
+        { "BSTDuplicates", fECRefresh.duplicates },
+        { "BSTDuplicatePercent", fECRefresh.samples ? (uint32_t)((uint64_t)fECRefresh.duplicates * 100 / fECRefresh.samples) : 0 },
+        { "ACTransitions", fACTransitions },
+        { "ACTransitionLatency", fACTransitionLatency },
+        { "ACTransitionLatencyMax", fACTransitionLatencyMax },
+        { "ACTransitionTimeouts", fACTransitionTimeouts },
+        { "DormantEntries", fDormantEntries },
+        { "SkippedEvaluations", fSkippedEvaluations },
+        { "StaticInfoRefreshes", fStaticInfoRefreshes },
+        { "LastPollEvaluations", fLastPollEvaluations },
+        { "PollEvaluations", fPollEvaluations },
+        { "BulkPolls", fBulkPolls },
+        { "GateHoldLast", fGateHoldLast },
+        { "GateHoldMax", fGateHoldMax },
+        { "ACPIReadTimeLast", fACPIReadTimeLast },
+        { "ACPIReadTimeMax", fACPIReadTimeMax },
+        { "CancelledReads", fCancelledReads },
+        { "FailedReads", fFailedReads },
+        { "RetriedReads", fRetriedReads },
+        { "RetriesExhausted", fRetriesExhausted },
+        { "IncompleteReads", fIncompleteReads },
+        { "FreshReads", fFreshReads },
+        { "FreshReadPolls", fFreshReadPolls },
+        { "FreshReadWaits", fFreshReadWaits },
+        { "FreshReadTimeouts", fFreshReadTimeouts },
+    };
+    for (unsigned i = 0; i < sizeof(stats)/sizeof(stats[0]); i++)
+    {
+        if (OSNumber* num = OSNumber::withNumber(stats[i].value, NUM_BITS))
+        {
+            dict->setObject(stats[i].key, num);
+            num->release();
+        }
+    }
+    setProperty("Poll Statistics", dict);
+    dict->release();
+}
+
+void AppleSmartBattery::handleBatteryInserted()
+{
+    DebugLog("handleBatteryInserted called\n");
+    
+    // This must be called under workloop synchronization; the Notify that
+    // found the change was counted by handleBatteryNotify. Called while that
+    // read completes (see applyBatteryRead), so the new battery read runs
+    // right after it.
+    fNegotiateAveraging = true;
+    fQueuedPath = kNewBatteryPath;
+}
+
+void AppleSmartBattery::handleBatteryRemoved()
+{
+    DebugLog("handleBatteryRemoved called\n");
+    
+    // This must be called under workloop synchronization; as for
+    // handleBatteryInserted, from the read that found the change
+    fQueuedPath = kNewBatteryPath;
+}
+
+void AppleSmartBattery::handleBatteryNotify()
+{
+    DebugLog("handleBatteryNotify called\n");
+
+    // This must be called under workloop synchronization
+    ++fNotifies;
+    ++fNotifiesThisInterval;
+    ++fNotifiesSinceRead;
+    requestBatteryPoll(kExistingBatteryPath, kACPIPriorityNotify);
+}
+
+/*****************************************************************************
+ * AppleSmartBattery::notifyConnectedState
+ * Cause a fresh battery poll in workloop to check AC status. Called from
+ * the AC adapter's workloop, so the state change is made under our gate.
+ ******************************************************************************/
+
+void AppleSmartBattery::notifyConnectedState(bool connected)
+{
+    if (fCommandGate)
+        fCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &AppleSmartBattery::gatedNotifyConnectedState), (void*)(uintptr_t)connected);
+}
+
+IOReturn AppleSmartBattery::gatedNotifyConnectedState(bool connected)
+{
+    if (externalConnected() != connected) {
+        DebugLog("notifyConnected: AC power state changed: %d\n", connected);
+
+        setExternalConnected(connected);
+        settingsChangedSinceUpdate = true;
+        updateStatus();
+    }
+
+    if (fACConnected != connected && fBatteryPresent && fACSettleTimer)
+    {
+        // give the charger time to switch over, then read _BST only
+        fACChangeTime = GetUptimeMS();
+        fACSettleAttempts = 0;
+        fACSettleTimer->setTimeoutMS(fACSettleDelay);
+    }
+
+    fACConnected = connected;
+    return kIOReturnSuccess;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::acSettleTimeOut
+ *
+ * Targeted _BST read after AC plug/unplug. The read re-arms the regular
+ * poll timer, so the normal scheduler resumes from there.
+ ******************************************************************************/
+
+void AppleSmartBattery::acSettleTimeOut(void)
+{
+    DebugLog("acSettleTimeOut called\n");
+
+    if (fACChangeTime)
+        requestBatteryPoll(kStatusOnlyBatteryPath, kACPIPriorityNotify);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::checkACTransition
+ *
+ * After a read, see whether _BST reflects the last AC change yet (charging
+ * or idle on AC, discharging off AC) and record how long that took.
+ * Caller must hold the gate.
+ ******************************************************************************/
+
+void AppleSmartBattery::checkACTransition(void)
+{
+    if (!fACChangeTime)
+        return;
+
+    bool discharging = fStatus & BATTERY_DISCHARGING;
+    if (fBatteryPresent && fACConnected == discharging)
+    {
+        if (++fACSettleAttempts < kACSettleAttempts)
+        {
+            fACSettleTimer->setTimeoutMS(fACSettleDelay);
+            return;
+        }
+        DebugLog("checkACTransition: _BST did not follow AC change\n");
+        ++fACTransitionTimeouts;
+    }
+    else
+    {
+        uint64_t latency = GetUptimeMS() - fACChangeTime;
+        fACTransitionLatency = (uint32_t)latency;
+        if (fACTransitionLatency > fACTransitionLatencyMax)
+            fACTransitionLatencyMax = fACTransitionLatency;
+        ++fACTransitions;
+    }
+    fACChangeTime = 0;
+    fACSettleTimer->cancelTimeout();
+}
+
+/******************************************************************************
+ * AppleSmartBattery::setProperties
+ *
+ * Requests from user space (IORegistryEntrySetCFProperties).
+ ******************************************************************************/
+
+IOReturn AppleSmartBattery::setProperties(OSObject* properties)
+{
+    OSDictionary* dict = OSDynamicCast(OSDictionary, properties);
+    if (!dict)
+        return kIOReturnBadArgument;
+
+    IOReturn result = kIOReturnUnsupported;
+    if (OSNumber* seconds = OSDynamicCast(OSNumber, dict->getObject(kBurstSampleSecondsKey)))
+    {
+        result = IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator);
+        if (kIOReturnSuccess != result)
+            return result;
+        result = fCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &AppleSmartBattery::startBurstSampling), (void*)(uintptr_t)seconds->unsigned32BitValue());
+    }
+    return result;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::readWithMaxAge
+ *
+ * Battery state no older than maxAgeMS. A fresh enough sample is returned
+ * right away; otherwise one poll is run, and callers arriving while it is
+ * deferred by the governor wait for that same poll instead of adding their
+ * own. Waits are bounded by kFreshReadTimeout. Only administrators poll
+ * at Notify priority; anyone else is admitted by the governor like a timer
+ * poll, so a user client cannot spend the Notify reserve.
+ ******************************************************************************/
+
+IOReturn AppleSmartBattery::readWithMaxAge(uint32_t maxAgeMS, BatterySnapshot* snapshot)
+{
+    if (!fCommandGate || !snapshot)
+        return kIOReturnBadArgument;
+    int priority = kACPIPriorityTimer;
+    if (kIOReturnSuccess == IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator))
+        priority = kACPIPriorityNotify;
+    return fCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &AppleSmartBattery::gatedReadWithMaxAge),
+                                   (void*)(uintptr_t)maxAgeMS, snapshot, (void*)(intptr_t)priority);
+}
+
+IOReturn AppleSmartBattery::gatedReadWithMaxAge(uint32_t maxAgeMS, BatterySnapshot* snapshot, int priority)
+{
+    uint64_t now = GetUptimeMS();
+    uint64_t oldest = now > maxAgeMS ? now - maxAgeMS : 0;
+    ++fFreshReads;
+
+    if (!fSampleTime || fSampleTime < oldest)
+    {
+        // a poll still pending from the governor (or before the first timer)
+        // is shared, merged with a status read; a read in flight may not get
+        // status (a retry of _BIX/BBIX only, a failed _BST), so a status
+        // read is queued behind it
+        int path = fBatteryPresent ? kStatusOnlyBatteryPath : kExistingBatteryPath;
+        if (!fFirstTimer)
+            ++fFreshReadWaits;
+        else if (fReadInFlight)
+        {
+            ++fFreshReadWaits;
+            fQueuedPath = fQueuedPath ? mergePollPath(path, fQueuedPath) : path;
+        }
+        else
+        {
+            if (fPendingPath)
+                ++fFreshReadWaits;
+            else
+                ++fFreshReadPolls;
+            requestBatteryPoll(path, priority);
+        }
+
+        uint64_t deadline;
+        clock_interval_to_deadline(kFreshReadTimeout, kMillisecondScale, &deadline);
+        uint32_t cancelledReads = fCancelledReads;
+        while (!fSampleTime || fSampleTime < oldest)
+        {
+            int wait = fCommandGate->commandSleep(&fSampleTime, deadline, THREAD_ABORTSAFE);
+            if (THREAD_INTERRUPTED == wait)
+                return kIOReturnAborted;    // caller's thread aborted, not a slow EC
+            if (fCancelledReads != cancelledReads)
+                return kIOReturnAborted;    // read cancelled by sleep or stop
+            if (THREAD_AWAKENED != wait)
+            {
+                ++fFreshReadTimeouts;
+                return kIOReturnTimeout;
+            }
+        }
+    }
+
+    snapshot->time = fSampleTime;
+    snapshot->age = GetUptimeMS() - fSampleTime;
+    snapshot->present = fBatteryPresent;
+    snapshot->acConnected = fACConnected;
+    snapshot->status = fStatus;
+    snapshot->currentRate = fCurrentRate;
+    snapshot->averageRate = fAverageRate;
+    snapshot->currentCapacity = fCurrentCapacity;
+    snapshot->maxCapacity = fMaxCapacity;
+    snapshot->designCapacity = fDesignCapacity;
+    snapshot->voltage = fCurrentVoltage;
+    snapshot->reserved = 0;
+    return kIOReturnSuccess;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::cancelFreshReads
+ * Fail readers waiting in gatedReadWithMaxAge now (read cancelled by sleep,
+ * or stop) instead of letting them sleep through it. Caller must hold the gate.
+ ******************************************************************************/
+
+void AppleSmartBattery::cancelFreshReads(void)
+{
+    ++fCancelledReads;
+    if (fCommandGate)
+        fCommandGate->commandWakeup(&fSampleTime);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::noteSampleTime
+ *
+ * Stamp the state just read from ACPI and release readers waiting for it.
+ * Caller must hold the gate.
+ ******************************************************************************/
+
+void AppleSmartBattery::noteSampleTime(void)
+{
+    fSampleTime = GetUptimeMS();
+    if (fCommandGate)
+        fCommandGate->commandWakeup(&fSampleTime);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::updateInterest
+ *
+ * Count a user client (un)registering interest in a field group. With
+ * DemandDrivenRefresh, regular polls read a group's ACPI method only while
+ * its count is non-zero. Each client drops what it still holds on close.
+ ******************************************************************************/
+
+static const char* interestGroupNames[kInterestGroupCount] =
+{
+    "Information",
+    "Extra",
+};
+
+IOReturn AppleSmartBattery::updateInterest(int group, bool registering)
+{
+    if (group < 0 || group >= kInterestGroupCount)
+        return kIOReturnBadArgument;
+    return fCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &AppleSmartBattery::gatedUpdateInterest),
+                                   (void*)(uintptr_t)group, (void*)registering);
+}
+
+IOReturn AppleSmartBattery::gatedUpdateInterest(int group, bool registering)
+{
+    if (registering)
+        ++fInterestCount[group];
+    else if (fInterestCount[group])
+        --fInterestCount[group];
+    else
+        return kIOReturnNotFound;
+    publishInterest();
+    return kIOReturnSuccess;
+}
+
+bool AppleSmartBattery::isInterested(int group)
+{
+    return !fDemandDriven || fInterestCount[group];
+}
+
+void AppleSmartBattery::publishInterest(void)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(kInterestGroupCount);
+    if (!dict)
+        return;
+    for (int i = 0; i < kInterestGroupCount; i++)
+    {
+        if (OSNumber* num = OSNumber::withNumber(fInterestCount[i], NUM_BITS))
+        {
+            dict->setObject(interestGroupNames[i], num);
+            num->release();
+        }
+    }
+    setProperty("Interest", dict);
+    dict->release();
+}
+
+/******************************************************************************
+ * AppleSmartBattery::routeFields
+ *
+ * One source per routed field for this poll, instead of every method that
+ * has it publishing in turn. A method the poll reads anyway costs nothing
+ * extra, so a field goes to the cheapest of those by recent latency; only
+ * a field past its max age gets a method added just for it. Single-source
+ * fields go first so the others can share what they add. A method left
+ * without fields is not read. Caller must hold the gate.
+ ******************************************************************************/
+
+static int cheapestMethod(AppleSmartBatteryManager* manager, UInt32 methods, UInt32 probed)
+{
+    int cheapest = -1;
+    uint32_t cheapestLatency = 0;
+    for (int i = 0; i < kACPIMethodCount; i++)
+    {
+        if (!(methods & ACPIMethodBit(i)))
+            continue;
+        // never measured: first pick once so it gets measured, then last
+        uint32_t latency = manager->getACPIMethodLatency(i);
+        if (!latency && (probed & ACPIMethodBit(i)))
+            latency = UINT32_MAX;
+        if (cheapest < 0 || latency < cheapestLatency)
+        {
+            cheapest = i;
+            cheapestLatency = latency;
+        }
+    }
+    return cheapest;
+}
+
+void AppleSmartBattery::routeFields(bool everything, int infoMethod)
+{
+    UInt32 usable = ACPIMethodBit(infoMethod);
+    if (fUseBatteryExtraInformation && fProvider->isACPIMethodUsable(kACPIMethodBBIX))
+        usable |= ACPIMethodBit(kACPIMethodBBIX);
+    if (fUseSmartBatterySystem && fProvider->isACPIMethodUsable(kACPIMethodSBS))
+        usable |= ACPIMethodBit(kACPIMethodSBS);
+    // Voltage: whichever status method this poll reads
+    usable |= fRead.methods & kStatusMethods;
+
+    uint64_t now = GetUptimeMS();
+    UInt32 wanted[kRoutedFieldCount];
+    for (int i = 0; i < kRoutedFieldCount; i++)
+    {
+        // a new battery may provide what the last one didn't
+        if (everything)
+            fFieldSources[i] = routedFields[i].sources;
+        fFieldRoute[i] = -1;
+        wanted[i] = 0;
+        int group = routedFields[i].group;
+        if (everything || group < 0 || isInterested(group))
+            wanted[i] = fFieldSources[i] & usable;
+    }
+
+    for (int count = 1; count <= kACPIMethodCount; count++)
+    {
+        for (int i = 0; i < kRoutedFieldCount; i++)
+        {
+            if (__builtin_popcount(wanted[i]) != count || (wanted[i] & fRead.methods))
+                continue;
+            if (everything || !fFieldTime[i] || now - fFieldTime[i] >= fFieldMaxAge[i])
+                fRead.methods |= ACPIMethodBit(cheapestMethod(fProvider, wanted[i], fLatencyProbed));
+        }
+    }
+    for (int i = 0; i < kRoutedFieldCount; i++)
+    {
+        if (UInt32 reading = wanted[i] & fRead.methods)
+            fFieldRoute[i] = cheapestMethod(fProvider, reading, fLatencyProbed);
+    }
+    fLatencyProbed |= fRead.methods;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::acceptField
+ * For the setBatteryXXX methods: true if this poll routed field to method
+ ******************************************************************************/
+
+bool AppleSmartBattery::acceptField(int field, int method)
+{
+    if (fFieldRoute[field] != method)
+        return false;
+    fFieldTime[field] = GetUptimeMS();
+    return true;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::publishFieldRouting
+ * "Field Routing": Source, Age and MaxAge per field, and the measured
+ * Latency (us) of each source
+ ******************************************************************************/
+
+void AppleSmartBattery::publishFieldRouting(void)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(kRoutedFieldCount + 1);
+    OSDictionary* latency = OSDictionary::withCapacity(4);
+    if (!dict || !latency)
+    {
+        OSSafeReleaseNULL(dict);
+        OSSafeReleaseNULL(latency);
+        return;
+    }
+
+    uint64_t now = GetUptimeMS();
+    UInt32 sources = 0;
+    for (int i = 0; i < kRoutedFieldCount; i++)
     {
-        DebugLog("AppleSmartBattry: setting fFirstTimer=true, and doing immediate poll\n");
-        fFirstTimer = true;
-        pollBatteryState(kNewBatteryPath);
+        sources |= routedFields[i].sources;
+        OSDictionary* field = OSDictionary::withCapacity(3);
+        if (!field)
+            continue;
+        const char* source = fFieldRoute[i] >= 0 ? fProvider->getACPIMethodName(fFieldRoute[i]) : fFieldTime[i] ? "Cached" : "None";
+        if (OSString* str = OSString::withCString(source))
+        {
+            field->setObject("Source", str);
+            str->release();
+        }
+        struct { const char* key; uint32_t value; } stats[] =
+        {
+            { "Age", fFieldTime[i] ? (uint32_t)(now - fFieldTime[i]) : 0 },
+            { "MaxAge", fFieldMaxAge[i] },
+        };
+        for (unsigned j = 0; j < sizeof(stats)/sizeof(stats[0]); j++)
+        {
+            if (OSNumber* num = OSNumber::withNumber(stats[j].value, NUM_BITS))
+            {
+                field->setObject(stats[j].key, num);
+                num->release();
+            }
+        }
+        dict->setObject(routedFields[i].name, field);
+        field->release();
     }
-    else
+    for (int i = 0; i < kACPIMethodCount; i++)
     {
-        DebugLog("AppleSmartBattery: setting fFirstTimer=false, and setting timer for %ums\n", (unsigned)fFirstPollDelay);
-        fFirstTimer = false;
-        fPollTimer->setTimeoutMS(fFirstPollDelay);
+        if (!(sources & ACPIMethodBit(i)) || !fProvider->hasACPIMethod(i))
+            continue;
+        if (OSNumber* num = OSNumber::withNumber(fProvider->getACPIMethodLatency(i), NUM_BITS))
+        {
+            latency->setObject(fProvider->getACPIMethodName(i), num);
+            num->release();
+        }
     }
-    
-    registerService(0);
-
-    return true;
+    dict->setObject("Latency", latency);
+    latency->release();
+    setProperty("Field Routing", dict);
+    dict->release();
 }
 
 /******************************************************************************
- * AppleSmartBattery::stop
+ * AppleSmartBattery::startBurstSampling
  *
+ * Power meter mode: sample _BST rate and voltage as fast as the EC refreshes
+ * it for a number of seconds, into a kernel buffer, integrating the energy.
+ * Regular polling is suspended meanwhile. Each sample is a _BST-only read
+ * through the worker, with the usual method deadline, under its own
+ * governor priority: a burst slows down to what the budget allows after
+ * the Notify reserve instead of running it into debt. Caller must hold
+ * the gate.
  ******************************************************************************/
 
-void AppleSmartBattery::stop(IOService *provider)
-{
-    OSSafeReleaseNULL(fCellVoltages);
+IOReturn AppleSmartBattery::startBurstSampling(uint32_t seconds)
+{
+    if (fBurstActive)
+        return kIOReturnBusy;
+    if (!fBatteryPresent || !fFirstTimer)
+        return kIOReturnNotReady;
+    if (!seconds)
+        return kIOReturnBadArgument;
+    if (seconds > kBurstSecondsMax)
+        seconds = kBurstSecondsMax;
+
+    // no faster than the EC declares (_BIX) or was seen to refresh
+    fBurstInterval = kBurstIntervalMin;
+    if (fMinSamplingTime > fBurstInterval)
+        fBurstInterval = fMinSamplingTime;
+    if (fECRefresh.lockedPeriod() > fBurstInterval)
+        fBurstInterval = fECRefresh.lockedPeriod();
+
+    fBurstCapacity = seconds * 1000 / fBurstInterval + 1;
+    if (fBurstCapacity > kBurstSamplesMax)
+        fBurstCapacity = kBurstSamplesMax;
+    fBurstSamples = (BurstSample*)IOMalloc(fBurstCapacity * sizeof(BurstSample));
+    if (!fBurstSamples)
+        return kIOReturnNoMemory;
+
+    AlwaysLog("Burst sampling for %us every %ums\n", (unsigned)seconds, (unsigned)fBurstInterval);
+    fBurstCount = 0;
+    fBurstTotal = 0;
+    fBurstDuplicates = 0;
+    fBurstDischarged = 0;
+    fBurstCharged = 0;
+    fBurstMissed = 0;
+    fBurstLastTime = 0;
+    fBurstStart = GetUptimeMS();
+    fBurstEnd = fBurstStart + seconds * 1000;
 
-    super::stop(provider);
+    fPollTimer->cancelTimeout();
+    fPollDeadline = 0;
+    fBurstActive = true;
+    setProperty("Burst Sampling", true);
+    burstTimeOut();
+    return kIOReturnSuccess;
 }
 
 /******************************************************************************
- * AppleSmartBattery::logReadError
+ * AppleSmartBattery::burstTimeOut
  *
+ * Start the next burst read, unless a read is still in flight or the
+ * governor refuses it: that sample is missed, and a refusal also pushes
+ * the next one out to when the budget allows.
  ******************************************************************************/
 
-void AppleSmartBattery::logReadError(
-										  const char *error_type, 
-										  uint16_t additional_error,
-										  void *t)
+void AppleSmartBattery::burstTimeOut(void)
 {
-    if(!error_type) return;
-	
-    setProperty((const char *)"LatestErrorType", error_type);
-	
-    AlwaysLog("Error: %s (%d)\n", error_type, additional_error);  
-	
-    return;
+    if (!fBurstActive)
+        return;
+
+    uint64_t now = GetUptimeMS();
+    if (now >= fBurstEnd)
+    {
+        finishBurstSampling(true);
+        return;
+    }
+
+    uint32_t delay = fBurstInterval;
+    uint32_t retry = 0;
+    if (fReadInFlight)
+        ++fBurstMissed;
+    else if (!fProvider->requestACPIBudget(kACPIPriorityBurst, 1, &retry))
+    {
+        ++fBurstMissed;
+        if (retry > delay)
+            delay = retry;
+    }
+    else
+    {
+        fRead.methods = ACPIMethodBit(kACPIMethodBST);
+        fRead.bulkFlags = 0;
+        fRead.methodTimeout = fMethodTimeout;
+        fRead.cancelled = false;
+        fRead.notifyTime = 0;
+        fReadTimedOut = false;
+        fReadBurst = true;
+        fBurstReadTime = now;
+        fReadInFlight = true;
+        if (fMethodTimeout && fReadTimer)
+            fReadTimer->setTimeoutMS(fMethodTimeout + kReadWatchdogSlack);
+        fProvider->startBatteryRead(&fRead);
+    }
+    fBurstTimer->setTimeoutMS(delay);
 }
 
 /******************************************************************************
- * AppleSmartBattery::setPollingInterval
- *
+ * AppleSmartBattery::completeBurstRead
+ * completeBatteryRead for a burst read: record the sample, nothing else
  ******************************************************************************/
 
-void AppleSmartBattery::setPollingInterval(
-												int milliSeconds)
+void AppleSmartBattery::completeBurstRead(void)
 {
-    DebugLog("setPollingInterval: New interval = %d ms\n", milliSeconds);
-    
-    if (!fPollingOverridden) {
-        milliSecPollingTable[kDefaultPollInterval] = milliSeconds;
-        fPollingInterval = kDefaultPollInterval;
+    // sleep or stop: whatever queued up waits for wake, as for a poll
+    bool resume = !fRead.cancelled || fReadTimedOut;
+    fReadBurst = false;
+    fReadTimedOut = false;
+
+    UInt32 status, rate, capacity, voltage;
+    if (kIOReturnSuccess == fProvider->takeBurstSample(&fRead, &status, &rate, &capacity, &voltage) && fBurstActive)
+        recordBurstSample(fBurstReadTime, status, rate, capacity, voltage);
+    else if (fBurstActive)
+        ++fBurstMissed;
+
+    // a poll requested meanwhile (Notify, end of the burst) runs now
+    if (int path = resume ? fQueuedPath : 0)
+    {
+        fQueuedPath = 0;
+        pollBatteryState(path);
     }
 }
 
 /******************************************************************************
- * AppleSmartBattery::pollBatteryState
+ * AppleSmartBattery::recordBurstSample
  *
- * Asynchronously kicks off the register poll.
+ * Store the sample and integrate power over time (trapezoidal) into the
+ * discharged or charged energy.
  ******************************************************************************/
 
-bool AppleSmartBattery::pollBatteryState(int path)
+void AppleSmartBattery::recordBurstSample(uint64_t now, UInt32 status, UInt32 rate, UInt32 capacity, UInt32 voltage)
 {
-    DebugLog("pollBatteryState: path = %d\n", path);
-
-    // Ignore calls to pollBatteryState before first timer has expired
-    if (!fFirstTimer)
+    // corrected before comparing: fBurstLastRate holds the corrected rate
+    if (fCorrect16bitSignedCurrentRate && ACPI_UNKNOWN != rate)
     {
-        DebugLog("pollBatteryState: doing nothing due to !fFirstTimer\n");
-        return false;
+        rate &= 0xFFFF;
+        if (rate & 0x8000)
+            rate = 0xFFFF - rate + 1;
     }
 
-    // This must be called under workloop synchronization
+    bool duplicate = fBurstTotal && status == fBurstLastStatus && rate == fBurstLastRate
+        && capacity == fBurstLastCapacity && voltage == fBurstLastVoltage;
+    ++fBurstTotal;
+    if (duplicate)
+        ++fBurstDuplicates;
 
-    fProvider->getBatterySTA();
-    if (fBatteryPresent)
+    uint32_t power = 0;
+    if (ACPI_UNKNOWN != rate && ACPI_UNKNOWN != voltage)
+        power = WATTS == fPowerUnit ? rate : (uint32_t)((uint64_t)rate * voltage / 1000);
+
+    if (fBurstLastTime && now > fBurstLastTime)
     {
-        if (fUseBatteryExtendedInformation)
-            fProvider->getBatteryBIX();
-        else
-            fProvider->getBatteryBIF();
-        if (fUseBatteryExtraInformation)
-            fProvider->getBatteryBBIX();
-        fProvider->getBatteryBST();
+        // mW * ms / 3600 = uWh
+        uint64_t energy = ((uint64_t)fBurstLastPower + power) / 2 * (now - fBurstLastTime) / 3600;
+        if (status & BATTERY_DISCHARGING)
+            fBurstDischarged += energy;
+        else if (status & BATTERY_CHARGING)
+            fBurstCharged += energy;
     }
-    else
+
+    if (fBurstCount < fBurstCapacity)
     {
-        //rehabman: added to correct power source Battery if boot w/ no batteries
-        DebugLog("!fBatteryPresent\n");
-        setFullyCharged(false);
-        clearBatteryState(true);
+        BurstSample* sample = &fBurstSamples[fBurstCount++];
+        sample->time = now;
+        sample->status = status;
+        sample->rate = rate;
+        sample->voltage = voltage;
+        sample->duplicate = duplicate;
     }
 
-    fPollTimer->cancelTimeout();
-    if (!fPollingOverridden)
+    fBurstLastTime = now;
+    fBurstLastPower = power;
+    fBurstLastStatus = status;
+    fBurstLastRate = rate;
+    fBurstLastCapacity = capacity;
+    fBurstLastVoltage = voltage;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::finishBurstSampling
+ *
+ * Publish the burst as "Burst Sample" and resume regular polling.
+ ******************************************************************************/
+
+void AppleSmartBattery::finishBurstSampling(bool resume)
+{
+    fBurstTimer->cancelTimeout();
+    fBurstActive = false;
+    setProperty("Burst Sampling", false);
+
+    if (OSDictionary* dict = OSDictionary::withCapacity(8))
     {
-        // at startup, polling is quick for slow to respond ACPI implementations
-        if (fStartupFastPoll)
+        if (OSData* samples = OSData::withBytes(fBurstSamples, fBurstCount * sizeof(BurstSample)))
         {
-            DebugLog("fStartupFastPoll=%d\n", fStartupFastPoll);
-            --fStartupFastPoll;
-            if (!fStartupFastPoll)
-                fPollingInterval = kDefaultPollInterval;
+            dict->setObject("Samples", samples);
+            samples->release();
         }
-
-        DebugLog("fACConnected=%d\n", fACConnected);
-        if (fACConnected)
+        struct { const char* key; uint32_t value; } stats[] =
         {
-            // Restart timer with standard polling interval
-            fPollTimer->setTimeoutMS(milliSecPollingTable[fPollingInterval]);
-        }
-        else
+            { "SampleCount", fBurstTotal },
+            { "Duplicates", fBurstDuplicates },
+            { "Missed", fBurstMissed },
+            { "Interval_msec", fBurstInterval },
+            { "Duration_msec", (uint32_t)(fBurstLastTime > fBurstStart ? fBurstLastTime - fBurstStart : 0) },
+            { "EnergyDischarged_mWh", (uint32_t)((fBurstDischarged + 500) / 1000) },
+            { "EnergyCharged_mWh", (uint32_t)((fBurstCharged + 500) / 1000) },
+        };
+        for (unsigned i = 0; i < sizeof(stats)/sizeof(stats[0]); i++)
         {
-            // Restart timer with quick polling interval
-            fPollTimer->setTimeoutMS(milliSecPollingTable[kQuickPollInterval]);
+            if (OSNumber* num = OSNumber::withNumber(stats[i].value, NUM_BITS))
+            {
+                dict->setObject(stats[i].key, num);
+                num->release();
+            }
         }
+        setProperty("Burst Sample", dict);
+        dict->release();
     }
-    else
+    AlwaysLog("Burst sampling done: %u samples, %u duplicates, %u mWh discharged\n",
+              (unsigned)fBurstTotal, (unsigned)fBurstDuplicates, (unsigned)((fBurstDischarged + 500) / 1000));
+
+    IOFree(fBurstSamples, fBurstCapacity * sizeof(BurstSample));
+    fBurstSamples = NULL;
+
+    // published state is as old as the burst: refresh it and restart the scheduler
+    if (resume)
+        requestBatteryPoll(kExistingBatteryPath, kACPIPriorityNotify);
+}
+
+/******************************************************************************
+ * AppleSmartBattery::handleSystemSleepWake
+ *
+ * Caller must hold the gate.
+ ******************************************************************************/
+
+IOReturn AppleSmartBattery::handleSystemSleepWake(IOService* powerService, bool isSystemSleep)
+{
+	DebugLog("handleSystemSleepWake: isSystemSleep = %d\n", isSystemSleep);
+	
+    if (isSystemSleep) // System Sleep
     {
-        // restart timer with debug value
-        fPollTimer->setTimeoutMS(1000 * fPollingInterval);
+        if (fBurstActive)
+            finishBurstSampling(false);
+        // don't let a slow read run into sleep; wake re-reads everything
+        if (fReadInFlight)
+            fRead.cancelled = true;
     }
-
-    return true;
+    else if (fFirstTimer && fProvider->isSystemInDarkWake()) // Dark Wake
+    {
+        // short maintenance wake (or full wake not announced yet): refresh
+        // status only, full read as soon as full wake is signalled
+        DebugLog("handleSystemSleepWake: dark wake, _BST only\n");
+        ++fDarkWakeFastPaths;
+        fFullPollDeferred = true;
+        if (kStatusOnlyBatteryPath != fQueuedPath)
+            fQueuedPath = 0;    // the deferred full read covers a read cancelled by sleep
+        requestBatteryPoll(kStatusOnlyBatteryPath, kACPIPriorityWake);
+    }
+    else if (fFirstTimer) // System Wake
+    {
+        // full re-read, offset by this instance's phase so the adapter and
+        // other batteries don't all hit the EC at once
+        fFullPollDeferred = false;
+        fWakePollPending = true;
+        armPollTimer(fPollPhase);
+    }
+	
+    return kIOPMAckImplied;
 }
 
-void AppleSmartBattery::handleBatteryInserted()
+/******************************************************************************
+ * AppleSmartBattery::handleFullWake
+ *
+ * The system reached full wake. A full read deferred by a dark wake runs
+ * now instead of waiting for the next poll. Caller must hold the gate.
+ ******************************************************************************/
+
+IOReturn AppleSmartBattery::handleFullWake(void)
 {
-    DebugLog("handleBatteryInserted called\n");
-    
-    // This must be called under workloop synchronization
-    pollBatteryState(kNewBatteryPath);
+    if (fFullPollDeferred)
+    {
+        DebugLog("handleFullWake: running deferred full read\n");
+        fFullPollDeferred = false;
+        fWakePollPending = false;
+        requestWakePoll();
+    }
+    return kIOReturnSuccess;
 }
 
-void AppleSmartBattery::handleBatteryRemoved()
+/******************************************************************************
+ * AppleSmartBattery::requestWakePoll
+ *
+ * Full read after wake. Firmware may not keep the trip point or averaging
+ * across sleep, so both are reprogrammed.
+ ******************************************************************************/
+
+void AppleSmartBattery::requestWakePoll(void)
 {
-    DebugLog("handleBatteryRemoved called\n");
-    
-    // This must be called under workloop synchronization
-    pollBatteryState(kNewBatteryPath);
+    fTripPoint = 0;
+    fNegotiateAveraging = true;
+    requestBatteryPoll(kNewBatteryPath, kACPIPriorityWake);
 }
 
-/*****************************************************************************
- * AppleSmartBatteryManager::notifyConnectedState
- * Cause a fresh battery poll in workloop to check AC status
+/******************************************************************************
+ * AppleSmartBattery::updateTripPoint
+ *
+ * Program _BTP when the next trip point (see batteryTripPoint) moves. If
+ * the firmware rejects it, fall back to polling for the rest of this session.
  ******************************************************************************/
 
-void AppleSmartBattery::notifyConnectedState(bool connected)
+void AppleSmartBattery::updateTripPoint(UInt32 currentStatus)
 {
-    if (externalConnected() != connected) {
-        DebugLog("notifyConnected: AC power state changed: %d\n", connected);
+    if (!fUseBatteryTripPoint)
+        return;
 
-        setExternalConnected(connected);
-        settingsChangedSinceUpdate = true;
-        updateStatus();
+    UInt32 trip = batteryTripPoint(currentStatus, fCurrentCapacityRaw, fMaxCapacityRaw, fCapacityWarningRaw, fLowWarningRaw);
+    if (trip == fTripPoint)
+        return;
+
+    if (kIOReturnSuccess != fProvider->setBatteryBTP(trip))
+    {
+        AlwaysLog("ACPI method _BTP failed, falling back to polling\n");
+        fUseBatteryTripPoint = false;
+        trip = 0;
     }
+    fTripPoint = trip;
+}
 
-    fACConnected = connected;
+/******************************************************************************
+ * AppleSmartBattery::negotiateAveraging
+ *
+ * Ask the firmware to average the _BST rate itself (_BMA/_BMS). When it
+ * accepts, the rate is used as is and polls follow the averaging window.
+ ******************************************************************************/
 
-/*
-    if (fBatteryPresent)
+void AppleSmartBattery::negotiateAveraging(void)
+{
+    fNegotiateAveraging = false;
+
+    // keep requests inside the bounds declared by _BIX
+    AveragingRequest request =
     {
-        // on AC status change, poll right away (will set quick timer if AC is out-of-sync)
-        pollBatteryState(kExistingBatteryPath);
-    }
-*/
+        fRequestedAveragingInterval, fMinAveragingInterval, fMaxAveragingInterval,
+        fRequestedSamplingTime, fMinSamplingTime, fMaxSamplingTime,
+    };
+    uint32_t averagingInterval, samplingTime;
+    negotiateFirmwareAveraging(fProvider, request, averagingInterval, samplingTime);
+    fAveragingInterval = averagingInterval;
+    fSamplingTime = samplingTime;
+
+    DebugLog("negotiateAveraging: fAveragingInterval=%u, fSamplingTime=%u\n", (unsigned)fAveragingInterval, (unsigned)fSamplingTime);
+    setProperty("AveragingInterval_msec", fAveragingInterval, NUM_BITS);
+    setProperty("SamplingTime_msec", fSamplingTime, NUM_BITS);
 }
 
 /******************************************************************************
- * AppleSmartBattery::handleSystemSleepWake
+ * AppleSmartBattery::publishSamplingBounds
  *
- * Caller must hold the gate.
  ******************************************************************************/
 
-IOReturn AppleSmartBattery::handleSystemSleepWake(IOService* powerService, bool isSystemSleep)
+void AppleSmartBattery::publishSamplingBounds(void)
 {
-	DebugLog("handleSystemSleepWake: isSystemSleep = %d\n", isSystemSleep);
-	
-    if (isSystemSleep) // System Sleep
+    OSDictionary* dict = OSDictionary::withCapacity(6);
+    if (!dict)
+        return;
+
+    struct { const char* key; uint32_t value; } bounds[] =
     {
-        // nothing
-    }
-    else // System Wake
+        { "MinSamplingTime", fMinSamplingTime },
+        { "MaxSamplingTime", fMaxSamplingTime },
+        { "MinAveragingInterval", fMinAveragingInterval },
+        { "MaxAveragingInterval", fMaxAveragingInterval },
+        { "MeasurementAccuracy", fMeasurementAccuracy },
+        { "PollingIntervalFloor", pollingIntervalFloor() },
+    };
+    for (unsigned i = 0; i < sizeof(bounds)/sizeof(bounds[0]); i++)
     {
-        pollBatteryState(kNewBatteryPath);
+        if (OSNumber* num = OSNumber::withNumber(bounds[i].value, NUM_BITS))
+        {
+            dict->setObject(bounds[i].key, num);
+            num->release();
+        }
     }
-	
-    return kIOPMAckImplied;
+    setProperty("Sampling Bounds", dict);
+    dict->release();
 }
 
 /******************************************************************************
@@ -576,18 +2187,83 @@ IOReturn AppleSmartBattery::handleSystemSleepWake(IOService* powerService, bool
 void AppleSmartBattery::pollingTimeOut()
 {
     DebugLog("pollingTimeOut called\n");
-    
+
+    // a timer that fired later than its deadline was deferred by the kernel,
+    // within its leeway or because of load; which one isn't visible from here
+    if (fPollDeadline)
+    {
+        if (GetUptimeMS() > fPollDeadline + kLateWakeupSlack)
+            ++fLateWakeups;
+        else
+            ++fOnTimeWakeups;
+        fPollDeadline = 0;
+    }
+
     fFirstTimer = true;
-    if (fInitialPollCountdown > 0)
+
+    // dark wake promoted to full wake since the status-only read, without
+    // the full wake signal reaching handleFullWake
+    if (fFullPollDeferred && !fProvider->isSystemInDarkWake())
+    {
+        fFullPollDeferred = false;
+        fWakePollPending = true;
+    }
+
+    if (fWakePollPending)
+    {
+        fWakePollPending = false;
+        requestWakePoll();
+    }
+    else if (fInitialPollCountdown > 0)
     {
         // At boot time we make sure to re-read everything kInitialPoltoCountdown times
-        pollBatteryState(kNewBatteryPath);
-        --fInitialPollCountdown;
+        if (requestBatteryPoll(kNewBatteryPath, kACPIPriorityTimer))
+            --fInitialPollCountdown;
+    }
+    else if (fNotifyDriven)
+    {
+        // watchdog poll, checked by checkNotifyWatchdog when its read completes
+        fWatchdogPending = !fReadInFlight;
+        fWatchdogStatus = fStatus;
+        fWatchdogCapacity = fCurrentCapacity;
+        if (!requestBatteryPoll(kExistingBatteryPath, kACPIPriorityTimer))
+            fWatchdogPending = false;
     }
     else
     {
-		pollBatteryState(kExistingBatteryPath);
+		requestBatteryPoll(kExistingBatteryPath, kACPIPriorityTimer);
 	}
+    fNotifiesLastInterval = fNotifiesThisInterval;
+    fNotifiesThisInterval = 0;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::checkNotifyWatchdog
+ *
+ * After the watchdog poll: a change since the last completed read with no
+ * Notify since then means the firmware does not notify reliably, so go back
+ * to timed polling. Notifies from earlier intervals don't count; their
+ * reads already completed. Caller must hold the gate.
+ ******************************************************************************/
+
+void AppleSmartBattery::checkNotifyWatchdog(void)
+{
+    if (!fWatchdogPending)
+        return;
+    fWatchdogPending = false;
+
+    UInt32 status = fWatchdogStatus;
+    UInt32 capacity = fWatchdogCapacity;
+    UInt32 delta = fCurrentCapacity > capacity ? fCurrentCapacity - capacity : capacity - fCurrentCapacity;
+    if (!fNotifiesSinceRead && fNotifyDriven && fBatteryPresent && (status != fStatus || (fMaxCapacity && delta * 100 >= fMaxCapacity)))
+    {
+        AlwaysLog("Missed battery Notify (status 0x%x->0x%x, capacity %u->%u), reverting to timed polling\n",
+                  (unsigned)status, (unsigned)fStatus, (unsigned)capacity, (unsigned)fCurrentCapacity);
+        ++fMissedNotifies;
+        fNotifyDriven = false;
+        setProperty("Notify Driven", false);
+        schedulePoll();
+    }
 }
 
 /******************************************************************************
@@ -598,16 +2274,63 @@ void AppleSmartBattery::pollingTimeOut()
  *    - The EC has dropped an SMBus packet (probably recoverable)
  *    - The EC has stalled an SMBus request; IOSMBusController is hung (probably not recoverable)
  *
- * Start the battery read over from scratch.
+ * Armed per read (ACPIMethodTimeout for each method). The worker can't be
+ * interrupted inside AML, so the read is cancelled: whatever is left is
+ * skipped, its results are discarded when it returns, and it is retried
+ * with backoff. The workloop and the state read before stay usable.
  *****************************************************************************/
 
 void AppleSmartBattery::incompleteReadTimeOut(void)
 {
     DebugLog("incompleteReadTimeOut called\n");
-    
+
+    if (!fReadInFlight || fRead.cancelled)
+        return;
+
     logReadError(kErrorOverallTimeoutExpired, 0, NULL);
-	
-	pollBatteryState(kExistingBatteryPath);
+    ++fIncompleteReads;
+    fReadTimedOut = true;
+    fRead.cancelled = true;
+}
+
+/******************************************************************************
+ * AppleSmartBattery::scheduleReadRetry
+ *
+ * Retry failed methods after kRetryDelayMin, doubling per attempt, up to
+ * kRetryAttempts failed reads (kIncompleteReadRetryMax watchdog timeouts)
+ * in a row. Past that the next regular poll tries again.
+ * Caller must hold the gate.
+ ******************************************************************************/
+
+void AppleSmartBattery::scheduleReadRetry(UInt32 methods, bool incomplete)
+{
+    uint32_t& attempts = incomplete ? fIncompleteReadRetries : fReadRetries;
+    if (attempts >= (uint32_t)(incomplete ? kIncompleteReadRetryMax : kRetryAttempts))
+    {
+        logReadError(kErrorRetryAttemptsExceeded, (uint16_t)methods, NULL);
+        ++fRetriesExhausted;
+        attempts = 0;
+        fRetryMethods = 0;
+        fRetryRefresh = false;
+        return;
+    }
+
+    uint32_t delay = kRetryDelayMin << attempts;
+    if (delay > kRetryDelayMax)
+        delay = kRetryDelayMax;
+    ++attempts;
+    ++fRetriedReads;
+    fRetryMethods |= methods;
+    fRetryRefresh |= fReadRefresh;
+    fRetryTimer->setTimeoutMS(delay);
+}
+
+void AppleSmartBattery::retryTimeOut(void)
+{
+    DebugLog("retryTimeOut called\n");
+
+    if (fRetryMethods)
+        requestBatteryPoll(kRetryBatteryPath, kACPIPriorityNotify);
 }
 
 /******************************************************************************
@@ -624,6 +2347,7 @@ void AppleSmartBattery::clearBatteryState(bool do_update)
 
     fBatteryPresent = false;
     fACChargeCapable = false;
+    fPublished.valid = false;
 	
     setBatteryInstalled(false);
     setIsCharging(false);
@@ -1294,7 +3018,7 @@ IOReturn AppleSmartBattery::setBatteryBIF(OSArray *acpibat_bif)
         cycleCnt = GetValueFromArray(acpibat_bif, BIF_CYCLE_COUNT);
     else if (fDesignCapacity > fMaxCapacity && fEstimateCycleCountDivisor)
         cycleCnt = (fDesignCapacity - fMaxCapacity) / fEstimateCycleCountDivisor;
-    if (cycleCnt)
+    if (cycleCnt && acceptField(kRoutedFieldCycleCount, kACPIMethodBIF))
         setCycleCount(cycleCnt);
     
     //rehabman: getting temperature from extended _BIF
@@ -1303,7 +3027,9 @@ IOReturn AppleSmartBattery::setBatteryBIF(OSArray *acpibat_bif)
         fTemperature = GetValueFromArray(acpibat_bif, BIF_TEMPERATURE);
         DebugLog("fTemperature = %d (0.1K)\n", (unsigned)fTemperature);
     }
-    if (-1 != fTemperature && 0 != fTemperature)
+    else
+        fFieldSources[kRoutedFieldTemperature] &= ~ACPIMethodBit(kACPIMethodBIF);
+    if (-1 != fTemperature && 0 != fTemperature && acceptField(kRoutedFieldTemperature, kACPIMethodBIF))
         setTemperature((fTemperature - 2731) * 10);
 
 	// ACPI _BIF doesn't provide these
@@ -1371,6 +3097,17 @@ IOReturn AppleSmartBattery::setBatteryBIX(OSArray *acpibat_bix)
 	fCycleCount			= GetValueFromArray (acpibat_bix, BIX_CYCLE_COUNT);
 	fMaxErr				= GetValueFromArray (acpibat_bix, BIX_ACCURACY);
 
+    // sampling/accuracy contract (ACPI_UNKNOWN or 0 means not declared)
+    fMeasurementAccuracy    = fMaxErr != ACPI_UNKNOWN ? fMaxErr : 0;
+    fMaxSamplingTime        = GetValueFromArray (acpibat_bix, BIX_MAX_SAMPLE_TIME);
+    fMinSamplingTime        = GetValueFromArray (acpibat_bix, BIX_MIN_SAMPLE_TIME);
+    fMaxAveragingInterval   = GetValueFromArray (acpibat_bix, BIX_MAX_AVG_INTERVAL);
+    fMinAveragingInterval   = GetValueFromArray (acpibat_bix, BIX_MIN_AVG_INTERVAL);
+    if (fMaxSamplingTime == ACPI_UNKNOWN) fMaxSamplingTime = 0;
+    if (fMinSamplingTime == ACPI_UNKNOWN) fMinSamplingTime = 0;
+    if (fMaxAveragingInterval == ACPI_UNKNOWN) fMaxAveragingInterval = 0;
+    if (fMinAveragingInterval == ACPI_UNKNOWN) fMinAveragingInterval = 0;
+
 	OSSymbol* deviceName		= GetSymbolFromArray(acpibat_bix, BIX_MODEL_NUMBER);
 	OSSymbol* serialNumber		= GetSymbolFromArray(acpibat_bix, BIX_SERIAL_NUMBER);
 	OSSymbol* type				= GetSymbolFromArray(acpibat_bix, BIX_BATTERY_TYPE);
@@ -1385,6 +3122,8 @@ IOReturn AppleSmartBattery::setBatteryBIX(OSArray *acpibat_bix)
     DebugLog("fLowWarningRaw      = %d\n", (int)fLowWarning);
     DebugLog("fCycleCount      = %d\n", (int)fCycleCount);
     DebugLog("fMaxErr          = %d\n", (int)fMaxErr);
+    DebugLog("fMinSamplingTime = %d\n", (int)fMinSamplingTime);
+    DebugLog("fMaxSamplingTime = %d\n", (int)fMaxSamplingTime);
     DebugLog("fDeviceName      = '%s'\n", deviceName->getCStringNoCopy());
     DebugLog("fSerialNumber    = '%s'\n", serialNumber->getCStringNoCopy());
     DebugLog("fType            = '%s'\n", type->getCStringNoCopy());
@@ -1421,7 +3160,9 @@ IOReturn AppleSmartBattery::setBatteryBIX(OSArray *acpibat_bix)
     OSSafeReleaseNULL(manufacturer);
     OSSafeReleaseNULL(serialNumber);
 
-	setCycleCount(fCycleCount);
+    if (acceptField(kRoutedFieldCycleCount, kACPIMethodBIX))
+        setCycleCount(fCycleCount);
+    publishSamplingBounds();
 
     //REVIEW_REHABMAN: Not sure it makes sense to set MaxErr based on BIF_ACCURACY
 	//setMaxErr(fMaxErr);
@@ -1515,31 +3256,106 @@ IOReturn AppleSmartBattery::setBatteryBBIX(OSArray *acpibat_bbix)
 	
     // temperature must be converted from .1K to .01 degrees C
     if (-1 != fTemperature && 0 != fTemperature)
-        setTemperature((fTemperature - 2731) * 10);
+    {
+        if (acceptField(kRoutedFieldTemperature, kACPIMethodBBIX))
+            setTemperature((fTemperature - 2731) * 10);
+    }
+    else
+        fFieldSources[kRoutedFieldTemperature] &= ~ACPIMethodBit(kACPIMethodBBIX);
     
-	setManufactureDate(fManufactureDate);
-	
-	const OSSymbol *manuDate = this->unpackDate(fManufactureDate);
-	if (manuDate) {
-		setPSProperty(_DateOfManufacture, const_cast<OSSymbol*>(manuDate));
-		manuDate->release();
-	}
+    // manufacture date/data are static: published on refresh only
+    if (fStaticExtraPending)
+    {
+        setManufactureDate(fManufactureDate);
+
+        const OSSymbol *manuDate = this->unpackDate(fManufactureDate);
+        if (manuDate) {
+            setPSProperty(_DateOfManufacture, const_cast<OSSymbol*>(manuDate));
+            manuDate->release();
+        }
+    }
 	
-	setRunTimeToEmpty(fRunTimeToEmpty);
-	setRelativeStateOfCharge(fRelativeStateOfCharge);
-	setAbsoluteStateOfCharge(fAbsoluteStateOfCharge);
-	setRemainingCapacity(fRemainingCapacity);
-	setAverageCurrent(fAverageCurrent);
-	setCurrent(fCurrent);
+    if (acceptField(kRoutedFieldRunTimeToEmpty, kACPIMethodBBIX))
+        setRunTimeToEmpty(fRunTimeToEmpty);
+    if (acceptField(kRoutedFieldStateOfCharge, kACPIMethodBBIX))
+    {
+        setRelativeStateOfCharge(fRelativeStateOfCharge);
+        setAbsoluteStateOfCharge(fAbsoluteStateOfCharge);
+        setRemainingCapacity(fRemainingCapacity);
+    }
+    if (acceptField(kRoutedFieldAverageCurrent, kACPIMethodBBIX))
+        setAverageCurrent(fAverageCurrent);
+    if (acceptField(kRoutedFieldCurrent, kACPIMethodBBIX))
+        setCurrent(fCurrent);
+    if (-1 != fVoltage && 0 != fVoltage)
+    {
+        if (acceptField(kRoutedFieldVoltage, kACPIMethodBBIX))
+            setVoltage(fVoltage);
+    }
+    else
+        fFieldSources[kRoutedFieldVoltage] &= ~ACPIMethodBit(kACPIMethodBBIX);
     if (manufacturerData)
     {
-        setManufacturerData((uint8_t *)manufacturerData, manufacturerData->getLength());
+        if (fStaticExtraPending)
+            setManufacturerData((uint8_t *)manufacturerData, manufacturerData->getLength());
         manufacturerData->release();
     }
+    fStaticExtraPending = false;
 	
 	return kIOReturnSuccess;
 }
 
+/******************************************************************************
+ * AppleSmartBattery::setBatterySBS
+ * Fields read from the Smart Battery System, through the same setters as
+ * the matching BBIX fields
+ ******************************************************************************/
+
+IOReturn AppleSmartBattery::setBatterySBS(const UInt16 *sbs)
+{
+	fTemperature		= sbs[SBS_TEMPERATURE];
+	fCurrent			= (SInt16)sbs[SBS_CURRENT];
+	fAverageCurrent		= (SInt16)sbs[SBS_AVG_CURRENT];
+	fRunTimeToEmpty		= sbs[SBS_RUNTIME_TO_EMPTY];
+	fCycleCount			= sbs[SBS_CYCLE_COUNT];
+	fVoltage			= sbs[SBS_VOLTAGE];
+
+	DebugLog("fTemperature     = %d (0.1K)\n", (int)fTemperature);
+	DebugLog("fCurrent         = %d (mA)\n", (int)fCurrent);
+	DebugLog("fAverageCurrent  = %d (mA)\n", (int)fAverageCurrent);
+	DebugLog("fRunTimeToEmpty  = %d (min)\n", (int)fRunTimeToEmpty);
+	DebugLog("fCycleCount      = %d\n", (int)fCycleCount);
+	DebugLog("fVoltage         = %d (mV)\n", (int)fVoltage);
+
+    // temperature must be converted from .1K to .01 degrees C
+    if (0 != fTemperature && 0xffff != fTemperature)
+    {
+        if (acceptField(kRoutedFieldTemperature, kACPIMethodSBS))
+            setTemperature((fTemperature - 2731) * 10);
+    }
+    else
+        fFieldSources[kRoutedFieldTemperature] &= ~ACPIMethodBit(kACPIMethodSBS);
+
+    // 0xffff: not discharging
+    if (acceptField(kRoutedFieldRunTimeToEmpty, kACPIMethodSBS))
+        setRunTimeToEmpty(0xffff != fRunTimeToEmpty ? fRunTimeToEmpty : 0);
+    if (acceptField(kRoutedFieldAverageCurrent, kACPIMethodSBS))
+        setAverageCurrent(fAverageCurrent);
+    if (acceptField(kRoutedFieldCurrent, kACPIMethodSBS))
+        setCurrent(fCurrent);
+    if (acceptField(kRoutedFieldCycleCount, kACPIMethodSBS))
+        setCycleCount(fCycleCount);
+    if (0 != fVoltage && 0xffff != fVoltage)
+    {
+        if (acceptField(kRoutedFieldVoltage, kACPIMethodSBS))
+            setVoltage(fVoltage);
+    }
+    else
+        fFieldSources[kRoutedFieldVoltage] &= ~ACPIMethodBit(kACPIMethodSBS);
+
+	return kIOReturnSuccess;
+}
+
 /******************************************************************************
  * AppleSmartBattery::setBatteryBST
  *
@@ -1614,7 +3430,9 @@ IOReturn AppleSmartBattery::setBatteryBST(OSArray *acpibat_bst)
 	UInt32 currentStatus = GetValueFromArray(acpibat_bst, BST_STATUS);
 	fCurrentRate		 = GetValueFromArray(acpibat_bst, BST_RATE);
 	fCurrentCapacity	 = GetValueFromArray(acpibat_bst, BST_CAPACITY);
+	fCurrentCapacityRaw	 = fCurrentCapacity;
 	fCurrentVoltage		 = GetValueFromArray(acpibat_bst, BST_VOLTAGE);
+    fECRefresh.track(GetUptimeMS(), currentStatus, fCurrentRate, fCurrentCapacity, fCurrentVoltage);
 	
 	DebugLog("fPowerUnit       = 0x%x\n", (unsigned)fPowerUnit);
 	DebugLog("currentStatus    = 0x%x\n", (unsigned)currentStatus);
@@ -1688,7 +3506,8 @@ IOReturn AppleSmartBattery::setBatteryBST(OSArray *acpibat_bst)
         fAverageRate = 0;
 
     // calculate decaying average for fAverageRate
-    if (!fAverageRate)
+    // (unless firmware is already averaging over its _BMA window)
+    if (!fAverageRate || fAveragingInterval)
         fAverageRate = fCurrentRate;
     fAverageRate = (fAverageRate + fCurrentRate) / 2;
 
@@ -1709,12 +3528,44 @@ IOReturn AppleSmartBattery::setBatteryBST(OSArray *acpibat_bst)
         }
     }
 
-    setDesignCapacity(fDesignCapacity);
-    setMaxCapacity(fMaxCapacity);
-    setCurrentCapacity(fCurrentCapacity);
-    setVoltage(fCurrentVoltage);
+    // nothing changed beyond measurement error since the last publish:
+    // keep the published properties, but do all the bookkeeping below
+    bool publish = !isBelowMeasurementError(fPublished, currentStatus, fCurrentCapacity, fCurrentRate,
+                                            fMaxCapacity, fCapacityWarning, fLowWarning, fMeasurementAccuracy);
+    if (!publish)
+    {
+        DebugLog("setBatteryBST: change below measurement error, not republishing\n");
+        ++fSuppressedPublishes;
+    }
+    else
+    {
+        fPublished.valid = true;
+        fPublished.status = currentStatus;
+        fPublished.capacity = fCurrentCapacity;
+        fPublished.rate = fCurrentRate;
+        fPublished.maxCapacity = fMaxCapacity;
+    }
+
+    if (publish)
+    {
+        setDesignCapacity(fDesignCapacity);
+        setMaxCapacity(fMaxCapacity);
+        setCurrentCapacity(fCurrentCapacity);
+        // unless this poll routed Voltage to BBIX or SBS; status-only and
+        // retry polls don't route, so a source they don't read doesn't count
+        int route = fFieldRoute[kRoutedFieldVoltage];
+        if (route < 0 || !(fRead.methods & ACPIMethodBit(route)) || (ACPIMethodBit(route) & kStatusMethods))
+        {
+            fFieldTime[kRoutedFieldVoltage] = GetUptimeMS();
+            setVoltage(fCurrentVoltage);
+        }
+    }
 
-	if ((currentStatus & BATTERY_DISCHARGING) && (currentStatus & BATTERY_CHARGING))
+	if (!publish)
+	{
+		DebugLog("AppleSmartBattery: power source properties unchanged\n");
+	}
+	else if ((currentStatus & BATTERY_DISCHARGING) && (currentStatus & BATTERY_CHARGING))
 	{		
 		// This should NEVER happen but...
 		
@@ -1844,18 +3695,20 @@ IOReturn AppleSmartBattery::setBatteryBST(OSArray *acpibat_bst)
 	}
 
     fStartupFastPoll = 0;
+    updateTripPoint(currentStatus);
 	if (!fPollingOverridden && fMaxCapacity) {
 		/*
 		 * Conditionally set polling interval to 1 second if we're
 		 *     discharging && below 5% && on AC power
 		 * i.e. we're doing an Inflow Disabled discharge
+		 * (not needed when _BTP will notify at each percent)
 		 */
-		if ((((100*fCurrentCapacity) / fMaxCapacity) < 5) && fACConnected) {
+		if ((((100*fCurrentCapacity) / fMaxCapacity) < 5) && fACConnected && !fTripPoint) {
 			setProperty("Quick Poll", true);
-			fPollingInterval = kQuickPollInterval;
+			fQuickPoll = true;
 		} else {
 			setProperty("Quick Poll", false);
-			fPollingInterval = kDefaultPollInterval;
+			fQuickPoll = false;
 		}
 	}
 
@@ -1863,19 +3716,22 @@ IOReturn AppleSmartBattery::setBatteryBST(OSArray *acpibat_bst)
     setAtWarnLevel(-1 != fCapacityWarning && fCurrentCapacity <= fCapacityWarning);
     setAtCriticalLevel(-1 != fLowWarning && fCurrentCapacity <= fLowWarning);
 	
-	// Assumes 4 cells but Smart Battery standard does not provide count to do this dynamically. 
-	// Smart Battery can expose manufacturer specific functions, but they will be specific to the embedded battery controller
-    UInt32 cellVoltage = fCurrentVoltage / 4;
-    for (int i = 0; i < NUM_CELLS-1; i++)
+    if (publish)
     {
-        OSNumber* num = (OSNumber*)fCellVoltages->getObject(i);
-        num->setValue(cellVoltage);
-    }
-    OSNumber* num = (OSNumber*)fCellVoltages->getObject(NUM_CELLS-1);
-    num->setValue(fCurrentVoltage-cellVoltage*(NUM_CELLS-1));
-    setProperty("CellVoltage", fCellVoltages);
+        // Assumes 4 cells but Smart Battery standard does not provide count to do this dynamically. 
+        // Smart Battery can expose manufacturer specific functions, but they will be specific to the embedded battery controller
+        UInt32 cellVoltage = fCurrentVoltage / 4;
+        for (int i = 0; i < NUM_CELLS-1; i++)
+        {
+            OSNumber* num = (OSNumber*)fCellVoltages->getObject(i);
+            num->setValue(cellVoltage);
+        }
+        OSNumber* num = (OSNumber*)fCellVoltages->getObject(NUM_CELLS-1);
+        num->setValue(fCurrentVoltage-cellVoltage*(NUM_CELLS-1));
+        setProperty("CellVoltage", fCellVoltages);
 
-	rebuildLegacyIOBatteryInfo(true);
+        rebuildLegacyIOBatteryInfo(true);
+    }
 	
 	updateStatus();
 	
@@ -28,20 +28,18 @@
 #include <IOKit/pwr_mgt/IOPMPowerSource.h>
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
 
+#include "BatteryPolicy.h"
 #include "AppleSmartBatteryManager.h"
 
 #define WATTS				0
 #define AMPS				1
-#define ACPI_MAX			0x7FFFFFFF
-#define ACPI_UNKNOWN		0xFFFFFFFF
-
-#define BATTERY_CHARGED		0
-#define BATTERY_DISCHARGING	1
-#define BATTERY_CHARGING	2
-#define	BATTERY_CRITICAL	4
 
 #define BATTERY_PRESENT		0x10	// Bit 4 - _STA Method return
 
+// Battery device Notify codes
+#define BATTERY_NOTIFY_STATUS		0x80	// _BST changed
+#define BATTERY_NOTIFY_INFORMATION	0x81	// _BIF/_BIX changed (or insert/remove)
+
 // Return package from _BIF
 
 #define BIF_POWER_UNIT			0	
@@ -103,12 +101,36 @@
 #define BBIX_MANUF_DATE			14
 #define BBIX_MANUF_DATA			15
 
+// Return package from BALL (optional bulk method, see SSDT-BALL.dsl)
+
+#define BALL_STATUS				0	// _STA value
+#define BALL_BST				1	// _BST package
+#define BALL_INFO				2	// _BIF or _BIX package, if requested
+#define BALL_EXTRA				3	// BBIX package, if requested
+
+// BALL argument: packages wanted besides _STA/_BST
+
+#define BALL_WANT_BIF			1
+#define BALL_WANT_BIX			2
+#define BALL_WANT_BBIX			4
+
+// Smart Battery System registers read in place of BBIX (see SmartBatterySystem.h)
+
+#define SBS_TEMPERATURE			0
+#define SBS_CURRENT				1
+#define SBS_AVG_CURRENT			2
+#define SBS_RUNTIME_TO_EMPTY	3
+#define SBS_CYCLE_COUNT			4
+#define SBS_VOLTAGE				5
+#define SBS_FIELD_COUNT			6
+
 // Return package from _BIF
 
 #define BST_STATUS				0
 #define	BST_RATE				1
 #define	BST_CAPACITY			2
 #define	BST_VOLTAGE				3
+#define BST_FIELD_COUNT			4
 
 #define NUM_BITS				32
 #define NUM_CELLS               4
@@ -127,6 +149,9 @@
 
 #define kUseBatteryExtraInfoKey		"UseExtraBatteryInformationMethod"
 
+// Define this in Info.plist to read everything through the non-standard bulk method BALL, if present
+#define kUseBatteryBulkInfoKey		"UseBulkInformationMethod"
+
 // Define this in Info.plist for estimations of cycle count
 
 #define kEstimateCycleCountDivisorInfoKey   "EstimateCycleCountDivisor"
@@ -153,11 +178,147 @@
 // For configuring the time before the first status poll
 #define kFirstPollDelay "FirstPollDelay"
 
+// Define these in Info.plist to bound the adaptive polling interval (ms)
+#define kPollingIntervalMinimum "PollingIntervalMinimum"
+#define kPollingIntervalMaximum "PollingIntervalMaximum"
+
+// Define this in Info.plist to set the poll timer leeway (percent of interval)
+#define kPollingLeewayPercent   "PollingLeewayPercent"
+
+// Define this in Info.plist to program the ACPI _BTP trip point and rely on its Notify
+#define kUseBatteryTripPointKey "UseBatteryTripPoint"
+
+// Define these in Info.plist to request firmware-side averaging via _BMA/_BMS (ms, 0 = leave alone)
+#define kBatteryAveragingIntervalKey "BatteryAveragingInterval"
+#define kBatterySamplingTimeKey      "BatterySamplingTime"
+
+// Define these in Info.plist to drive reads from ACPI Notify, with a long watchdog poll (ms)
+#define kNotifyDrivenPollingKey     "NotifyDrivenPolling"
+#define kNotifyWatchdogIntervalKey  "NotifyWatchdogInterval"
+
+// Define this in Info.plist to bound ACPI evaluations per minute across all poll triggers (0 = unlimited)
+#define kACPIEvaluationsPerMinuteKey "ACPIEvaluationsPerMinute"
+
+// Define this in Info.plist to set the delay (ms) before the _BST read after AC plug/unplug
+#define kACSettleDelayKey       "ACSettleDelay"
+
+// Define this in Info.plist to set the deadline (ms) for each ACPI method in a poll (0 = none)
+#define kACPIMethodTimeoutKey   "ACPIMethodTimeout"
+
+// Define this in Info.plist to set the sanity check interval (ms) while no battery is present (0 = never)
+#define kBatteryAbsentCheckIntervalKey "BatteryAbsentCheckInterval"
+
+// Define this in Info.plist to collapse Notify storms into one read per window (ms, 0 = off)
+#define kNotifyCoalesceWindowKey "NotifyCoalesceWindow"
+
+// Define this in Info.plist to read temperature, current, run time and cycle count from the Smart Battery System (see routeFields)
+#define kUseSmartBatterySystemKey "UseSmartBatterySystem"
+
+// Define this in RMCF to read the _BST fields straight from EC registers (see setECRegisterMap)
+#define kECRegisterMapKey       "ECRegisterMap"
+#define kECCrossCheckIntervalKey "CrossCheckInterval"   // in the map: direct reads between _BST cross-checks
+
+// Define this in Info.plist to evaluate poll ACPI methods on a low priority worker thread instead of the workloop
+#define kAsyncACPIReadsKey      "AsyncACPIReads"
+
+// Define this in Info.plist to set how often (ms) cached _BIF/_BIX info is re-read without a Notify 0x81 (0 = never)
+#define kStaticInfoRefreshIntervalKey "StaticInfoRefreshInterval"
+
+// Define this in Info.plist to read optional methods only for field groups someone registered interest in
+#define kDemandDrivenRefreshKey "DemandDrivenRefresh"
+
+// Field groups beyond the baseline (_STA/_BST) that IOPMPowerSource/powerd always get
+enum
+{
+    kInterestGroupInformation = 0,  // _BIF/_BIX re-read on every poll (capacities, cycle count)
+    kInterestGroupExtra,            // BBIX (time estimates, state of charge, temperature, manufacturer data)
+    kInterestGroupCount
+};
+
+// Fields more than one method provides, each read from the cheapest fresh source (see routeFields)
+enum
+{
+    kRoutedFieldTemperature = 0,    // extended _BIF, BBIX, SBS
+    kRoutedFieldCycleCount,         // _BIF (extended or estimated), _BIX, SBS
+    kRoutedFieldCurrent,            // BBIX, SBS
+    kRoutedFieldAverageCurrent,     // BBIX, SBS
+    kRoutedFieldRunTimeToEmpty,     // BBIX, SBS
+    kRoutedFieldStateOfCharge,      // BBIX only: relative/absolute state of charge, remaining capacity
+    kRoutedFieldVoltage,            // _BST (or the EC map), BBIX, SBS
+    kRoutedFieldCount
+};
+
+// Define this in Info.plist to set how old (ms) each routed field may get before a method is read for it
+#define kFieldMaxAgeKey         "FieldMaxAge"
+
+// Set this property on AppleSmartBattery (as root) to sample _BST as fast as the EC allows for N seconds
+#define kBurstSampleSecondsKey  "BurstSampleSeconds"
+
+// One burst sample, published as an array of these in "Burst Sample" Samples
+struct BurstSample
+{
+    uint64_t    time;           // ms since boot
+    UInt32      status;
+    UInt32      rate;
+    UInt32      voltage;
+    UInt32      duplicate;      // identical to the previous _BST
+};
+
+// ACPIBatteryUserClient selectors (IOConnectCallMethod)
+enum
+{
+    kBatteryUserClientReadWithMaxAge = 0,   // scalar in: max age (ms), struct out: BatterySnapshot
+    kBatteryUserClientRegisterInterest,     // scalar in: kInterestGroup*, dropped on close
+    kBatteryUserClientUnregisterInterest,   // scalar in: kInterestGroup*
+    kBatteryUserClientMethodCount
+};
+
+// Battery state returned to user space, with the time it was read from ACPI
+struct BatterySnapshot
+{
+    uint64_t    time;           // ms since boot
+    uint64_t    age;            // ms, when returned
+    UInt32      present;
+    UInt32      acConnected;
+    UInt32      status;         // _BST state
+    UInt32      currentRate;    // mA
+    UInt32      averageRate;    // mA
+    UInt32      currentCapacity;// mAh
+    UInt32      maxCapacity;    // mAh
+    UInt32      designCapacity; // mAh
+    UInt32      voltage;        // mV
+    UInt32      reserved;
+};
+
+// One poll's ACPI reads: planned by the battery, evaluated by the manager's
+// worker thread (see startBatteryRead) and decoded back on the workloop
+struct BatteryRead
+{
+    UInt32          methods;        // ACPIMethodBit()s to evaluate (BALL first, if set)
+    UInt32          bulkFlags;      // BALL_WANT_* for BALL
+    uint32_t        methodTimeout;  // ms deadline per method, 0 = none
+    volatile bool   cancelled;      // sleep/stop/watchdog: skip what is left, discard results
+    bool            async;          // evaluated by the worker, not under the gate
+    UInt32          evaluated;      // ACPIMethodBit()s evaluated
+    UInt32          failed;         // ACPIMethodBit()s that failed or were skipped after a timeout
+    UInt32          timedOut;       // ACPIMethodBit()s that overran methodTimeout
+    UInt32          sta;
+    uint64_t        notifyTime;     // us, oldest Notify this read services, 0 if none (see takeNotifyTime)
+    OSArray*        info;           // _BIF or _BIX package
+    OSArray*        extra;          // BBIX package
+    OSArray*        bst;            // _BST package
+    UInt16          sbs[SBS_FIELD_COUNT];   // SBS_* registers
+    UInt32          ec[BST_FIELD_COUNT];    // EC register map, in _BST order
+    uint32_t        ioTime;         // us spent evaluating
+};
+
 // for pollBatteryState
 enum
 {
     kExistingBatteryPath    = 1,
-    kNewBatteryPath         = 2
+    kNewBatteryPath         = 2,
+    kStatusOnlyBatteryPath  = 3,    // _BST only (dark wake)
+    kRetryBatteryPath       = 4     // methods that failed in the last read
 };
 
 UInt32 GetValueFromArray(OSArray * array, UInt8 index);
@@ -181,10 +342,150 @@ protected:
     AppleSmartBatteryManager *fProvider;
 	IOWorkLoop              *fWorkLoop;
 	IOTimerEventSource      *fPollTimer;
+	IOTimerEventSource      *fACSettleTimer;
+	IOCommandGate           *fCommandGate;
     uint32_t                fPollingInterval;
     bool                    fPollingOverridden;
+    uint32_t                fPollingIntervalMin;
+    uint32_t                fPollingIntervalMax;
+    bool                    fQuickPoll;
+    uint32_t                fPollingLeewayPercent;
+    uint32_t                fPollPhase;
+    uint64_t                fPollDeadline;
+    uint64_t                fPollLeeway;
+    bool                    fWakePollPending;
+    bool                    fFullPollDeferred;
+    bool                    fNotifyDriven;
+    uint32_t                fNotifyWatchdogInterval;
+    int                     fPendingPath;           // poll refused by the governor, 0 if none
+    int                     fPendingPriority;
+    uint32_t                fACSettleDelay;
+    uint64_t                fACChangeTime;          // AC plug/unplug not yet reflected in _BST, 0 if none
+    uint32_t                fACSettleAttempts;
+    bool                    fDormant;               // no battery: no timer, woken by Notify
+    uint32_t                fBatteryAbsentCheckInterval;
+
+    // poll statistics, published as "Poll Statistics"
+    uint32_t                fLateWakeups;
+    uint32_t                fOnTimeWakeups;
+    uint32_t                fPollsAheadOfTimer;
+    uint32_t                fSuppressedPublishes;
+    uint32_t                fDarkWakeFastPaths;
+    uint32_t                fNotifies;
+    uint32_t                fNotifiesThisInterval;
+    uint32_t                fNotifiesLastInterval;
+    uint32_t                fMissedNotifies;
+    uint32_t                fACTransitions;
+    uint32_t                fACTransitionLatency;
+    uint32_t                fACTransitionLatencyMax;
+    uint32_t                fACTransitionTimeouts;
+    uint32_t                fDormantEntries;
+    uint32_t                fSkippedEvaluations;
+
+    // static info (_BIF/_BIX, BBIX manufacture date/data) cache
+    uint32_t                fStaticInfoRefreshInterval;
+    uint64_t                fStaticInfoTime;        // last _BIF/_BIX refresh, 0 if stale
+    bool                    fStaticExtraPending;    // next BBIX also refreshes its static fields
+    uint32_t                fStaticInfoRefreshes;
+
+    // AML interpreter entries per poll (bulk method vs. per-method reads)
+    uint32_t                fLastPollEvaluations;
+    uint32_t                fPollEvaluations;
+    uint32_t                fBulkPolls;
+
+    // poll in progress (see pollBatteryState/completeBatteryRead)
+    BatteryRead             fRead;
+    bool                    fReadInFlight;
+    bool                    fReadBurst;             // a burst sample, see completeBurstRead
+    int                     fReadPath;
+    bool                    fReadRefresh;
+    char                    fReadSkipped[32];
+    uint32_t                fReadSkippedCount;
+    int                     fQueuedPath;            // poll requested while one was in flight
+    uint32_t                fGateHoldDispatch;      // us
+    uint32_t                fGateHoldLast;          // us the poll held the gate
+    uint32_t                fGateHoldMax;
+    uint32_t                fACPIReadTimeLast;      // us spent evaluating ACPI methods
+    uint32_t                fACPIReadTimeMax;
+    uint32_t                fCancelledReads;
+
+    // incomplete read watchdog and retries (see scheduleReadRetry)
+	IOTimerEventSource      *fReadTimer;
+	IOTimerEventSource      *fRetryTimer;
+    uint32_t                fMethodTimeout;
+    bool                    fReadTimedOut;          // cancelled by incompleteReadTimeOut
+    UInt32                  fRetryMethods;          // for kRetryBatteryPath
+    bool                    fRetryRefresh;
+    uint32_t                fReadRetries;           // consecutive, this poll cycle
+    uint32_t                fIncompleteReadRetries;
+    uint32_t                fFailedReads;
+    uint32_t                fRetriedReads;
+    uint32_t                fRetriesExhausted;
+    uint32_t                fIncompleteReads;
+
+    // watchdog poll in NotifyDrivenPolling mode (see checkNotifyWatchdog)
+    bool                    fWatchdogPending;
+    uint32_t                fNotifiesSinceRead;     // since the last completed read
+    UInt32                  fWatchdogStatus;
+    UInt32                  fWatchdogCapacity;
+
+    // demand-driven refresh: registrations per field group
+    bool                    fDemandDriven;
+    uint32_t                fInterestCount[kInterestGroupCount];
+
+    // per-field source routing (see routeFields)
+    int                     fFieldRoute[kRoutedFieldCount];     // method this poll, -1 if kept
+    uint64_t                fFieldTime[kRoutedFieldCount];      // ms, last published
+    uint32_t                fFieldMaxAge[kRoutedFieldCount];    // ms, 0 = every poll
+    UInt32                  fFieldSources[kRoutedFieldCount];   // ACPIMethodBit()s seen to provide it
+    UInt32                  fLatencyProbed;                     // ACPIMethodBit()s routing has read once
+
+    // burst sampling (see startBurstSampling)
+	IOTimerEventSource      *fBurstTimer;
+    bool                    fBurstActive;
+    uint64_t                fBurstStart;
+    uint64_t                fBurstEnd;
+    uint32_t                fBurstInterval;
+    BurstSample*            fBurstSamples;
+    uint32_t                fBurstCapacity;
+    uint32_t                fBurstCount;
+    uint32_t                fBurstTotal;
+    uint32_t                fBurstDuplicates;
+    uint32_t                fBurstMissed;           // read in flight, refused by the governor or failed
+    uint64_t                fBurstReadTime;         // ms, when the burst read in flight started
+    uint64_t                fBurstDischarged;       // uWh
+    uint64_t                fBurstCharged;          // uWh
+    uint32_t                fBurstLastPower;        // mW
+    UInt32                  fBurstLastStatus, fBurstLastRate, fBurstLastCapacity, fBurstLastVoltage;
+    uint64_t                fBurstLastTime;
+
+    // read with max age (see readWithMaxAge)
+    uint64_t                fSampleTime;            // last poll's ACPI read, 0 if none yet
+    uint32_t                fFreshReads;
+    uint32_t                fFreshReadPolls;
+    uint32_t                fFreshReadWaits;
+    uint32_t                fFreshReadTimeouts;
 	bool					fUseBatteryExtendedInformation;
 	bool					fUseBatteryExtraInformation;
+    bool                    fUseBatteryBulkInformation;
+    bool                    fUseSmartBatterySystem;
+    bool                    fUseBatteryTripPoint;
+    UInt32                  fTripPoint;
+    UInt32                  fRequestedAveragingInterval;
+    UInt32                  fRequestedSamplingTime;
+    UInt32                  fAveragingInterval;     // accepted by _BMA, 0 if none
+    UInt32                  fSamplingTime;          // accepted by _BMS, 0 if none
+    bool                    fNegotiateAveraging;
+
+    // sampling contract declared in _BIX (0 if not declared)
+    UInt32                  fMinSamplingTime;
+    UInt32                  fMaxSamplingTime;
+    UInt32                  fMinAveragingInterval;
+    UInt32                  fMaxAveragingInterval;
+    UInt32                  fMeasurementAccuracy;   // thousandths of a percent
+
+    // last published _BST (for accuracy-based suppression)
+    PublishedBST            fPublished;
     bool                    fBatteryPresent;
     bool                    fACConnected;
 	bool                    fACChargeCapable;
@@ -296,18 +597,32 @@ public:
     void    setPollingInterval(int milliSeconds);
 
     bool    pollBatteryState(int path);
+    bool    requestBatteryPoll(int path, int priority);
+    void    requestWakePoll(void);
+    void    completeBatteryRead(void);
     
     IOReturn setPowerState(unsigned long which, IOService *whom);
 
     void    handleBatteryInserted(void);
     
     void    handleBatteryRemoved(void);
+
+    void    handleBatteryNotify(void);
+
+    void    invalidateStaticInfo(void);
 	
 	IOReturn handleSystemSleepWake(IOService *powerSource, bool isSystemSleep);
+    IOReturn handleFullWake(void);
 	
     // For AC adapter notification
     void notifyConnectedState(bool connected);
 
+    virtual IOReturn setProperties(OSObject* properties);
+
+    // For ACPIBatteryUserClient
+    IOReturn readWithMaxAge(uint32_t maxAgeMS, BatterySnapshot* snapshot);
+    IOReturn updateInterest(int group, bool registering);
+
 protected:
     
 	void    logReadError( const char *error_type,
@@ -317,6 +632,42 @@ protected:
     void    clearBatteryState(bool do_update);
 
     void    pollingTimeOut(void);
+    void    acSettleTimeOut(void);
+
+    IOReturn gatedUpdateInterest(int group, bool registering);
+    bool    isInterested(int group);
+    void    publishInterest(void);
+
+    void    routeFields(bool everything, int infoMethod);
+    bool    acceptField(int field, int method);
+    void    publishFieldRouting(void);
+
+    IOReturn startBurstSampling(uint32_t seconds);
+    void    burstTimeOut(void);
+    void    completeBurstRead(void);
+    void    recordBurstSample(uint64_t now, UInt32 status, UInt32 rate, UInt32 capacity, UInt32 voltage);
+    void    finishBurstSampling(bool resume);
+    IOReturn gatedReadWithMaxAge(uint32_t maxAgeMS, BatterySnapshot* snapshot, int priority);
+    IOReturn gatedNotifyConnectedState(bool connected);
+    void    checkACTransition(void);
+    void    checkNotifyWatchdog(void);
+    void    scheduleReadRetry(UInt32 methods, bool incomplete);
+    void    retryTimeOut(void);
+    void    noteSampleTime(void);
+    void    cancelFreshReads(void);
+
+    UInt32  pollCost(int path);
+    bool    isStaticInfoStale(void);
+    bool    useBulkMethod(void);
+    uint32_t pollingIntervalFloor(void);
+    uint32_t nextPollingInterval(void);
+    void    schedulePoll(void);
+    void    armPollTimer(uint32_t milliSeconds);
+    void    publishPollStatistics(void);
+
+    void    updateTripPoint(UInt32 currentStatus);
+    void    negotiateAveraging(void);
+    void    publishSamplingBounds(void);
     
     void    incompleteReadTimeOut(void);
 
@@ -331,7 +682,7 @@ private:
 	UInt32   fDesignVoltage;
 	UInt32   fCurrentVoltage;
 	UInt32   fDesignCapacity, fDesignCapacityRaw;
-	UInt32   fCurrentCapacity;
+	UInt32   fCurrentCapacity, fCurrentCapacityRaw;
 	UInt32	 fBatteryTechnology;
 	UInt32   fMaxCapacity, fMaxCapacityRaw;
 	UInt32   fCurrentRate;
@@ -362,12 +713,21 @@ private:
 
     int fStartupFastPoll;
 
+    // previous sample, for the adaptive poll scheduler
+    uint64_t fLastSampleTime;
+    UInt32   fLastSampleCapacity;
+    UInt32   fLastSampleRate;
+
+    // EC refresh cadence, learned from repeated identical _BST packages
+    ECRefreshTracker fECRefresh;
+
 public:
 
 	IOReturn setBatterySTA(UInt32 battery_status);
 	IOReturn setBatteryBIF(OSArray *acpibat_bif);
 	IOReturn setBatteryBIX(OSArray *acpibat_bix);
 	IOReturn setBatteryBBIX(OSArray *acpibat_bbix);
+	IOReturn setBatterySBS(const UInt16 *sbs);
 	IOReturn setBatteryBST(OSArray *acpibat_bst);
 
 };
@@ -24,10 +24,14 @@
 #include <IOKit/pwr_mgt/RootDomain.h>
 #include <IOKit/IOCommandGate.h>
 #include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOInterruptEventSource.h>
 #include <libkern/version.h>
+#include <mach/thread_policy.h>
 
+#include "IOPMPrivate.h"
 #include "AppleSmartBatteryManager.h"
 #include "AppleSmartBattery.h"
+#include "SmartBatterySystem.h"
 
 //REVIEW: avoids problem with Xcode 5.1.0 where -dead_strip eliminates these required symbols
 #include <libkern/OSKextLib.h>
@@ -42,6 +46,24 @@ enum {
     kMyOnPowerState = 1
 };
 
+enum {
+    kWorkerPrecedence = -10,        // ACPI worker runs below normal kernel threads
+    kWorkerStopTimeout = 5000,      // ms stop waits for a read stuck in AML before detaching the worker
+    kBreakerThreshold = 3,          // consecutive failures that open a breaker
+    kBreakerBackoffMin = 30000,     // first recovery probe (ms), doubled per failed probe
+    kBreakerBackoffMax = 3600000,
+    kDefaultECCrossCheckInterval = 20, // direct EC reads between _BST cross-checks
+    kECMismatchLimit = 2,           // consecutive cross-check mismatches that disable the EC map
+    kLatencyDecayShift = 3,         // latency average weighs each new sample 1/8
+};
+
+// methods that have a fallback while their breaker is open
+#define kBreakerMethods (ACPIMethodBit(kACPIMethodBIX) | ACPIMethodBit(kACPIMethodBBIX) \
+                        | ACPIMethodBit(kACPIMethodSBS) | ACPIMethodBit(kACPIMethodEC) | ACPIMethodBit(kACPIMethodBALL))
+
+// not on the battery's device: set by the AC adapter / SBS / EC backends, kept across probes
+#define kForeignMethods (ACPIMethodBit(kACPIMethodPSR) | ACPIMethodBit(kACPIMethodSBS) | ACPIMethodBit(kACPIMethodEC))
+
 static IOPMPowerState myTwoStates[2] = {
     {kIOPMPowerStateVersion1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
     {kIOPMPowerStateVersion1, kIOPMPowerOn, kIOPMPowerOn, kIOPMPowerOn, 0, 0, 0, 0, 0, 0, 0, 0}
@@ -72,6 +94,13 @@ bool AppleSmartBatteryManager::init(OSDictionary *dict)
 void AppleSmartBatteryManager::free(void)
 {
     DebugLog("AppleSmartBatteryManager::free: Freeing\n");
+    // a detached worker holds a reference until it exits, so these outlive it
+    if (fWorkerLock)
+    {
+        IOLockFree(fWorkerLock);
+        fWorkerLock = NULL;
+    }
+    OSSafeReleaseNULL(fSBS);
     super::free();
 }
 
@@ -111,6 +140,103 @@ bool AppleSmartBatteryManager::start(IOService *provider)
     }
     
     fBatteryServices = OSSet::withCapacity(1);
+
+    // guards the governor and the method map, both shared with the AC adapter
+    fGovernorLock = IOLockAlloc();
+    if (!fGovernorLock)
+        return false;
+
+    // probe ACPI methods once; re-probed only on Notify 0x81
+    fACPIMethods = 0;
+    fACPIMethodProbes = 0;
+    probeACPIMethods();
+    for (int i = 0; i < kACPIMethodCount; i++)
+    {
+        fMethodFailures[i] = 0;
+        fMethodTimeouts[i] = 0;
+        fMethodTimeTotal[i] = 0;
+        fMethodTimeCount[i] = 0;
+        fMethodTimeMax[i] = 0;
+        fMethodLatency[i] = 0;
+        fBreakerTrips[i] = 0;
+        fBreakerRecoveries[i] = 0;
+    }
+
+    // governor is unlimited until the battery loads its configuration
+    fGovernorBudget.set(0, GetUptimeMS());
+    fGovernorMerged = 0;
+    resetBreakers();
+    for (int i = 0; i < kACPIPriorityCount; i++)
+    {
+        fGovernorAdmitted[i] = 0;
+        fGovernorDeferred[i] = 0;
+    }
+
+    // Notify coalescing is off until the battery loads its configuration
+    fNotifyCoalesceWindow = 0;
+    fNotifyWindowEnd = 0;
+    fNotifyTrailingPending = false;
+    fNotifySTAPending = false;
+    fNotifiesRaw = 0;
+    fNotifiesServiced = 0;
+    fNotifiesCoalesced = 0;
+    fNotifiesInformation = 0;
+    fNotifyPendingCodes = 0;
+    fNotifyPendingTime = 0;
+    fNotifyUnservicedTime = 0;
+    fNotifyServicingTime = 0;
+    fNotifyLatencyTotal = 0;
+    fNotifyLatencyCount = 0;
+    fNotifyLatencyLast = 0;
+    fNotifyLatencyMax = 0;
+    fNotifyTimer = IOTimerEventSource::timerEventSource(this,
+        OSMemberFunctionCast(IOTimerEventSource::Action, this, &AppleSmartBatteryManager::notifyWindowTimeOut));
+    if (!fNotifyTimer || kIOReturnSuccess != wl->addEventSource(fNotifyTimer))
+        return false;
+    // same workloop as fBatteryGate, so Notify handling is serialized with battery reads
+    fNotifyIntake = IOInterruptEventSource::interruptEventSource(this,
+        OSMemberFunctionCast(IOInterruptEventSource::Action, this, &AppleSmartBatteryManager::notifyIntakeOccurred));
+    if (!fNotifyIntake || kIOReturnSuccess != wl->addEventSource(fNotifyIntake))
+        return false;
+
+    // worker thread for poll ACPI reads; results come back through fReadCompletion
+    fWorkerLock = IOLockAlloc();
+    if (!fWorkerLock)
+        return false;
+    fWorkerRunning = false;
+    fWorkerStop = false;
+    fAsyncReads = true;
+    fWorkerRequest = NULL;
+    fWorkerDone = NULL;
+    fSBS = NULL;
+    fECCrossCheckInterval = kDefaultECCrossCheckInterval;
+    fECReadsSinceCheck = 0;
+    fECDirectReads = 0;
+    fECCrossChecks = 0;
+    fECMismatches = 0;
+    fECMismatchesTotal = 0;
+    fECUnstableReads = 0;
+    fReadCompletion = IOInterruptEventSource::interruptEventSource(this,
+        OSMemberFunctionCast(IOInterruptEventSource::Action, this, &AppleSmartBatteryManager::readCompleted));
+    if (!fReadCompletion || kIOReturnSuccess != wl->addEventSource(fReadCompletion))
+        return false;
+    thread_t worker;
+    fWorkerRunning = true;
+    // the worker's reference, dropped when it exits (see stopWorker)
+    retain();
+    if (KERN_SUCCESS == kernel_thread_start(&AppleSmartBatteryManager::workerMain, this, &worker))
+    {
+        thread_precedence_policy_data_t precedence = { kWorkerPrecedence };
+        thread_policy_set(worker, THREAD_PRECEDENCE_POLICY, (thread_policy_t)&precedence, THREAD_PRECEDENCE_POLICY_COUNT);
+        thread_deallocate(worker);
+    }
+    else
+    {
+        AlwaysLog("unable to start ACPI worker thread, reads stay on the workloop\n");
+        fWorkerRunning = false;
+        release();
+    }
+    setProperty("Async ACPI Reads", fWorkerRunning);
     
     OSDictionary * serviceMatch = serviceMatching("AppleSmartBattery");
     
@@ -141,6 +267,17 @@ bool AppleSmartBatteryManager::start(IOService *provider)
         //IOSleep(15000);
     }
 
+    // capability changes tell dark wake from full wake as they happen;
+    // until the first one, go by the root domain's current capabilities
+    fSystemCapabilities = kIOPMSystemCapabilityCPU | kIOPMSystemCapabilityGraphics;
+    fCapabilityNotifier = NULL;
+    if (IOPMrootDomain* root = getPMRootDomain())
+    {
+        if (OSNumber* capabilities = OSDynamicCast(OSNumber, root->getProperty(kIOPMSystemCapabilitiesKey)))
+            fSystemCapabilities = capabilities->unsigned32BitValue();
+        fCapabilityNotifier = root->registerPrioritySleepWakeInterest(&AppleSmartBatteryManager::systemCapabilityChanged, this);
+    }
+
     // Join power management so that we can get a notification early during
     // wakeup to re-sample our battery data. We don't actually power manage
     // any devices.
@@ -214,6 +351,15 @@ void AppleSmartBatteryManager::stop(IOService *provider)
 {
 	DebugLog("AppleSmartBatteryManager::stop: called\n");
 
+    // no ACPI evaluation may outlive the battery
+    stopWorker();
+
+    if (fCapabilityNotifier)
+    {
+        fCapabilityNotifier->remove();
+        fCapabilityNotifier = NULL;
+    }
+
     fBattery->detach(this);
     
     // Free device matching notifiers
@@ -225,20 +371,45 @@ void AppleSmartBatteryManager::stop(IOService *provider)
     fBatteryServices->flushCollection();
     OSSafeReleaseNULL(fBatteryServices);
     
-    fBattery->free();
     fBattery->stop(this);
     fBattery->terminate();
-    fBattery = NULL;
+    OSSafeReleaseNULL(fBattery);
     
     IOWorkLoop *wl = getWorkLoop();
     if (wl) {
         wl->removeEventSource(fBatteryGate);
     }
 
+    if (fNotifyTimer)
+    {
+        fNotifyTimer->cancelTimeout();
+        if (wl)
+            wl->removeEventSource(fNotifyTimer);
+        OSSafeReleaseNULL(fNotifyTimer);
+    }
+    if (fNotifyIntake)
+    {
+        if (wl)
+            wl->removeEventSource(fNotifyIntake);
+        OSSafeReleaseNULL(fNotifyIntake);
+    }
+    if (fReadCompletion)
+    {
+        if (wl)
+            wl->removeEventSource(fReadCompletion);
+        OSSafeReleaseNULL(fReadCompletion);
+    }
+
     fBatteryGate->free();
     fBatteryGate = NULL;
     
 	PMstop();
+
+    if (fGovernorLock)
+    {
+        IOLockFree(fGovernorLock);
+        fGovernorLock = NULL;
+    }
     
     super::stop(provider);
 }
@@ -303,6 +474,126 @@ bool AppleSmartBatteryManager::areBatteriesDischarging(AppleSmartBattery * excep
     return false;
 }
 
+/******************************************************************************
+ * AppleSmartBatteryManager::isSystemInDarkWake
+ *
+ * Dark wake (Power Nap, maintenance): CPU is up but graphics is not.
+ * With capability change messages, graphics counts as up only once it
+ * was announced, so a wake is dark until systemCapabilityChanged says
+ * otherwise. The root domain property is only the fallback: read from
+ * setPowerState it may still describe the state before the wake.
+ ******************************************************************************/
+
+bool AppleSmartBatteryManager::isSystemInDarkWake(void)
+{
+    if (fCapabilityNotifier)
+        return !(fSystemCapabilities & kIOPMSystemCapabilityGraphics);
+
+    IOPMrootDomain* root = getPMRootDomain();
+    if (!root)
+        return false;
+
+    OSNumber* capabilities = OSDynamicCast(OSNumber, root->getProperty(kIOPMSystemCapabilitiesKey));
+    if (!capabilities)
+        return false;
+
+    uint64_t caps = capabilities->unsigned64BitValue();
+    return (caps & kIOPMSystemCapabilityCPU) && !(caps & kIOPMSystemCapabilityGraphics);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::setACPIBudget
+ *
+ * Evaluations per minute allowed across all poll triggers (0 = unlimited).
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::setACPIBudget(UInt32 evaluationsPerMinute)
+{
+    IOLockLock(fGovernorLock);
+    fGovernorBudget.set(evaluationsPerMinute, GetUptimeMS());
+    IOLockUnlock(fGovernorLock);
+    setProperty("ACPI Evaluations Per Minute", evaluationsPerMinute, 32);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::requestACPIBudget
+ *
+ * Every path that evaluates battery/AC methods asks here first (see
+ * ACPIBudget for who is admitted when). When a request is refused, *retryMS
+ * is how long until it would be admitted; the caller keeps it pending,
+ * merged with whatever else queues up meanwhile.
+ ******************************************************************************/
+
+bool AppleSmartBatteryManager::requestACPIBudget(int priority, UInt32 evaluations, uint32_t* retryMS)
+{
+    if (priority < 0 || priority >= kACPIPriorityCount)
+        priority = kACPIPriorityTimer;
+
+    IOLockLock(fGovernorLock);
+    bool limited = fGovernorBudget.perMinute;
+    bool admitted = fGovernorBudget.request(priority, evaluations, GetUptimeMS(), retryMS);
+    if (admitted)
+        ++fGovernorAdmitted[priority];
+    else
+        ++fGovernorDeferred[priority];
+    IOLockUnlock(fGovernorLock);
+
+    if (limited)
+        publishGovernorStatistics();
+    return admitted;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::noteACPIRequestMerged
+ * A refused request was folded into one already pending
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::noteACPIRequestMerged(void)
+{
+    IOLockLock(fGovernorLock);
+    ++fGovernorMerged;
+    IOLockUnlock(fGovernorLock);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::publishGovernorStatistics
+ *
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::publishGovernorStatistics(void)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(10);
+    if (!dict)
+        return;
+
+    IOLockLock(fGovernorLock);
+    int64_t tokens = fGovernorBudget.available();
+    struct { const char* key; uint32_t value; } stats[] =
+    {
+        { "BudgetPerMinute", fGovernorBudget.perMinute },
+        { "TokensAvailable", tokens > 0 ? (uint32_t)tokens : 0 },
+        { "BurstAdmitted", fGovernorAdmitted[kACPIPriorityBurst] },
+        { "BurstDeferred", fGovernorDeferred[kACPIPriorityBurst] },
+        { "TimerAdmitted", fGovernorAdmitted[kACPIPriorityTimer] },
+        { "TimerDeferred", fGovernorDeferred[kACPIPriorityTimer] },
+        { "NotifyAdmitted", fGovernorAdmitted[kACPIPriorityNotify] },
+        { "NotifyDeferred", fGovernorDeferred[kACPIPriorityNotify] },
+        { "WakeAdmitted", fGovernorAdmitted[kACPIPriorityWake] },
+        { "Merged", fGovernorMerged },
+    };
+    IOLockUnlock(fGovernorLock);
+
+    for (unsigned i = 0; i < sizeof(stats)/sizeof(stats[0]); i++)
+    {
+        if (OSNumber* num = OSNumber::withNumber(stats[i].value, 32))
+        {
+            dict->setObject(stats[i].key, num);
+            num->release();
+        }
+    }
+    setProperty("ACPI Governor", dict);
+    dict->release();
+}
 
 /******************************************************************************
  * AppleSmartBatteryManager::setPollingInterval
@@ -345,201 +636,1478 @@ IOReturn AppleSmartBatteryManager::setPowerState(unsigned long which, IOService
     return ret;
 }
 
+/******************************************************************************
+ * AppleSmartBatteryManager::systemCapabilityChanged
+ *
+ * Root domain capability changes (priority sleep/wake interest). Graphics
+ * coming up is the full wake signal: a full read deferred by a dark wake
+ * is started right away.
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryManager::systemCapabilityChanged(void* target, void* refCon, UInt32 messageType,
+                                                           IOService* provider, void* messageArgument, vm_size_t argSize)
+{
+    AppleSmartBatteryManager* self = (AppleSmartBatteryManager*)target;
+    IOPMSystemCapabilityChangeParameters* params = (IOPMSystemCapabilityChangeParameters*)messageArgument;
+    if (kIOMessageSystemCapabilityChange != messageType || !self || !params)
+        return kIOReturnSuccess;
+
+    DebugLog("systemCapabilityChanged: flags 0x%x, 0x%x -> 0x%x\n", params->changeFlags, params->fromCapabilities, params->toCapabilities);
+    self->fSystemCapabilities = params->toCapabilities;
+
+    if ((params->changeFlags & kIOPMSystemCapabilityDidChange)
+        && (params->toCapabilities & kIOPMSystemCapabilityGraphics)
+        && !(params->fromCapabilities & kIOPMSystemCapabilityGraphics)
+        && self->fBatteryGate && self->fBattery)
+    {
+        self->fBatteryGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, self->fBattery, &AppleSmartBattery::handleFullWake));
+    }
+    return kIOReturnSuccess;
+}
+
 /******************************************************************************
  * AppleSmartBatteryManager::message
  *
+ * Runs on the ACPI notify thread, which every other ACPI device waits on:
+ * record the Notify and wake the workloop, evaluate nothing here.
  ******************************************************************************/
 
-IOReturn AppleSmartBatteryManager::message(UInt32 type, IOService *provider, void *argument)
+enum
 {
-    UInt32 batterySTA;
+    kNotifyPendingStatus        = 1 << 0,   // 0x80 or any other code
+    kNotifyPendingInformation   = 1 << 1,   // 0x81
+};
 
-	if( (kIOACPIMessageDeviceNotification == type)
-        && (kIOReturnSuccess == fProvider->evaluateInteger("_STA", &batterySTA))
-		&& fBatteryGate )
+IOReturn AppleSmartBatteryManager::message(UInt32 type, IOService *provider, void *argument)
+{
+	if( (kIOACPIMessageDeviceNotification == type) && fNotifyIntake )
 	{
-		if (batterySTA ^ fBatterySTA) 
-		{
-			if (batterySTA & BATTERY_PRESENT) 
-			{
-				// Battery inserted
-				DebugLog("battery inserted\n");
-				fBatteryGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, fBattery, &AppleSmartBattery::handleBatteryInserted));
-			}
-			else 
-			{
-				// Battery removed
-				DebugLog("battery removed\n");
-				fBatteryGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, fBattery, &AppleSmartBattery::handleBatteryRemoved));
-			}
-		}
-		else 
-		{
-            // Just an alarm; re-read battery state.
-			DebugLog("polling battery state\n");
-            fBatteryGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, fBattery, &AppleSmartBattery::pollBatteryState), (void*)kExistingBatteryPath);
-		}
+        UInt32 code = argument ? *(UInt32*)argument : 0;
+        OSIncrementAtomic(&fNotifiesRaw);
+        // time first: the workloop takes the codes, then the time
+        OSCompareAndSwap64(0, GetUptimeUS(), &fNotifyPendingTime);
+        OSBitOrAtomic(BATTERY_NOTIFY_INFORMATION == code ? kNotifyPendingInformation : kNotifyPendingStatus, &fNotifyPendingCodes);
+        fNotifyIntake->interruptOccurred(NULL, this, 0);
 	}
 
     return kIOReturnSuccess;
 }
 
 /******************************************************************************
- * AppleSmartBatteryManager::validateBatteryBIX
- * Verify that DSDT _BIX method exists
+ * AppleSmartBatteryManager::notifyIntakeOccurred
+ *
+ * Workloop side of message: takes every Notify recorded since the last
+ * call and hands them to gatedNotify as one. No ACPI here: _STA is read
+ * with the rest of the battery on the next read (see serviceNotify).
  ******************************************************************************/
-IOReturn AppleSmartBatteryManager::validateBatteryBIX(void)
+
+void AppleSmartBatteryManager::notifyIntakeOccurred(IOInterruptEventSource* sender, int count)
 {
-    return fProvider->validateObject("_BIX");
+    UInt32 codes;
+    do
+        codes = fNotifyPendingCodes;
+    while (codes && !OSCompareAndSwap(codes, 0, &fNotifyPendingCodes));
+    if (!codes)
+        return;
+    // 0 if a Notify racing this call already stamped the time we just cleared
+    UInt64 queued;
+    do
+        queued = fNotifyPendingTime;
+    while (queued && !OSCompareAndSwap64(queued, 0, &fNotifyPendingTime));
+    // latency runs until a read services it (see noteNotifyServiced)
+    if (queued && !fNotifyUnservicedTime)
+        fNotifyUnservicedTime = queued;
+
+    // one read covers both; Information also refreshes static info
+    if (fBattery)
+        gatedNotify((codes & kNotifyPendingInformation) ? BATTERY_NOTIFY_INFORMATION : BATTERY_NOTIFY_STATUS);
 }
 
 /******************************************************************************
- * AppleSmartBatteryManager::validateBatteryBBIX
- * Verify that DSDT _BBIX method exists
+ * AppleSmartBatteryManager::setNotifyCoalesceWindow
+ *
  ******************************************************************************/
-IOReturn AppleSmartBatteryManager::validateBatteryBBIX(void)
+
+void AppleSmartBatteryManager::setNotifyCoalesceWindow(UInt32 milliSeconds)
 {
-    return fProvider->validateObject("_BBIX");
+    fNotifyCoalesceWindow = milliSeconds;
+    setProperty("NotifyCoalesceWindow_msec", milliSeconds, 32);
 }
 
 /******************************************************************************
- * AppleSmartBatteryManager::getBatterySTA
- * Call DSDT _STA method to return battery device status
+ * AppleSmartBatteryManager::gatedNotify
+ *
+ * Notify storms collapse into one battery read per coalescing window: the
+ * first Notify is serviced right away (latency), later ones in the window
+ * leave a single read for when it closes (correctness). Insert/remove is
+ * only known once that read has _STA, so it waits for the window too.
  ******************************************************************************/
 
-IOReturn AppleSmartBatteryManager::getBatterySTA(void)
+void AppleSmartBatteryManager::gatedNotify(UInt32 code)
 {
-    DebugLog("getBatterySTA called\n");
-    
-    IOReturn evaluateStatus = fProvider->evaluateInteger("_STA", &fBatterySTA);
-	if (evaluateStatus == kIOReturnSuccess)
+    // cached static info and method map are stale now, even if this Notify is coalesced
+    if (BATTERY_NOTIFY_INFORMATION == code)
     {
-		return fBattery->setBatterySTA(fBatterySTA);
-	}
-    else 
+        ++fNotifiesInformation;
+        // breakers tripped on methods that are still there stay tripped
+        if (probeACPIMethods())
+            resetBreakers();
+        fBattery->invalidateStaticInfo();
+    }
+
+    uint64_t now = GetUptimeMS();
+    if (fNotifyCoalesceWindow && now < fNotifyWindowEnd)
     {
-        DebugLog("evaluateObject error 0x%x\n", evaluateStatus);
-		return kIOReturnError;
-	}
+        fNotifyTrailingPending = true;
+        ++fNotifiesCoalesced;
+        publishNotifyStatistics();
+        return;
+    }
+
+    serviceNotify();
+    if (fNotifyCoalesceWindow)
+    {
+        fNotifyTrailingPending = false;
+        fNotifyWindowEnd = now + fNotifyCoalesceWindow;
+        fNotifyTimer->setTimeoutMS(fNotifyCoalesceWindow);
+    }
 }
 
 /******************************************************************************
- * AppleSmartBatteryManager::getBatteryBIF
- * Call DSDT _BIF method to return ACPI 3.x battery info
+ * AppleSmartBatteryManager::notifyWindowTimeOut
+ * Coalescing window closed; service the Notify folded into it, if any
  ******************************************************************************/
 
-IOReturn AppleSmartBatteryManager::getBatteryBIF(void)
+void AppleSmartBatteryManager::notifyWindowTimeOut(void)
 {
-    DebugLog("getBatteryBIF called\n");
-    
-    OSObject *fBatteryBIF = NULL;
-    IOReturn evaluateStatus = fProvider->validateObject("_BIF");
-    DebugLog("validateObject return 0x%x\n", evaluateStatus);
-    
-    evaluateStatus = fProvider->evaluateObject("_BIF", &fBatteryBIF);
-	if (evaluateStatus == kIOReturnSuccess)
+    fNotifyWindowEnd = 0;
+    if (!fNotifyTrailingPending)
+        return;
+
+    // trailing read opens the next window, so a sustained storm is serviced once per window
+    fNotifyTrailingPending = false;
+    serviceNotify();
+    fNotifyWindowEnd = GetUptimeMS() + fNotifyCoalesceWindow;
+    fNotifyTimer->setTimeoutMS(fNotifyCoalesceWindow);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::serviceNotify
+ *
+ * Re-read battery state, _STA included: applyBatteryRead turns a change in
+ * it into an insert/remove. Caller must hold the gate.
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::serviceNotify(void)
+{
+    ++fNotifiesServiced;
+    publishNotifyStatistics();
+
+    // the next read planned (now, or once the governor or a read in flight
+    // lets it) takes this time, see takeNotifyTime
+    if (!fNotifyServicingTime)
+        fNotifyServicingTime = fNotifyUnservicedTime;
+    fNotifyUnservicedTime = 0;
+
+    DebugLog("polling battery state\n");
+    fNotifySTAPending = hasACPIMethod(kACPIMethodSTA);
+    fBattery->handleBatteryNotify();
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::takeNotifyTime
+ * The battery planned a read: it services the Notifies serviceNotify left
+ * waiting. Caller must hold the gate.
+ ******************************************************************************/
+
+uint64_t AppleSmartBatteryManager::takeNotifyTime(void)
+{
+    uint64_t queued = fNotifyServicingTime;
+    fNotifyServicingTime = 0;
+    return queued;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::noteNotifyServiced
+ * The read planned for a Notify was applied: count the time since the
+ * oldest Notify it covers. Caller must hold the gate.
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::noteNotifyServiced(uint64_t queued)
+{
+    uint64_t latency = GetUptimeUS() - queued;
+    fNotifyLatencyLast = (uint32_t)latency;
+    if (fNotifyLatencyLast > fNotifyLatencyMax)
+        fNotifyLatencyMax = fNotifyLatencyLast;
+    fNotifyLatencyTotal += latency;
+    ++fNotifyLatencyCount;
+    publishNotifyStatistics();
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::publishNotifyStatistics
+ *
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::publishNotifyStatistics(void)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(3);
+    if (!dict)
+        return;
+
+    struct { const char* key; uint32_t value; } stats[] =
+    {
+        { "Raw", (uint32_t)fNotifiesRaw },
+        { "Serviced", fNotifiesServiced },
+        { "Coalesced", fNotifiesCoalesced },
+        { "Information", fNotifiesInformation },
+        { "LatencyLast", fNotifyLatencyLast },
+        { "LatencyMax", fNotifyLatencyMax },
+        { "LatencyAverage", fNotifyLatencyCount ? (uint32_t)(fNotifyLatencyTotal / fNotifyLatencyCount) : 0 },
+    };
+    for (unsigned i = 0; i < sizeof(stats)/sizeof(stats[0]); i++)
     {
-        IOReturn value = kIOReturnError;
-        if (OSArray* acpibat_bif = OSDynamicCast(OSArray, fBatteryBIF))
+        if (OSNumber* num = OSNumber::withNumber(stats[i].value, 32))
         {
-            setProperty("Battery Information", acpibat_bif);
-            value = fBattery->setBatteryBIF(acpibat_bif);
+            dict->setObject(stats[i].key, num);
+            num->release();
         }
-        OSSafeReleaseNULL(fBatteryBIF);
-		return value;
-	} 
-    else 
+    }
+    setProperty("Notify Statistics", dict);
+    dict->release();
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::probeACPIMethods
+ * Record which battery methods the DSDT implements, absent ones included,
+ * so no evaluation path has to validate or fail on them again. True if
+ * that changed the map.
+ ******************************************************************************/
+
+static const char* acpiMethodNames[kACPIMethodCount] =
+{
+    "_STA", "_BIF", "_BIX", "BBIX", "_BST", "_BTP", "_BMA", "_BMS", "_PSR", "RMCF", "BALL", "_SBS", "EC",
+};
+
+bool AppleSmartBatteryManager::probeACPIMethods(void)
+{
+    UInt32 probed = 0;
+    for (int i = 0; i < kACPIMethodCount; i++)
     {
-        DebugLog("evaluateObject error 0x%x\n", evaluateStatus);
-		return kIOReturnError;
-	}
+        if (!(kForeignMethods & ACPIMethodBit(i)) && kIOReturnSuccess == fProvider->validateObject(acpiMethodNames[i]))
+            probed |= ACPIMethodBit(i);
+    }
+
+    // _PSR, _SBS and EC are not on this device and are set from other
+    // threads (AC adapter start): keep what was reported for them
+    IOLockLock(fGovernorLock);
+    UInt32 previous = fACPIMethods;
+    UInt32 methods = (previous & kForeignMethods) | probed;
+    fACPIMethods = methods;
+    IOLockUnlock(fGovernorLock);
+
+    bool changed = fACPIMethodProbes && methods != previous;
+    if (changed)
+        AlwaysLog("ACPI methods changed: 0x%x -> 0x%x\n", (unsigned)previous, (unsigned)methods);
+    ++fACPIMethodProbes;
+    publishACPIMethods();
+    return changed;
+}
+
+void AppleSmartBatteryManager::setACPIMethod(int method, bool present)
+{
+    IOLockLock(fGovernorLock);
+    if (present)
+        fACPIMethods |= ACPIMethodBit(method);
+    else
+        fACPIMethods &= ~ACPIMethodBit(method);
+    IOLockUnlock(fGovernorLock);
+    publishACPIMethods();
+}
+
+void AppleSmartBatteryManager::publishACPIMethods(void)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(kACPIMethodCount);
+    if (!dict)
+        return;
+    UInt32 methods = fACPIMethods;
+    for (int i = 0; i < kACPIMethodCount; i++)
+        dict->setObject(acpiMethodNames[i], (methods & ACPIMethodBit(i)) ? kOSBooleanTrue : kOSBooleanFalse);
+    setProperty("ACPI Methods", dict);
+    dict->release();
+}
+
+const char* AppleSmartBatteryManager::getACPIMethodName(int method)
+{
+    return method >= 0 && method < kACPIMethodCount ? acpiMethodNames[method] : "";
 }
 
 /******************************************************************************
- * AppleSmartBatteryManager::getBatteryBIX
- * Call DSDT _BIX method to return ACPI 4.x battery info
+ * AppleSmartBatteryManager::getACPIMethodLatency
+ * Recent us per evaluation (see noteMethodTime), 0 if never measured.
+ * Caller must hold the gate with no read in flight.
  ******************************************************************************/
 
-IOReturn AppleSmartBatteryManager::getBatteryBIX(void)
+uint32_t AppleSmartBatteryManager::getACPIMethodLatency(int method)
 {
-    DebugLog("getBatteryBIX called\n");
-    
-    OSObject *fBatteryBIX = NULL;
-    IOReturn evaluateStatus = fProvider->evaluateObject("_BIX", &fBatteryBIX);
-	if (evaluateStatus == kIOReturnSuccess)
+    if (method < 0 || method >= kACPIMethodCount)
+        return 0;
+    return fMethodLatency[method];
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::isACPIMethodUsable
+ *
+ * False while the method's breaker is open. Once the backoff has passed the
+ * next caller gets to probe it; noteACPIMethodResult closes or re-opens it.
+ ******************************************************************************/
+
+bool AppleSmartBatteryManager::isACPIMethodUsable(int method)
+{
+    if (!hasACPIMethod(method))
+        return false;
+    IOLockLock(fGovernorLock);
+    bool usable = !fBreakerOpenUntil[method] || GetUptimeMS() >= fBreakerOpenUntil[method];
+    IOLockUnlock(fGovernorLock);
+    return usable;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::noteACPIMethodResult
+ *
+ * kBreakerThreshold failures in a row (evaluation errors, timeouts or a
+ * malformed package) open the breaker; a failed probe doubles the backoff.
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::noteACPIMethodResult(int method, bool success)
+{
+    if (method < 0 || method >= kACPIMethodCount || !(kBreakerMethods & ACPIMethodBit(method)))
+        return;
+
+    IOLockLock(fGovernorLock);
+    bool changed = false;
+    if (success)
     {
-        IOReturn value = kIOReturnError;
-		if (OSArray* acpibat_bix = OSDynamicCast(OSArray, fBatteryBIX))
+        if (fBreakerOpenUntil[method])
         {
-            setProperty("Battery Extended Information", acpibat_bix);
-            value = fBattery->setBatteryBIX(acpibat_bix);
+            AlwaysLog("%s recovered, breaker closed\n", acpiMethodNames[method]);
+            fBreakerOpenUntil[method] = 0;
+            fBreakerBackoff[method] = 0;
+            ++fBreakerRecoveries[method];
+            changed = true;
         }
-		OSSafeReleaseNULL(fBatteryBIX);
-		return value;
-	}
-    else 
+        changed |= fBreakerFailures[method] != 0;
+        fBreakerFailures[method] = 0;
+    }
+    else
     {
-        DebugLog("evaluateObject error 0x%x\n", evaluateStatus);
-		return kIOReturnError;
-	}
+        ++fBreakerFailures[method];
+        changed = true;
+        if (fBreakerOpenUntil[method])
+        {
+            fBreakerBackoff[method] *= 2;
+            if (fBreakerBackoff[method] > kBreakerBackoffMax)
+                fBreakerBackoff[method] = kBreakerBackoffMax;
+            fBreakerOpenUntil[method] = GetUptimeMS() + fBreakerBackoff[method];
+        }
+        else if (fBreakerFailures[method] >= kBreakerThreshold)
+        {
+            AlwaysLog("%s failed %u times in a row, breaker open (using fallback)\n",
+                      acpiMethodNames[method], (unsigned)fBreakerFailures[method]);
+            fBreakerBackoff[method] = kBreakerBackoffMin;
+            fBreakerOpenUntil[method] = GetUptimeMS() + kBreakerBackoffMin;
+            ++fBreakerTrips[method];
+        }
+    }
+    IOLockUnlock(fGovernorLock);
+
+    if (changed)
+        publishBreakers();
+}
+
+void AppleSmartBatteryManager::resetBreakers(void)
+{
+    IOLockLock(fGovernorLock);
+    for (int i = 0; i < kACPIMethodCount; i++)
+    {
+        fBreakerFailures[i] = 0;
+        fBreakerOpenUntil[i] = 0;
+        fBreakerBackoff[i] = 0;
+    }
+    IOLockUnlock(fGovernorLock);
+    publishBreakers();
 }
 
 /******************************************************************************
- * AppleSmartBatteryManager::getBatteryBBIX
- * Call DSDT BBIX method to return all battery info (non-standard)
+ * AppleSmartBatteryManager::publishBreakers
+ * "ACPI Breakers": State (Closed/Open/Probing) and counts per method
  ******************************************************************************/
 
-IOReturn AppleSmartBatteryManager::getBatteryBBIX(void)
+void AppleSmartBatteryManager::publishBreakers(void)
 {
-    DebugLog("getBatteryBBIX called\n");
+    OSDictionary* dict = OSDictionary::withCapacity(3);
+    if (!dict)
+        return;
 
-	OSObject * fBatteryBBIX = NULL;
-    IOReturn evaluateStatus = fProvider->evaluateObject("BBIX", &fBatteryBBIX);
-	if (evaluateStatus == kIOReturnSuccess)
+    uint64_t now = GetUptimeMS();
+    for (int i = 0; i < kACPIMethodCount; i++)
     {
-        IOReturn value = kIOReturnError;
-		if (OSArray* acpibat_bbix = OSDynamicCast(OSArray, fBatteryBBIX))
+        if (!(kBreakerMethods & ACPIMethodBit(i)) || !hasACPIMethod(i))
+            continue;
+        OSDictionary* breaker = OSDictionary::withCapacity(5);
+        if (!breaker)
+            continue;
+
+        IOLockLock(fGovernorLock);
+        const char* state = !fBreakerOpenUntil[i] ? "Closed" : now < fBreakerOpenUntil[i] ? "Open" : "Probing";
+        struct { const char* key; uint32_t value; } stats[] =
+        {
+            { "ConsecutiveFailures", fBreakerFailures[i] },
+            { "Backoff", fBreakerBackoff[i] },
+            { "Trips", fBreakerTrips[i] },
+            { "Recoveries", fBreakerRecoveries[i] },
+        };
+        IOLockUnlock(fGovernorLock);
+
+        if (OSString* str = OSString::withCString(state))
         {
-            setProperty("Battery Extra Information", acpibat_bbix);
-            value = fBattery->setBatteryBBIX(acpibat_bbix);
+            breaker->setObject("State", str);
+            str->release();
         }
-		OSSafeReleaseNULL(fBatteryBBIX);
-		return value;
-	} 
-    else 
-    {
-        DebugLog("evaluateObject error 0x%x\n", evaluateStatus);
-		return kIOReturnError;
-	}
+        for (unsigned j = 0; j < sizeof(stats)/sizeof(stats[0]); j++)
+        {
+            if (OSNumber* num = OSNumber::withNumber(stats[j].value, 32))
+            {
+                breaker->setObject(stats[j].key, num);
+                num->release();
+            }
+        }
+        dict->setObject(acpiMethodNames[i], breaker);
+        breaker->release();
+    }
+    setProperty("ACPI Breakers", dict);
+    dict->release();
 }
 
 /******************************************************************************
- * AppleSmartBatteryManager::getBatteryBST
- * Call DSDT _BST method to return the battery state
+ * AppleSmartBatteryManager::validateBatteryBIX
+ * Verify that DSDT _BIX method exists
  ******************************************************************************/
+IOReturn AppleSmartBatteryManager::validateBatteryBIX(void)
+{
+    return hasACPIMethod(kACPIMethodBIX) ? kIOReturnSuccess : kIOReturnNotFound;
+}
 
-IOReturn AppleSmartBatteryManager::getBatteryBST(void)
+/******************************************************************************
+ * AppleSmartBatteryManager::validateBatteryBBIX
+ * Verify that DSDT BBIX method exists
+ ******************************************************************************/
+IOReturn AppleSmartBatteryManager::validateBatteryBBIX(void)
 {
-    DebugLog("getBatteryBST called\n");
+    return hasACPIMethod(kACPIMethodBBIX) ? kIOReturnSuccess : kIOReturnNotFound;
+}
 
-	OSObject *fBatteryBST = NULL;
-    IOReturn evaluateStatus = fProvider->evaluateObject("_BST", &fBatteryBST);
-	if (evaluateStatus == kIOReturnSuccess)
-	{
-        IOReturn value = kIOReturnError;
-		if (OSArray* acpibat_bst = OSDynamicCast(OSArray, fBatteryBST))
-        {
-            setProperty("Battery Status", acpibat_bst);
-            value = fBattery->setBatteryBST(acpibat_bst);
-        }
-		OSSafeReleaseNULL(fBatteryBST);
-		return value;
-	}
-	else
-	{
-        DebugLog("evaluateObject error 0x%x\n", evaluateStatus);
-		return kIOReturnError;
-	}
+/******************************************************************************
+ * AppleSmartBatteryManager::validateBatteryBTP
+ * Verify that DSDT _BTP method exists
+ ******************************************************************************/
+IOReturn AppleSmartBatteryManager::validateBatteryBTP(void)
+{
+    return hasACPIMethod(kACPIMethodBTP) ? kIOReturnSuccess : kIOReturnNotFound;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::validateBatteryBMA
+ * Verify that DSDT _BMA method exists
+ ******************************************************************************/
+IOReturn AppleSmartBatteryManager::validateBatteryBMA(void)
+{
+    return hasACPIMethod(kACPIMethodBMA) ? kIOReturnSuccess : kIOReturnNotFound;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::validateBatteryBMS
+ * Verify that DSDT _BMS method exists
+ ******************************************************************************/
+IOReturn AppleSmartBatteryManager::validateBatteryBMS(void)
+{
+    return hasACPIMethod(kACPIMethodBMS) ? kIOReturnSuccess : kIOReturnNotFound;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::setSmartBatterySystem
+ * Looks for the SMBus host controller once; false if there is none
+ ******************************************************************************/
+
+bool AppleSmartBatteryManager::setSmartBatterySystem(bool enable)
+{
+    if (enable && !fSBS)
+    {
+        fSBS = ACPISmartBatterySystem::smartBatterySystem();
+        if (fSBS)
+            AlwaysLog("Smart Battery System at EC offset 0x%x\n", fSBS->getBase());
+        else
+            AlwaysLog("UseSmartBatterySystem: no ACPI0001 SMBus host controller\n");
+    }
+    setACPIMethod(kACPIMethodSBS, enable && fSBS);
+    return enable && fSBS;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::setECRegisterMap
+ *
+ * ECRegisterMap (RMCF only): Status, Rate, RemainingCapacity and Voltage,
+ * each { Offset (bytes), Width (bits, default 16), BigEndian, Signed,
+ * Scale (to _BST units, default 1) }, plus CrossCheckInterval. Status may
+ * also give DischargingMask, ChargingMask and CriticalMask, the EC bits for
+ * each _BST state bit. An empty or incomplete map leaves _BST alone.
+ ******************************************************************************/
+
+static const char* ecRegisterNames[BST_FIELD_COUNT] =
+{
+    "Status", "Rate", "RemainingCapacity", "Voltage",
+};
+
+bool AppleSmartBatteryManager::setECRegisterMap(OSDictionary* map)
+{
+    bool valid = map && map->getCount();
+    for (int i = 0; valid && i < BST_FIELD_COUNT; i++)
+    {
+        OSDictionary* field = OSDynamicCast(OSDictionary, map->getObject(ecRegisterNames[i]));
+        OSNumber* offset = field ? OSDynamicCast(OSNumber, field->getObject("Offset")) : NULL;
+        if (!offset)
+        {
+            AlwaysLog("ECRegisterMap: no Offset for %s, using _BST\n", ecRegisterNames[i]);
+            valid = false;
+            break;
+        }
+        ECRegister& reg = fECRegisters[i];
+        reg.offset = offset->unsigned16BitValue();
+        reg.width = 2;
+        if (OSNumber* width = OSDynamicCast(OSNumber, field->getObject("Width")))
+            reg.width = width->unsigned32BitValue() / 8;
+        if (1 != reg.width && 2 != reg.width && 4 != reg.width)
+        {
+            AlwaysLog("ECRegisterMap: bad Width for %s, using _BST\n", ecRegisterNames[i]);
+            valid = false;
+            break;
+        }
+        OSBoolean* flag = OSDynamicCast(OSBoolean, field->getObject("BigEndian"));
+        reg.bigEndian = flag && flag->isTrue();
+        flag = OSDynamicCast(OSBoolean, field->getObject("Signed"));
+        reg.isSigned = flag && flag->isTrue();
+        reg.scale = 1;
+        if (OSNumber* scale = OSDynamicCast(OSNumber, field->getObject("Scale")))
+            reg.scale = scale->unsigned32BitValue();
+        if (!reg.scale)
+            reg.scale = 1;
+        reg.dischargingMask = reg.chargingMask = reg.criticalMask = 0;
+        if (BST_STATUS == i)
+        {
+            if (OSNumber* mask = OSDynamicCast(OSNumber, field->getObject("DischargingMask")))
+                reg.dischargingMask = mask->unsigned32BitValue();
+            if (OSNumber* mask = OSDynamicCast(OSNumber, field->getObject("ChargingMask")))
+                reg.chargingMask = mask->unsigned32BitValue();
+            if (OSNumber* mask = OSDynamicCast(OSNumber, field->getObject("CriticalMask")))
+                reg.criticalMask = mask->unsigned32BitValue();
+        }
+    }
+
+    fECCrossCheckInterval = kDefaultECCrossCheckInterval;
+    if (OSNumber* interval = valid ? OSDynamicCast(OSNumber, map->getObject(kECCrossCheckIntervalKey)) : NULL)
+        fECCrossCheckInterval = interval->unsigned32BitValue();
+    // first direct read is verified against _BST right away
+    fECReadsSinceCheck = fECCrossCheckInterval;
+    fECMismatches = 0;
+    setACPIMethod(kACPIMethodEC, valid);
+    publishECStatistics();
+    return valid;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::batteryStatusMethods
+ * What a poll reads for battery status: _BST, or the EC registers, with
+ * _BST as well when a cross-check is due (see crossCheckECRegisters)
+ ******************************************************************************/
+
+UInt32 AppleSmartBatteryManager::batteryStatusMethods(void)
+{
+    if (!isACPIMethodUsable(kACPIMethodEC))
+        return ACPIMethodBit(kACPIMethodBST);
+    UInt32 methods = ACPIMethodBit(kACPIMethodEC);
+    if (fECCrossCheckInterval && fECReadsSinceCheck >= fECCrossCheckInterval && hasACPIMethod(kACPIMethodBST))
+        methods |= ACPIMethodBit(kACPIMethodBST);
+    return methods;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::readECRegister
+ * One field through readECField (ECRegisterMap.h): multi-byte fields must
+ * read the same twice in a row
+ ******************************************************************************/
+
+// EC address space of the battery's device, for readECField
+struct ECAddressSpace
+{
+    IOACPIPlatformDevice*   device;
+
+    int readByte(uint16_t offset, uint8_t* value)
+    {
+        IOACPIAddress address;
+        address.addr64 = offset;
+        UInt64 byte = 0;
+        IOReturn ret = device->readAddressSpace(&byte, kIOACPIAddressSpaceIDEmbeddedController, address, 8);
+        *value = (uint8_t)byte;
+        return ret;
+    }
+};
+
+IOReturn AppleSmartBatteryManager::readECRegister(const ECRegister& reg, UInt32* value)
+{
+    ECAddressSpace ec = { fProvider };
+    switch (readECField(&ec, reg, value))
+    {
+        case kECReadSuccess:
+            return kIOReturnSuccess;
+        case kECReadUnstable:
+            ++fECUnstableReads;
+            return kIOReturnNotReady;
+    }
+    return kIOReturnIOError;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::setAsyncACPIReads
+ *
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::setAsyncACPIReads(bool async)
+{
+    fAsyncReads = async;
+    setProperty("Async ACPI Reads", async && fWorkerRunning);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::startBatteryRead
+ *
+ * Evaluate the methods a poll planned. With async reads, the worker thread
+ * does the ACPI I/O (slow EC transactions included) outside the workloop and
+ * readCompleted hands the results back; otherwise they are evaluated here.
+ * Either way the battery's completeBatteryRead decodes them under the gate.
+ * Caller must hold the gate and have no other read outstanding.
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::startBatteryRead(BatteryRead* read)
+{
+    read->async = fAsyncReads && fWorkerRunning;
+    if (!read->async)
+    {
+        fetchBatteryRead(read);
+        fBattery->completeBatteryRead();
+        return;
+    }
+
+    IOLockLock(fWorkerLock);
+    fWorkerRequest = read;
+    IOLockWakeup(fWorkerLock, &fWorkerRequest, true);
+    IOLockUnlock(fWorkerLock);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::workerMain/workerLoop
+ *
+ * Worker thread: evaluates one BatteryRead at a time, then signals
+ * fReadCompletion so the results are decoded on the workloop. It holds a
+ * reference on the manager, and on the battery whose read it is evaluating,
+ * so a read stuck in AML past stop (see stopWorker) only drops its result.
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::workerMain(void* arg, wait_result_t result)
+{
+    AppleSmartBatteryManager* manager = static_cast<AppleSmartBatteryManager*>(arg);
+    manager->workerLoop();
+    manager->release();
+    thread_terminate(current_thread());
+}
+
+void AppleSmartBatteryManager::workerLoop(void)
+{
+    IOLockLock(fWorkerLock);
+    while (!fWorkerStop)
+    {
+        BatteryRead* read = fWorkerRequest;
+        if (!read || read == fWorkerDone)
+        {
+            IOLockSleep(fWorkerLock, &fWorkerRequest, THREAD_UNINT);
+            continue;
+        }
+        AppleSmartBattery* battery = fBattery;
+        battery->retain();
+        IOLockUnlock(fWorkerLock);
+        fetchBatteryRead(read);
+        IOLockLock(fWorkerLock);
+        if (fWorkerStop)
+        {
+            // stopped meanwhile: nobody will decode it
+            OSSafeReleaseNULL(read->info);
+            OSSafeReleaseNULL(read->extra);
+            OSSafeReleaseNULL(read->bst);
+        }
+        else
+        {
+            fWorkerDone = read;
+            fReadCompletion->interruptOccurred(NULL, this, 0);
+        }
+        battery->release();
+    }
+    fWorkerRunning = false;
+    IOLockWakeup(fWorkerLock, &fWorkerRunning, true);
+    IOLockUnlock(fWorkerLock);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::stopWorker
+ *
+ * Cancel any read in progress and wait for the worker thread to exit. The
+ * cancel is only seen between methods, so a read stuck in AML gets
+ * kWorkerStopTimeout; past that the worker is left to finish on its own
+ * and exit, holding the references it needs (see workerLoop).
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::stopWorker(void)
+{
+    if (!fWorkerLock)
+        return;
+    IOLockLock(fWorkerLock);
+    if (fWorkerRequest)
+        fWorkerRequest->cancelled = true;
+    fWorkerStop = true;
+    IOLockWakeup(fWorkerLock, &fWorkerRequest, true);
+    uint64_t deadline;
+    clock_interval_to_deadline(kWorkerStopTimeout, kMillisecondScale, &deadline);
+    while (fWorkerRunning)
+    {
+        if (THREAD_TIMED_OUT == IOLockSleepDeadline(fWorkerLock, &fWorkerRunning, deadline, THREAD_UNINT))
+        {
+            AlwaysLog("ACPI worker stuck in a read for %ums, detaching it\n", (unsigned)kWorkerStopTimeout);
+            break;
+        }
+    }
+    // a finished read readCompleted will never see
+    BatteryRead* done = fWorkerDone;
+    fWorkerDone = NULL;
+    fWorkerRequest = NULL;
+    IOLockUnlock(fWorkerLock);
+
+    if (done)
+    {
+        done->cancelled = true;
+        applyBatteryRead(done);
+    }
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::readCompleted
+ * Worker finished a read; decode it on the workloop
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::readCompleted(IOInterruptEventSource* sender, int count)
+{
+    IOLockLock(fWorkerLock);
+    BatteryRead* read = fWorkerDone;
+    fWorkerDone = NULL;
+    if (read == fWorkerRequest)
+        fWorkerRequest = NULL;
+    IOLockUnlock(fWorkerLock);
+
+    if (read && fBattery)
+        fBattery->completeBatteryRead();
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::evaluatePackage
+ * Evaluate one package-returning battery method into read (no decoding)
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryManager::evaluatePackage(BatteryRead* read, int method, OSArray** package,
+                                                   OSObject** params, IOItemCount paramCount)
+{
+    *package = NULL;
+    if (read->cancelled)
+        return kIOReturnAborted;
+    if (!hasACPIMethod(method))
+        return kIOReturnUnsupported;
+    // after one method overran its deadline the EC is likely stuck: skip the rest
+    if (read->timedOut)
+    {
+        read->failed |= ACPIMethodBit(method);
+        return kIOReturnTimeout;
+    }
+
+    read->evaluated |= ACPIMethodBit(method);
+    OSObject* result = NULL;
+    uint64_t start = GetUptimeUS();
+    IOReturn evaluateStatus = fProvider->evaluateObject(acpiMethodNames[method], &result, params, paramCount);
+    noteMethodTime(read, method, start);
+    *package = OSDynamicCast(OSArray, result);
+    if (evaluateStatus != kIOReturnSuccess || !*package)
+    {
+        DebugLog("evaluateObject %s error 0x%x\n", acpiMethodNames[method], evaluateStatus);
+        OSSafeReleaseNULL(result);
+        *package = NULL;
+        read->failed |= ACPIMethodBit(method);
+        return kIOReturnError;
+    }
+    return kIOReturnSuccess;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::evaluateSTA
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryManager::evaluateSTA(BatteryRead* read)
+{
+    if (read->cancelled)
+        return kIOReturnAborted;
+    if (!hasACPIMethod(kACPIMethodSTA))
+        return kIOReturnUnsupported;
+    if (read->timedOut)
+    {
+        read->failed |= ACPIMethodBit(kACPIMethodSTA);
+        return kIOReturnTimeout;
+    }
+
+    read->evaluated |= ACPIMethodBit(kACPIMethodSTA);
+    uint64_t start = GetUptimeUS();
+    IOReturn evaluateStatus = fProvider->evaluateInteger("_STA", &read->sta);
+    noteMethodTime(read, kACPIMethodSTA, start);
+    if (evaluateStatus != kIOReturnSuccess)
+    {
+        DebugLog("evaluateInteger _STA error 0x%x\n", evaluateStatus);
+        read->failed |= ACPIMethodBit(kACPIMethodSTA);
+    }
+    return evaluateStatus;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::noteMethodTime
+ * A method that returns after its deadline keeps its result, but the rest
+ * of the read is skipped (and retried by the battery)
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::noteMethodTime(BatteryRead* read, int method, uint64_t start)
+{
+    uint64_t elapsed = GetUptimeUS() - start;
+    fMethodTimeTotal[method] += elapsed;
+    ++fMethodTimeCount[method];
+    if (elapsed > fMethodTimeMax[method])
+        fMethodTimeMax[method] = (uint32_t)elapsed;
+    // decaying average, so routing follows an EC that got slower (or faster)
+    // since startup instead of its lifetime average; never 0 once measured
+    int64_t latency = fMethodLatency[method];
+    latency = latency ? latency + (((int64_t)elapsed - latency) >> kLatencyDecayShift) : (int64_t)elapsed;
+    fMethodLatency[method] = latency > 0 ? (uint32_t)latency : 1;
+    if (read->methodTimeout && elapsed > (uint64_t)read->methodTimeout * 1000)
+    {
+        AlwaysLog("%s took %ums (deadline %ums)\n", acpiMethodNames[method], (unsigned)(elapsed / 1000), (unsigned)read->methodTimeout);
+        read->timedOut |= ACPIMethodBit(method);
+    }
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::fetchSBS
+ * Only the SBS registers that replace BBIX fields, straight from the
+ * battery: no AML, no package marshalling
+ ******************************************************************************/
+
+static const UInt8 sbsRegisters[SBS_FIELD_COUNT] =
+{
+    kSBSTemperature, kSBSCurrent, kSBSAverageCurrent, kSBSRunTimeToEmpty, kSBSCycleCount, kSBSVoltage,
+};
+
+void AppleSmartBatteryManager::fetchSBS(BatteryRead* read)
+{
+    if (read->cancelled || !fSBS)
+        return;
+    if (read->timedOut)
+    {
+        read->failed |= ACPIMethodBit(kACPIMethodSBS);
+        return;
+    }
+
+    read->evaluated |= ACPIMethodBit(kACPIMethodSBS);
+    uint64_t start = GetUptimeUS();
+    for (int i = 0; i < SBS_FIELD_COUNT && !read->cancelled; i++)
+    {
+        IOReturn ret = fSBS->readWord(sbsRegisters[i], &read->sbs[i]);
+        if (kIOReturnSuccess != ret)
+        {
+            DebugLog("SBS register 0x%x error 0x%x\n", sbsRegisters[i], ret);
+            read->failed |= ACPIMethodBit(kACPIMethodSBS);
+            break;
+        }
+    }
+    noteMethodTime(read, kACPIMethodSBS, start);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::fetchECRegisters
+ * _BST fields straight from EC space: no AML on the status path
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::fetchECRegisters(BatteryRead* read)
+{
+    if (read->cancelled)
+        return;
+    if (read->timedOut)
+    {
+        read->failed |= ACPIMethodBit(kACPIMethodEC);
+        return;
+    }
+
+    read->evaluated |= ACPIMethodBit(kACPIMethodEC);
+    uint64_t start = GetUptimeUS();
+    for (int i = 0; i < BST_FIELD_COUNT && !read->cancelled; i++)
+    {
+        IOReturn ret = readECRegister(fECRegisters[i], &read->ec[i]);
+        if (kIOReturnSuccess != ret)
+        {
+            DebugLog("EC register %s error 0x%x\n", ecRegisterNames[i], ret);
+            read->failed |= ACPIMethodBit(kACPIMethodEC);
+            break;
+        }
+    }
+    noteMethodTime(read, kACPIMethodEC, start);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::fetchBulk
+ * BALL: _STA, _BST and the requested _BIF/_BIX/BBIX packages in one
+ * evaluation (non-standard, see SSDT-BALL.dsl)
+ ******************************************************************************/
+
+bool AppleSmartBatteryManager::fetchBulk(BatteryRead* read)
+{
+    OSObject* params[1];
+    params[0] = OSNumber::withNumber(read->bulkFlags, 32);
+    if (!params[0])
+        return false;
+
+    OSArray* acpibat_ball = NULL;
+    evaluatePackage(read, kACPIMethodBALL, &acpibat_ball, params, 1);
+    params[0]->release();
+    if (!acpibat_ball)
+        return false;
+
+    // every requested package must be there, or the per-method reads are used
+    bool complete = false;
+    if (OSNumber* sta = OSDynamicCast(OSNumber, acpibat_ball->getObject(BALL_STATUS)))
+    {
+        read->sta = sta->unsigned32BitValue();
+        complete = true;
+        if (read->sta & BATTERY_PRESENT)
+        {
+            read->bst = OSDynamicCast(OSArray, acpibat_ball->getObject(BALL_BST));
+            if (read->bulkFlags & (BALL_WANT_BIF | BALL_WANT_BIX))
+                read->info = OSDynamicCast(OSArray, acpibat_ball->getObject(BALL_INFO));
+            if (read->bulkFlags & BALL_WANT_BBIX)
+                read->extra = OSDynamicCast(OSArray, acpibat_ball->getObject(BALL_EXTRA));
+            complete = read->bst
+                && (read->info || !(read->bulkFlags & (BALL_WANT_BIF | BALL_WANT_BIX)))
+                && (read->extra || !(read->bulkFlags & BALL_WANT_BBIX));
+        }
+    }
+    if (complete)
+    {
+        if (read->info)
+            read->info->retain();
+        if (read->extra)
+            read->extra->retain();
+        if (read->bst)
+            read->bst->retain();
+    }
+    else
+    {
+        read->info = read->extra = read->bst = NULL;
+        read->failed |= ACPIMethodBit(kACPIMethodBALL);
+    }
+    acpibat_ball->release();
+    return complete;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::fetchBatteryRead
+ * ACPI I/O only: may run on the worker thread, so no battery state is touched
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::fetchBatteryRead(BatteryRead* read)
+{
+    uint64_t start = GetUptimeUS();
+    read->evaluated = 0;
+    read->failed = 0;
+    read->timedOut = 0;
+    read->sta = 0;
+    read->info = read->extra = read->bst = NULL;
+
+    bool present = true;
+    if ((read->methods & ACPIMethodBit(kACPIMethodBALL)) && fetchBulk(read))
+        present = read->sta & BATTERY_PRESENT;
+    else
+    {
+        if ((read->methods & ACPIMethodBit(kACPIMethodSTA)) && kIOReturnSuccess == evaluateSTA(read))
+            present = read->sta & BATTERY_PRESENT;
+        if (present)
+        {
+            if (read->methods & ACPIMethodBit(kACPIMethodBIX))
+                evaluatePackage(read, kACPIMethodBIX, &read->info);
+            else if (read->methods & ACPIMethodBit(kACPIMethodBIF))
+                evaluatePackage(read, kACPIMethodBIF, &read->info);
+            if (read->methods & ACPIMethodBit(kACPIMethodBBIX))
+                evaluatePackage(read, kACPIMethodBBIX, &read->extra);
+            if (read->methods & ACPIMethodBit(kACPIMethodBST))
+                evaluatePackage(read, kACPIMethodBST, &read->bst);
+            // right after _BST, so a cross-check compares the same EC sample
+            if (read->methods & ACPIMethodBit(kACPIMethodEC))
+                fetchECRegisters(read);
+        }
+    }
+    if (present && (read->methods & ACPIMethodBit(kACPIMethodSBS)))
+        fetchSBS(read);
+    read->ioTime = (uint32_t)(GetUptimeUS() - start);
+}
+
+/******************************************************************************
+ * isPackageSane
+ * Enough elements, and numbers where the capacities go: a package that fails
+ * this (seen after some EC firmware updates) is treated as a failed read
+ ******************************************************************************/
+
+static bool isPackageSane(int method, OSArray* package)
+{
+    switch (method)
+    {
+        case kACPIMethodBIF:
+            return package->getCount() > BIF_OEM && OSDynamicCast(OSNumber, package->getObject(BIF_DESIGN_CAPACITY));
+        case kACPIMethodBIX:
+            return package->getCount() > BIX_OEM && OSDynamicCast(OSNumber, package->getObject(BIX_DESIGN_CAPACITY));
+        case kACPIMethodBBIX:
+            return package->getCount() > BBIX_MANUF_DATE;
+        case kACPIMethodBST:
+            return package->getCount() > BST_VOLTAGE && OSDynamicCast(OSNumber, package->getObject(BST_CAPACITY));
+    }
+    return true;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::countReadErrors
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::countReadErrors(BatteryRead* read)
+{
+    if (!(read->failed | read->timedOut))
+        return;
+    for (int i = 0; i < kACPIMethodCount; i++)
+    {
+        if (read->failed & ACPIMethodBit(i))
+            ++fMethodFailures[i];
+        if (read->timedOut & ACPIMethodBit(i))
+            ++fMethodTimeouts[i];
+    }
+    publishReadErrors();
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::applyBatteryRead
+ * Decode a finished read into the battery (_STA, _BIF/_BIX, BBIX, _BST
+ * order) and publish the raw packages. Returns false for a cancelled read,
+ * which is only released. Caller must hold the gate.
+ ******************************************************************************/
+
+bool AppleSmartBatteryManager::applyBatteryRead(BatteryRead* read)
+{
+    bool bulk = (read->evaluated & ACPIMethodBit(kACPIMethodBALL)) && !(read->failed & ACPIMethodBit(kACPIMethodBALL));
+    bool bix = bulk ? (read->bulkFlags & BALL_WANT_BIX) : (read->methods & ACPIMethodBit(kACPIMethodBIX));
+    UInt32 infoBit = ACPIMethodBit(bix ? kACPIMethodBIX : kACPIMethodBIF);
+    UInt32 tried = read->evaluated;
+    if (bulk)
+    {
+        tried |= ACPIMethodBit(kACPIMethodBST);
+        if (read->bulkFlags & (BALL_WANT_BIF | BALL_WANT_BIX))
+            tried |= infoBit;
+        if (read->bulkFlags & BALL_WANT_BBIX)
+            tried |= ACPIMethodBit(kACPIMethodBBIX);
+    }
+
+    if (read->info && !isPackageSane(bix ? kACPIMethodBIX : kACPIMethodBIF, read->info))
+    {
+        read->failed |= infoBit;
+        OSSafeReleaseNULL(read->info);
+    }
+    if (read->extra && !isPackageSane(kACPIMethodBBIX, read->extra))
+    {
+        read->failed |= ACPIMethodBit(kACPIMethodBBIX);
+        OSSafeReleaseNULL(read->extra);
+    }
+    if (read->bst && !isPackageSane(kACPIMethodBST, read->bst))
+    {
+        read->failed |= ACPIMethodBit(kACPIMethodBST);
+        OSSafeReleaseNULL(read->bst);
+    }
+
+    // breakers only see methods that actually ran (not those skipped after a timeout)
+    for (int i = 0; i < kACPIMethodCount; i++)
+    {
+        if (tried & kBreakerMethods & ACPIMethodBit(i))
+            noteACPIMethodResult(i, !((read->failed | read->timedOut) & ACPIMethodBit(i)));
+    }
+
+    // counted even for a cancelled read: a watchdog cancel is an error too
+    countReadErrors(read);
+
+    bool applied = !read->cancelled;
+    // its Notify goes to the read that replaces it
+    if (!applied && read->notifyTime && (!fNotifyServicingTime || read->notifyTime < fNotifyServicingTime))
+        fNotifyServicingTime = read->notifyTime;
+    if (applied)
+    {
+        if (bulk || ((read->evaluated & ACPIMethodBit(kACPIMethodSTA)) && !(read->failed & ACPIMethodBit(kACPIMethodSTA))))
+        {
+            UInt32 previous = fBatterySTA;
+            fBatterySTA = read->sta;
+            if (kIOReturnSuccess != fBattery->setBatterySTA(fBatterySTA))
+                read->failed |= ACPIMethodBit(kACPIMethodSTA);
+            // the _STA a Notify asked for: a change is an insert/remove
+            if (fNotifySTAPending && (previous ^ fBatterySTA))
+            {
+                if (fBatterySTA & BATTERY_PRESENT)
+                {
+                    DebugLog("battery inserted\n");
+                    fBattery->handleBatteryInserted();
+                }
+                else
+                {
+                    DebugLog("battery removed\n");
+                    fBattery->handleBatteryRemoved();
+                }
+            }
+        }
+        if (bulk || (read->methods & ACPIMethodBit(kACPIMethodSTA)))
+            fNotifySTAPending = false;
+        if (read->info)
+        {
+            setProperty(bix ? "Battery Extended Information" : "Battery Information", read->info);
+            if (kIOReturnSuccess != (bix ? fBattery->setBatteryBIX(read->info) : fBattery->setBatteryBIF(read->info)))
+                read->failed |= infoBit;
+        }
+        if (read->extra)
+        {
+            setProperty("Battery Extra Information", read->extra);
+            if (kIOReturnSuccess != fBattery->setBatteryBBIX(read->extra))
+                read->failed |= ACPIMethodBit(kACPIMethodBBIX);
+        }
+        if ((read->evaluated & ACPIMethodBit(kACPIMethodSBS)) && !(read->failed & ACPIMethodBit(kACPIMethodSBS)))
+        {
+            if (kIOReturnSuccess != fBattery->setBatterySBS(read->sbs))
+                read->failed |= ACPIMethodBit(kACPIMethodSBS);
+        }
+        // the EC registers stand in for _BST; read together, _BST wins and verifies them
+        UInt32 statusBit = ACPIMethodBit(kACPIMethodBST);
+        if ((read->evaluated & ACPIMethodBit(kACPIMethodEC)) && !(read->failed & ACPIMethodBit(kACPIMethodEC)))
+        {
+            ++fECDirectReads;
+            if (read->bst)
+                crossCheckECRegisters(read);
+            else if ((read->bst = OSArray::withCapacity(BST_FIELD_COUNT)))
+            {
+                ++fECReadsSinceCheck;
+                statusBit = ACPIMethodBit(kACPIMethodEC);
+                for (int i = 0; i < BST_FIELD_COUNT; i++)
+                {
+                    if (OSNumber* num = OSNumber::withNumber(read->ec[i], 32))
+                    {
+                        read->bst->setObject(num);
+                        num->release();
+                    }
+                }
+            }
+            publishECStatistics();
+        }
+        if (read->bst)
+        {
+            setProperty("Battery Status", read->bst);
+            if (kIOReturnSuccess != fBattery->setBatteryBST(read->bst))
+                read->failed |= statusBit;
+        }
+        if (read->notifyTime)
+            noteNotifyServiced(read->notifyTime);
+    }
+    read->notifyTime = 0;
+    OSSafeReleaseNULL(read->info);
+    OSSafeReleaseNULL(read->extra);
+    OSSafeReleaseNULL(read->bst);
+    return applied;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::crossCheckECRegisters
+ *
+ * EC registers against the _BST read just before them. Charge state must
+ * match; capacity and voltage within 1/16, rate within 1/4 (it moves
+ * between the two reads). A wrong offset, width or scale is far outside
+ * that, so kECMismatchLimit mismatches in a row disable the map for good.
+ ******************************************************************************/
+
+static bool isECValueClose(UInt32 ec, UInt32 acpi, int shift, UInt32 slack)
+{
+    if (ACPI_UNKNOWN == ec || ACPI_UNKNOWN == acpi)
+        return true;
+    UInt32 diff = ec > acpi ? ec - acpi : acpi - ec;
+    return diff <= (acpi >> shift) + slack;
+}
+
+void AppleSmartBatteryManager::crossCheckECRegisters(BatteryRead* read)
+{
+    UInt32 bst[BST_FIELD_COUNT];
+    for (int i = 0; i < BST_FIELD_COUNT; i++)
+        bst[i] = GetValueFromArray(read->bst, i);
+
+    ++fECCrossChecks;
+    fECReadsSinceCheck = 0;
+    UInt32 state = BATTERY_CHARGING | BATTERY_DISCHARGING;
+    if ((read->ec[BST_STATUS] & state) == (bst[BST_STATUS] & state)
+        && isECValueClose(read->ec[BST_RATE], bst[BST_RATE], 2, 50)
+        && isECValueClose(read->ec[BST_CAPACITY], bst[BST_CAPACITY], 4, 1)
+        && isECValueClose(read->ec[BST_VOLTAGE], bst[BST_VOLTAGE], 4, 1))
+    {
+        fECMismatches = 0;
+        return;
+    }
+
+    ++fECMismatchesTotal;
+    AlwaysLog("EC registers 0x%x/%u/%u/%u disagree with _BST 0x%x/%u/%u/%u\n",
+              (unsigned)read->ec[BST_STATUS], (unsigned)read->ec[BST_RATE], (unsigned)read->ec[BST_CAPACITY], (unsigned)read->ec[BST_VOLTAGE],
+              (unsigned)bst[BST_STATUS], (unsigned)bst[BST_RATE], (unsigned)bst[BST_CAPACITY], (unsigned)bst[BST_VOLTAGE]);
+    if (++fECMismatches >= kECMismatchLimit)
+    {
+        AlwaysLog("EC register map disabled, using _BST\n");
+        setACPIMethod(kACPIMethodEC, false);
+    }
+    else
+    {
+        // could be an EC update between the two reads: check again next poll
+        fECReadsSinceCheck = fECCrossCheckInterval;
+    }
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::publishECStatistics
+ * "EC Registers": use counts and direct vs _BST read latency (us)
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::publishECStatistics(void)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(9);
+    if (!dict)
+        return;
+
+    uint32_t directCount = fMethodTimeCount[kACPIMethodEC];
+    uint32_t bstCount = fMethodTimeCount[kACPIMethodBST];
+    struct { const char* key; uint32_t value; } stats[] =
+    {
+        { "CrossCheckInterval", fECCrossCheckInterval },
+        { "DirectReads", fECDirectReads },
+        { "CrossChecks", fECCrossChecks },
+        { "Mismatches", fECMismatchesTotal },
+        { "UnstableReads", fECUnstableReads },
+        { "DirectTimeAverage", directCount ? (uint32_t)(fMethodTimeTotal[kACPIMethodEC] / directCount) : 0 },
+        { "DirectTimeMax", fMethodTimeMax[kACPIMethodEC] },
+        { "BSTTimeAverage", bstCount ? (uint32_t)(fMethodTimeTotal[kACPIMethodBST] / bstCount) : 0 },
+        { "BSTTimeMax", fMethodTimeMax[kACPIMethodBST] },
+    };
+    dict->setObject("Enabled", hasACPIMethod(kACPIMethodEC) ? kOSBooleanTrue : kOSBooleanFalse);
+    for (unsigned i = 0; i < sizeof(stats)/sizeof(stats[0]); i++)
+    {
+        if (OSNumber* num = OSNumber::withNumber(stats[i].value, 32))
+        {
+            dict->setObject(stats[i].key, num);
+            num->release();
+        }
+    }
+    setProperty("EC Registers", dict);
+    dict->release();
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::publishReadErrors
+ * "ACPI Read Errors": Failures/Timeouts per method that ever had one
+ ******************************************************************************/
+
+void AppleSmartBatteryManager::publishReadErrors(void)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(kACPIMethodCount);
+    if (!dict)
+        return;
+    for (int i = 0; i < kACPIMethodCount; i++)
+    {
+        if (!fMethodFailures[i] && !fMethodTimeouts[i])
+            continue;
+        OSDictionary* errors = OSDictionary::withCapacity(2);
+        OSNumber* failures = OSNumber::withNumber(fMethodFailures[i], 32);
+        OSNumber* timeouts = OSNumber::withNumber(fMethodTimeouts[i], 32);
+        if (errors && failures && timeouts)
+        {
+            errors->setObject("Failures", failures);
+            errors->setObject("Timeouts", timeouts);
+            dict->setObject(acpiMethodNames[i], errors);
+        }
+        OSSafeReleaseNULL(failures);
+        OSSafeReleaseNULL(timeouts);
+        OSSafeReleaseNULL(errors);
+    }
+    setProperty("ACPI Read Errors", dict);
+    dict->release();
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::readBatteryWithMaxAge
+ * Battery state no older than maxAgeMS, for the user client
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryManager::readBatteryWithMaxAge(uint32_t maxAgeMS, BatterySnapshot* snapshot)
+{
+    if (!fBattery)
+        return kIOReturnNoDevice;
+    return fBattery->readWithMaxAge(maxAgeMS, snapshot);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::updateBatteryInterest
+ * (Un)register a user client's interest in a battery field group
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryManager::updateBatteryInterest(int group, bool registering)
+{
+    if (!fBattery)
+        return kIOReturnNoDevice;
+    return fBattery->updateInterest(group, registering);
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::takeBurstSample
+ *
+ * Raw values from a finished burst read (_BST only, through startBatteryRead
+ * like any poll), without publishing them. Errors are counted as for a
+ * poll. Caller must hold the gate.
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryManager::takeBurstSample(BatteryRead* read, UInt32* status, UInt32* rate, UInt32* capacity, UInt32* voltage)
+{
+    if (read->bst && !isPackageSane(kACPIMethodBST, read->bst))
+    {
+        read->failed |= ACPIMethodBit(kACPIMethodBST);
+        OSSafeReleaseNULL(read->bst);
+    }
+    countReadErrors(read);
+
+    IOReturn value = kIOReturnError;
+    if (read->cancelled)
+        value = kIOReturnAborted;
+    else if (OSArray* acpibat_bst = read->bst)
+    {
+        *status = GetValueFromArray(acpibat_bst, BST_STATUS);
+        *rate = GetValueFromArray(acpibat_bst, BST_RATE);
+        *capacity = GetValueFromArray(acpibat_bst, BST_CAPACITY);
+        *voltage = GetValueFromArray(acpibat_bst, BST_VOLTAGE);
+        value = kIOReturnSuccess;
+    }
+    OSSafeReleaseNULL(read->bst);
+    return value;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::setBatteryBTP
+ * Call DSDT _BTP method to set the battery trip point (0 clears it)
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryManager::setBatteryBTP(UInt32 tripPoint)
+{
+    DebugLog("setBatteryBTP called: tripPoint = %u\n", (unsigned)tripPoint);
+
+    if (!hasACPIMethod(kACPIMethodBTP))
+        return kIOReturnUnsupported;
+
+    OSObject* params[1];
+    params[0] = OSNumber::withNumber(tripPoint, 32);
+    if (!params[0])
+        return kIOReturnNoMemory;
+
+    IOReturn evaluateStatus = fProvider->evaluateObject("_BTP", NULL, params, 1);
+    params[0]->release();
+    if (evaluateStatus != kIOReturnSuccess)
+    {
+        DebugLog("evaluateObject error 0x%x\n", evaluateStatus);
+        return kIOReturnError;
+    }
+    setProperty("Battery Trip Point", tripPoint, 32);
+    return kIOReturnSuccess;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::setBatteryBMA
+ * Call DSDT _BMA method to set the measurement averaging interval (ms)
+ * _BMA returns 0 on success, 1 if the interval could not be set
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryManager::setBatteryBMA(UInt32 averagingInterval)
+{
+    DebugLog("setBatteryBMA called: averagingInterval = %u\n", (unsigned)averagingInterval);
+
+    if (!hasACPIMethod(kACPIMethodBMA))
+        return kIOReturnUnsupported;
+
+    OSObject* params[1];
+    params[0] = OSNumber::withNumber(averagingInterval, 32);
+    if (!params[0])
+        return kIOReturnNoMemory;
+
+    UInt32 result = 1;
+    IOReturn evaluateStatus = fProvider->evaluateInteger("_BMA", &result, params, 1);
+    params[0]->release();
+    if (evaluateStatus != kIOReturnSuccess || result != 0)
+    {
+        DebugLog("evaluateInteger error 0x%x, result %u\n", evaluateStatus, (unsigned)result);
+        return kIOReturnError;
+    }
+    return kIOReturnSuccess;
+}
+
+/******************************************************************************
+ * AppleSmartBatteryManager::setBatteryBMS
+ * Call DSDT _BMS method to set the measurement sampling time (ms)
+ * _BMS returns 0 on success, 1 if the sampling time could not be set
+ ******************************************************************************/
+
+IOReturn AppleSmartBatteryManager::setBatteryBMS(UInt32 samplingTime)
+{
+    DebugLog("setBatteryBMS called: samplingTime = %u\n", (unsigned)samplingTime);
+
+    if (!hasACPIMethod(kACPIMethodBMS))
+        return kIOReturnUnsupported;
+
+    OSObject* params[1];
+    params[0] = OSNumber::withNumber(samplingTime, 32);
+    if (!params[0])
+        return kIOReturnNoMemory;
+
+    UInt32 result = 1;
+    IOReturn evaluateStatus = fProvider->evaluateInteger("_BMS", &result, params, 1);
+    params[0]->release();
+    if (evaluateStatus != kIOReturnSuccess || result != 0)
+    {
+        DebugLog("evaluateInteger error 0x%x, result %u\n", evaluateStatus, (unsigned)result);
+        return kIOReturnError;
+    }
+    return kIOReturnSuccess;
 }
 
 /*****************************************************************************
@@ -34,12 +34,15 @@
 #include <IOKit/IOService.h>
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
 
+#include <kern/clock.h>
+
 #include <libkern/version.h>
 #define MakeKernelVersion(maj,min,rev) (static_cast<uint32_t>((maj)<<16)|static_cast<uint16_t>((min)<<8)|static_cast<uint8_t>(rev))
 #define RunningKernel() MakeKernelVersion(version_major,version_minor,version_revision)
 
 
 #include "AppleSmartBattery.h"
+#include "ECRegisterMap.h"
 
 #ifdef DEBUG_MSG
 #define DebugLog(args...)  do { IOLog("ACPIBatteryManager: " args); } while (0)
@@ -51,8 +54,48 @@
 
 #define AlwaysLog(args...) do { IOLog("ACPIBatteryManager: " args); } while (0)
 
+// milliseconds since boot (used for poll scheduling and sample timestamps)
+static inline uint64_t GetUptimeMS(void)
+{
+    uint64_t abstime, ns;
+    clock_get_uptime(&abstime);
+    absolutetime_to_nanoseconds(abstime, &ns);
+    return ns / 1000000;
+}
+
+// microseconds since boot (used for instrumentation)
+static inline uint64_t GetUptimeUS(void)
+{
+    uint64_t abstime, ns;
+    clock_get_uptime(&abstime);
+    absolutetime_to_nanoseconds(abstime, &ns);
+    return ns / 1000;
+}
+
 class AppleSmartBattery;
 class BatteryTracker;
+class IOInterruptEventSource;
+class ACPISmartBatterySystem;
+
+// ACPI methods in the capability map (see probeACPIMethods)
+enum {
+    kACPIMethodSTA = 0,
+    kACPIMethodBIF,
+    kACPIMethodBIX,
+    kACPIMethodBBIX,
+    kACPIMethodBST,
+    kACPIMethodBTP,
+    kACPIMethodBMA,
+    kACPIMethodBMS,
+    kACPIMethodPSR,             // on the AC adapter's device, reported by ACPIACAdapter
+    kACPIMethodRMCF,
+    kACPIMethodBALL,            // optional bulk method (see SSDT-BALL.dsl)
+    kACPIMethodSBS,             // Smart Battery System via the SMBus host controller, not a method here
+    kACPIMethodEC,              // _BST fields from the EC register map, not a method either
+    kACPIMethodCount
+};
+
+#define ACPIMethodBit(method)   (1U << (method))
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
@@ -75,6 +118,45 @@ public:
     IOReturn message(UInt32 type, IOService *provider, void *argument);
     
     bool                    areBatteriesDischarging(AppleSmartBattery * except);
+    bool                    isSystemInDarkWake(void);
+
+    // ACPI access governor shared by the battery and the AC adapter
+    bool                    requestACPIBudget(int priority, UInt32 evaluations, uint32_t* retryMS);
+    void                    noteACPIRequestMerged(void);
+    void                    setACPIBudget(UInt32 evaluationsPerMinute);
+    void                    setNotifyCoalesceWindow(UInt32 milliSeconds);
+
+    // ACPI method capability map: probed once, negative results cached
+    bool                    hasACPIMethod(int method) { return fACPIMethods & ACPIMethodBit(method); }
+    void                    setACPIMethod(int method, bool present);
+    const char*             getACPIMethodName(int method);
+    uint32_t                getACPIMethodLatency(int method);
+
+    // per-method circuit breaker for methods with a fallback (_BIX, BBIX, _PSR, SBS)
+    bool                    isACPIMethodUsable(int method);
+    void                    noteACPIMethodResult(int method, bool success);
+
+    // SBS backend (UseSmartBatterySystem), reported as _SBS in the method map
+    bool                    setSmartBatterySystem(bool enable);
+
+    // EC register backend for _BST (ECRegisterMap), reported as EC in the method map
+    bool                    setECRegisterMap(OSDictionary* map);
+    UInt32                  batteryStatusMethods(void);
+
+    // a Notify is waiting for _STA, planned into the next read (see serviceNotify)
+    bool                    notifySTAPending(void) { return fNotifySTAPending; }
+    // and the Notify time the next read planned services (see applyBatteryRead)
+    uint64_t                takeNotifyTime(void);
+
+    // ACPI reads for a poll, done by the worker thread when async reads are on
+    void                    setAsyncACPIReads(bool async);
+    void                    startBatteryRead(BatteryRead* read);
+    bool                    applyBatteryRead(BatteryRead* read);
+    IOReturn                takeBurstSample(BatteryRead* read, UInt32* status, UInt32* rate, UInt32* capacity, UInt32* voltage);
+
+    // for ACPIBatteryUserClient
+    IOReturn                readBatteryWithMaxAge(uint32_t maxAgeMS, BatterySnapshot* snapshot);
+    IOReturn                updateBatteryInterest(int group, bool registering);
 
 private:
 	
@@ -83,6 +165,114 @@ private:
 	AppleSmartBattery       *fBattery;
     UInt32                  fBatterySTA;
 
+    IOLock*                 fGovernorLock;
+    ACPIBudget              fGovernorBudget;
+    uint32_t                fGovernorAdmitted[kACPIPriorityCount];
+    uint32_t                fGovernorDeferred[kACPIPriorityCount];
+    uint32_t                fGovernorMerged;
+
+    void                    publishGovernorStatistics(void);
+
+    volatile UInt32         fACPIMethods;       // under fGovernorLock, read without it
+    uint32_t                fACPIMethodProbes;
+
+    bool                    probeACPIMethods(void);
+    void                    publishACPIMethods(void);
+
+    ACPISmartBatterySystem* fSBS;
+
+    // EC register backend (see setECRegisterMap)
+    ECRegister              fECRegisters[BST_FIELD_COUNT];
+    uint32_t                fECCrossCheckInterval;
+    uint32_t                fECReadsSinceCheck;
+    uint32_t                fECDirectReads;
+    uint32_t                fECCrossChecks;
+    uint32_t                fECMismatches;          // consecutive
+    uint32_t                fECMismatchesTotal;
+    uint32_t                fECUnstableReads;       // fields that never read the same twice
+
+    IOReturn                readECRegister(const ECRegister& reg, UInt32* value);
+    void                    fetchECRegisters(BatteryRead* read);
+    void                    crossCheckECRegisters(BatteryRead* read);
+    void                    publishECStatistics(void);
+
+    // low priority worker thread for ACPI I/O (see startBatteryRead)
+    IOLock*                 fWorkerLock;
+    bool                    fWorkerRunning;
+    bool                    fWorkerStop;
+    bool                    fAsyncReads;
+    BatteryRead*            fWorkerRequest;     // queued or being evaluated
+    BatteryRead*            fWorkerDone;        // waiting for readCompleted
+    IOInterruptEventSource* fReadCompletion;
+
+    static void             workerMain(void* arg, wait_result_t result);
+    void                    workerLoop(void);
+    void                    stopWorker(void);
+    void                    readCompleted(IOInterruptEventSource* sender, int count);
+    void                    fetchBatteryRead(BatteryRead* read);
+    bool                    fetchBulk(BatteryRead* read);
+    IOReturn                evaluatePackage(BatteryRead* read, int method, OSArray** package,
+                                            OSObject** params = NULL, IOItemCount paramCount = 0);
+    IOReturn                evaluateSTA(BatteryRead* read);
+    void                    fetchSBS(BatteryRead* read);
+    void                    noteMethodTime(BatteryRead* read, int method, uint64_t start);
+
+    // per-method read errors (see applyBatteryRead)
+    uint32_t                fMethodFailures[kACPIMethodCount];
+    uint32_t                fMethodTimeouts[kACPIMethodCount];
+
+    // per-method latency (see noteMethodTime), written by whoever fetches the read
+    uint64_t                fMethodTimeTotal[kACPIMethodCount];     // us
+    uint32_t                fMethodTimeCount[kACPIMethodCount];
+    uint32_t                fMethodTimeMax[kACPIMethodCount];       // us
+    uint32_t                fMethodLatency[kACPIMethodCount];       // us, decaying average
+
+    void                    countReadErrors(BatteryRead* read);
+    void                    publishReadErrors(void);
+
+    // circuit breakers (see noteACPIMethodResult), under fGovernorLock
+    uint32_t                fBreakerFailures[kACPIMethodCount];     // consecutive
+    uint64_t                fBreakerOpenUntil[kACPIMethodCount];    // next probe, 0 if closed
+    uint32_t                fBreakerBackoff[kACPIMethodCount];
+    uint32_t                fBreakerTrips[kACPIMethodCount];
+    uint32_t                fBreakerRecoveries[kACPIMethodCount];
+
+    void                    resetBreakers(void);
+    void                    publishBreakers(void);
+
+    // Notify intake (see message): the notify thread only records, the workloop evaluates
+    IOInterruptEventSource* fNotifyIntake;
+    volatile UInt32         fNotifyPendingCodes;    // kNotifyPending* bits
+    volatile UInt64         fNotifyPendingTime;     // us, oldest Notify not yet taken, 0 if none
+    uint64_t                fNotifyUnservicedTime;  // us, oldest Notify taken but not yet serviced, 0 if none
+    uint64_t                fNotifyServicingTime;   // us, oldest Notify serviceNotify left to the next read, 0 if none
+    uint64_t                fNotifyLatencyTotal;    // us
+    uint32_t                fNotifyLatencyCount;
+    uint32_t                fNotifyLatencyLast;     // us
+    uint32_t                fNotifyLatencyMax;      // us
+
+    // Notify coalescing (see gatedNotify)
+    IOTimerEventSource*     fNotifyTimer;
+    UInt32                  fNotifyCoalesceWindow;
+    uint64_t                fNotifyWindowEnd;
+    bool                    fNotifyTrailingPending;
+    IONotifier*             fCapabilityNotifier;    // root domain capability changes, see systemCapabilityChanged
+    volatile UInt32         fSystemCapabilities;    // as last announced
+    bool                    fNotifySTAPending;
+    volatile SInt32         fNotifiesRaw;
+    uint32_t                fNotifiesServiced;
+    uint32_t                fNotifiesCoalesced;
+    uint32_t                fNotifiesInformation;   // Notify 0x81
+
+    void                    notifyIntakeOccurred(IOInterruptEventSource* sender, int count);
+    void                    gatedNotify(UInt32 code);
+    void                    serviceNotify(void);
+    void                    noteNotifyServiced(uint64_t queued);
+    void                    notifyWindowTimeOut(void);
+    void                    publishNotifyStatistics(void);
+    static IOReturn         systemCapabilityChanged(void* target, void* refCon, UInt32 messageType,
+                                                    IOService* provider, void* messageArgument, vm_size_t argSize);
+
 	IOReturn setPollingInterval(int milliSeconds);
     
     IONotifier*             fPublishNotify;
@@ -102,17 +292,19 @@ private:
 public:
 	
     // Methods that return ACPI data into above structures
+    // (poll reads go through startBatteryRead)
     
-	IOReturn getBatterySTA(void);
-	IOReturn getBatteryBIF(void);
-	IOReturn getBatteryBIX(void);
-	IOReturn getBatteryBBIX(void);
-	IOReturn getBatteryBST(void);
+	IOReturn setBatteryBTP(UInt32 tripPoint);
+	IOReturn setBatteryBMA(UInt32 averagingInterval);
+	IOReturn setBatteryBMS(UInt32 samplingTime);
     
     // Methods to test whether optional ACPI methods exist
     
     IOReturn validateBatteryBIX(void);
     IOReturn validateBatteryBBIX(void);
+    IOReturn validateBatteryBTP(void);
+    IOReturn validateBatteryBMA(void);
+    IOReturn validateBatteryBMS(void);
 };
 
 #endif
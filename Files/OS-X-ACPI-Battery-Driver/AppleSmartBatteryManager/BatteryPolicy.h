@@ -0,0 +1,491 @@
+/*
+ * BatteryPolicy.h
+ *
+ * Poll scheduling, _BTP trip points, EC refresh tracking and the ACPI
+ * evaluation budget. Plain arithmetic on battery state with no IOKit
+ * dependency, so the kext and the host tests (see Tests/) run the same code.
+ */
+
+#ifndef __BatteryPolicy__
+#define __BatteryPolicy__
+
+#include <stdint.h>
+
+#define ACPI_MAX			0x7FFFFFFF
+#define ACPI_UNKNOWN		0xFFFFFFFF
+
+#define BATTERY_CHARGED		0
+#define BATTERY_DISCHARGING	1
+#define BATTERY_CHARGING	2
+#define	BATTERY_CRITICAL	4
+
+// Priority classes for the ACPI access governor (higher value wins)
+enum {
+    kACPIPriorityBurst = 0,     // burst sampling: as timer polls, never runs the bucket into debt
+    kACPIPriorityTimer,         // periodic poll: must leave a reserve in the budget
+    kACPIPriorityNotify,        // battery/AC Notify
+    kACPIPriorityWake,          // wake, insert/remove: always admitted
+    kACPIPriorityCount
+};
+
+enum
+{
+    kMilliSecondsPerMinute      = 60000,
+    kMilliSecondsPerHour        = 3600000,
+    kTimerReservePercent        = 25,       // share of the budget timer polls may not use
+    kECRefreshConfidence        = 3,        // sharp refresh edges needed before phase locking
+    kECRefreshMarginMin         = 100,      // poll at least this long (ms) after an expected refresh
+};
+
+// Reads after wake are spread out so the EC is not hit by all of them at
+// once: the adapter's _PSR first, then each battery, in windows that don't
+// overlap (ms after wake, random offset within the window)
+enum
+{
+    kWakePhaseAdapterSpread     = 200,
+    kWakePhaseBatteryStart      = 250,
+    kWakePhaseBatterySpread     = 1000,
+};
+
+static inline void limitInterval(uint64_t& interval, uint64_t limit)
+{
+    if (limit < interval)
+        interval = limit;
+}
+
+static inline uint32_t valueDelta(uint32_t a, uint32_t b)
+{
+    return a > b ? a - b : b - a;
+}
+
+/******************************************************************************
+ * Poll scheduler
+ ******************************************************************************/
+
+// What the scheduler looks at, in _BST units (mA/mAh after any watts conversion)
+struct PollState
+{
+    uint32_t    status;             // _BST state
+    uint32_t    rate;               // this sample
+    uint32_t    averageRate;
+    uint32_t    capacity;
+    uint32_t    maxCapacity;
+    uint32_t    capacityWarning;    // ACPI_UNKNOWN if not declared
+    uint32_t    lowWarning;
+    uint32_t    tripPoint;          // armed _BTP, 0 if none
+};
+
+// The sample the previous interval was picked from (time 0: none yet)
+struct PollSample
+{
+    uint64_t    time;               // ms
+    uint32_t    capacity;
+    uint32_t    rate;
+};
+
+/*
+ * Time until the next poll, at most intervalMax: how long until the capacity
+ * moves by 1% at the current rate, how long until the warning/low levels are
+ * reached, and how much the capacity and rate actually moved since last.
+ * Not yet clamped to the floor (see pollIntervalFloor/clampPollInterval).
+ */
+static inline uint64_t pollIntervalForState(const PollState& state, const PollSample& last, uint64_t now, uint64_t intervalMax)
+{
+    uint64_t interval = intervalMax;
+    bool discharging = state.status & BATTERY_DISCHARGING;
+    bool charging = state.status & BATTERY_CHARGING;
+    uint32_t rate = state.averageRate;
+
+    // with a _BTP trip point armed, the firmware notifies at the next
+    // threshold/percent, so only load changes need an early poll
+    if (state.tripPoint && rate && rate != ACPI_UNKNOWN && last.time && now > last.time)
+    {
+        uint32_t swing = valueDelta(state.rate, last.rate);
+        if (last.rate && state.rate != ACPI_UNKNOWN && (uint64_t)swing * 4 > last.rate)
+            limitInterval(interval, (now - last.time) / 2);
+    }
+    else if ((charging || discharging) && rate && rate != ACPI_UNKNOWN && state.maxCapacity)
+    {
+        // time for the capacity to move by 1% at the current rate
+        uint64_t step = state.maxCapacity / 100;
+        if (!step)
+            step = 1;
+        limitInterval(interval, step * kMilliSecondsPerHour / rate);
+
+        // approaching warning/low levels: get there in at least two polls
+        if (discharging)
+        {
+            if (ACPI_UNKNOWN != state.capacityWarning && state.capacity > state.capacityWarning)
+                limitInterval(interval, (uint64_t)(state.capacity - state.capacityWarning) * kMilliSecondsPerHour / rate / 2);
+            if (ACPI_UNKNOWN != state.lowWarning && state.capacity > state.lowWarning)
+                limitInterval(interval, (uint64_t)(state.capacity - state.lowWarning) * kMilliSecondsPerHour / rate / 2);
+        }
+
+        if (last.time && now > last.time)
+        {
+            uint64_t elapsed = now - last.time;
+
+            // capacity moving faster than the reported rate suggests
+            uint32_t delta = valueDelta(state.capacity, last.capacity);
+            if (delta > step)
+                limitInterval(interval, elapsed * step / delta);
+
+            // rate swung by more than 25% since last sample: load is changing
+            uint32_t swing = valueDelta(state.rate, last.rate);
+            if (last.rate && state.rate != ACPI_UNKNOWN && (uint64_t)swing * 4 > last.rate)
+                limitInterval(interval, elapsed / 2);
+        }
+    }
+    return interval;
+}
+
+/*
+ * Shortest useful interval: polling faster than the firmware's minimum
+ * sampling time (_BIX), averaging window (_BMA) or learned EC refresh
+ * period (0 if not locked) only returns duplicates.
+ */
+static inline uint32_t pollIntervalFloor(uint32_t intervalMin, uint32_t intervalMax, uint32_t minSamplingTime,
+                                         uint32_t averagingInterval, uint32_t ecRefreshPeriod)
+{
+    uint32_t floor = intervalMin;
+    if (minSamplingTime > floor)
+        floor = minSamplingTime;
+    if (averagingInterval > floor)
+        floor = averagingInterval;
+    if (ecRefreshPeriod > floor)
+        floor = ecRefreshPeriod;
+    if (floor > intervalMax)
+        floor = intervalMax;
+    return floor;
+}
+
+static inline uint32_t clampPollInterval(uint64_t interval, uint32_t floor, uint32_t intervalMax)
+{
+    if (interval < floor)
+        interval = floor;
+    if (interval > intervalMax)
+        interval = intervalMax;
+    return (uint32_t)interval;
+}
+
+/******************************************************************************
+ * Firmware averaging
+ *
+ * Configured _BMA averaging interval and _BMS sampling time, kept inside the
+ * bounds declared by _BIX (0: not declared) and sent to the firmware through
+ * provider->setBatteryBMA/setBatteryBMS, which return 0 (kIOReturnSuccess)
+ * when accepted. What was accepted is returned, 0 where nothing was
+ * requested or the firmware refused.
+ ******************************************************************************/
+
+struct AveragingRequest
+{
+    uint32_t    averagingInterval;
+    uint32_t    minAveragingInterval;
+    uint32_t    maxAveragingInterval;
+    uint32_t    samplingTime;
+    uint32_t    minSamplingTime;
+    uint32_t    maxSamplingTime;
+};
+
+static inline uint32_t clampToDeclared(uint32_t value, uint32_t min, uint32_t max)
+{
+    if (value && min && value < min)
+        value = min;
+    if (value && max && value > max)
+        value = max;
+    return value;
+}
+
+template <class Provider>
+static inline void negotiateFirmwareAveraging(Provider* provider, const AveragingRequest& request,
+                                              uint32_t& averagingInterval, uint32_t& samplingTime)
+{
+    uint32_t interval = clampToDeclared(request.averagingInterval, request.minAveragingInterval, request.maxAveragingInterval);
+    uint32_t sampling = clampToDeclared(request.samplingTime, request.minSamplingTime, request.maxSamplingTime);
+
+    averagingInterval = 0;
+    if (interval && 0 == provider->setBatteryBMA(interval))
+        averagingInterval = interval;
+    samplingTime = 0;
+    if (sampling && 0 == provider->setBatteryBMS(sampling))
+        samplingTime = sampling;
+}
+
+/******************************************************************************
+ * Trip point
+ *
+ * Next capacity (in _BST units) worth a Notify: the warning/low levels or
+ * the next whole percent, in the direction the capacity is moving. 0 if
+ * there is none.
+ ******************************************************************************/
+
+static inline uint32_t batteryTripPoint(uint32_t status, uint32_t current, uint32_t full, uint32_t warning, uint32_t low)
+{
+    if (!full || ACPI_UNKNOWN == full || ACPI_UNKNOWN == current)
+        return 0;
+
+    uint32_t percent = (uint32_t)((uint64_t)current * 100 / full);
+    if (status & BATTERY_CHARGING)
+    {
+        if (percent >= 100)
+            return 0;
+        return (uint32_t)(((uint64_t)(percent + 1) * full + 99) / 100);
+    }
+
+    uint32_t trip = (uint32_t)((uint64_t)percent * full / 100);
+    if (trip >= current)
+        trip = percent ? (uint32_t)((uint64_t)(percent - 1) * full / 100) : 0;
+    if (ACPI_UNKNOWN != warning && warning < current && warning > trip)
+        trip = warning;
+    if (ACPI_UNKNOWN != low && low < current && low > trip)
+        trip = low;
+    return trip;
+}
+
+/******************************************************************************
+ * ECRefreshTracker
+ *
+ * Many ECs refresh _BST only every few seconds. A _BST identical to the
+ * previous one is a duplicate; a changed one means the EC refreshed since
+ * the previous read. Changes seen by reads at most half a period apart
+ * give sharp edges, from which the refresh period and phase are learned.
+ ******************************************************************************/
+
+struct ECRefreshTracker
+{
+    bool        valid;
+    uint32_t    lastStatus, lastRate, lastCapacity, lastVoltage;
+    uint64_t    lastTime;
+    uint64_t    refreshTime;        // estimated time of the last EC refresh
+    uint32_t    period;             // 0 until learned
+    uint32_t    confidence;
+    uint32_t    phaseMargin;        // poll this long after the expected refresh
+    uint32_t    samples;
+    uint32_t    duplicates;
+
+    void reset(void)
+    {
+        valid = false;
+        lastStatus = lastRate = lastCapacity = lastVoltage = 0;
+        lastTime = 0;
+        refreshTime = 0;
+        period = 0;
+        confidence = 0;
+        phaseMargin = 0;
+        samples = 0;
+        duplicates = 0;
+    }
+
+    bool isLocked(void) const
+    {
+        return period && confidence >= kECRefreshConfidence;
+    }
+
+    // period to poll no faster than, 0 until locked
+    uint32_t lockedPeriod(void) const
+    {
+        return isLocked() ? period : 0;
+    }
+
+    void track(uint64_t now, uint32_t status, uint32_t rate, uint32_t capacity, uint32_t voltage)
+    {
+        bool duplicate = valid && status == lastStatus && rate == lastRate
+            && capacity == lastCapacity && voltage == lastVoltage;
+
+        ++samples;
+        if (duplicate)
+        {
+            ++duplicates;
+            // a phase locked read that landed before the refresh: read later next time
+            if (isLocked() && phaseMargin < period / 2)
+                phaseMargin += period / 20;
+        }
+        else if (valid && now > lastTime)
+        {
+            // the EC refreshed somewhere in (lastTime, now]
+            uint64_t window = now - lastTime;
+            if (!period || window <= period / 2)
+            {
+                uint64_t refresh = lastTime + window / 2;
+                if (refreshTime && refresh > refreshTime)
+                {
+                    uint64_t interval = refresh - refreshTime;
+                    uint64_t cycles = period ? (interval + period / 2) / period : 1;
+                    uint64_t estimate = interval / (cycles ? cycles : 1);
+                    if (!period || estimate < (uint64_t)period * 3 / 4)
+                    {
+                        // first estimate, or the previous one was a multiple of the real period
+                        period = (uint32_t)estimate;
+                        confidence = 0;
+                    }
+                    else if (estimate <= (uint64_t)period * 5 / 4)
+                    {
+                        period = (uint32_t)((3 * (uint64_t)period + estimate) / 4);
+                        if (confidence < kECRefreshConfidence)
+                            ++confidence;
+                    }
+                }
+                refreshTime = refresh;
+            }
+            else if (isLocked() && now > refreshTime)
+            {
+                // phase locked read: the refresh was the expected one
+                refreshTime += (now - refreshTime) / period * period;
+            }
+
+            // fresh data: ease the margin back toward its minimum
+            uint32_t margin = period / 10;
+            if (margin < kECRefreshMarginMin)
+                margin = kECRefreshMarginMin;
+            if (phaseMargin > margin + period / 40)
+                phaseMargin -= period / 40;
+            else
+                phaseMargin = margin;
+        }
+
+        valid = true;
+        lastTime = now;
+        lastStatus = status;
+        lastRate = rate;
+        lastCapacity = capacity;
+        lastVoltage = voltage;
+    }
+
+    // Move a poll to just after an expected EC refresh, so the read returns
+    // fresh data instead of a duplicate: the last refresh before the poll is
+    // due or, if that comes sooner than floor, the first one at or after
+    // now + floor. The result is then clamped to [floor, intervalMax].
+    uint32_t align(uint64_t now, uint32_t interval, uint32_t floor, uint32_t intervalMax) const
+    {
+        if (!isLocked() || !refreshTime)
+            return interval;
+
+        uint64_t target = now + interval;
+        uint64_t earliest = now + floor;
+        uint64_t first = refreshTime + phaseMargin;
+        if (target <= first)
+            return interval;
+        uint64_t when = first + (target - first) / period * period;
+        if (when < earliest)
+            when = first + (earliest - first + period - 1) / period * period;
+
+        uint64_t aligned = when - now;
+        if (aligned < floor)
+            aligned = floor;
+        if (aligned > intervalMax)
+            aligned = intervalMax;
+        return (uint32_t)aligned;
+    }
+};
+
+/******************************************************************************
+ * Measurement error
+ *
+ * True if a _BST differs from what was last published by less than the
+ * measurement accuracy declared in _BIX (thousandths of a percent), so
+ * republishing would only show noise. Compared with the last published
+ * values, not the previous sample, so a drift of small steps is published
+ * once it adds up. Never true across a status or full capacity change, or
+ * a warning/low level crossing (ACPI_UNKNOWN: level not declared).
+ ******************************************************************************/
+
+struct PublishedBST
+{
+    bool        valid;
+    uint32_t    status;
+    uint32_t    capacity;
+    uint32_t    rate;
+    uint32_t    maxCapacity;
+};
+
+static inline bool isBelowMeasurementError(const PublishedBST& published, uint32_t status, uint32_t capacity,
+                                           uint32_t rate, uint32_t maxCapacity, uint32_t warning, uint32_t low,
+                                           uint32_t accuracy)
+{
+    if (!published.valid || !accuracy || accuracy >= 100000)
+        return false;
+    if (status != published.status || !maxCapacity || maxCapacity != published.maxCapacity)
+        return false;
+    if (ACPI_UNKNOWN != warning && (capacity <= warning) != (published.capacity <= warning))
+        return false;
+    if (ACPI_UNKNOWN != low && (capacity <= low) != (published.capacity <= low))
+        return false;
+
+    // error band in the same units as the values
+    uint64_t inaccuracy = 100000 - accuracy;
+    uint64_t capacityError = (uint64_t)maxCapacity * inaccuracy / 100000;
+    uint64_t rateError = (uint64_t)published.rate * inaccuracy / 100000;
+    return valueDelta(capacity, published.capacity) <= capacityError
+        && valueDelta(rate, published.rate) <= rateError;
+}
+
+/******************************************************************************
+ * ACPIBudget
+ *
+ * Token bucket behind the ACPI access governor, in 1/60000 evaluation units
+ * so it refills by perMinute units per millisecond. Timer polls and burst
+ * samples must leave a reserve for Notify handling; wake and insert/remove are always admitted
+ * and may run the bucket into debt, bounded by one bucket's worth. Anything
+ * is admitted from a full bucket, so a budget configured smaller than a
+ * poll (plus the reserve) slows polls down instead of stopping them. The
+ * caller serializes access.
+ ******************************************************************************/
+
+struct ACPIBudget
+{
+    uint32_t    perMinute;          // 0 = unlimited
+    int64_t     tokens;
+    uint64_t    refillTime;
+
+    void set(uint32_t evaluationsPerMinute, uint64_t now)
+    {
+        perMinute = evaluationsPerMinute;
+        tokens = (int64_t)evaluationsPerMinute * kMilliSecondsPerMinute;
+        refillTime = now;
+    }
+
+    void refill(uint64_t now)
+    {
+        int64_t capacity = (int64_t)perMinute * kMilliSecondsPerMinute;
+        if (now > refillTime)
+            tokens += (int64_t)(now - refillTime) * perMinute;
+        if (tokens > capacity)
+            tokens = capacity;
+        refillTime = now;
+    }
+
+    // whole evaluations left (negative while in debt)
+    int64_t available(void) const
+    {
+        return tokens / kMilliSecondsPerMinute;
+    }
+
+    // when refused, *retryMS is how long until the request would be admitted
+    bool request(int priority, uint32_t evaluations, uint64_t now, uint32_t* retryMS)
+    {
+        if (!perMinute)
+            return true;
+
+        refill(now);
+        int64_t capacity = (int64_t)perMinute * kMilliSecondsPerMinute;
+        int64_t cost = (int64_t)evaluations * kMilliSecondsPerMinute;
+        int64_t reserve = priority <= kACPIPriorityTimer ? capacity * kTimerReservePercent / 100 : 0;
+
+        // more than the bucket holds: wait for it to fill
+        int64_t needed = cost + reserve < capacity ? cost + reserve : capacity;
+        if (kACPIPriorityWake != priority && tokens < needed)
+        {
+            if (retryMS)
+                *retryMS = (uint32_t)((needed - tokens + perMinute - 1) / perMinute);
+            return false;
+        }
+        tokens -= cost;
+        // bound the debt so a wake storm can't starve everything for long
+        if (tokens < -capacity)
+            tokens = -capacity;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,150 @@
+//
+//  BatteryUserClient.cpp
+//  ACPIBatteryManager
+//
+//  User space access to the battery manager (IOServiceOpen on AppleSmartBatteryManager).
+//
+
+#include "BatteryUserClient.h"
+
+#define super IOUserClient
+
+OSDefineMetaClassAndStructors(ACPIBatteryUserClient, IOUserClient)
+
+const IOExternalMethodDispatch ACPIBatteryUserClient::sMethods[kBatteryUserClientMethodCount] =
+{
+    // kBatteryUserClientReadWithMaxAge
+    { &ACPIBatteryUserClient::sReadWithMaxAge, 1, 0, 0, sizeof(BatterySnapshot) },
+    // kBatteryUserClientRegisterInterest
+    { &ACPIBatteryUserClient::sRegisterInterest, 1, 0, 0, 0 },
+    // kBatteryUserClientUnregisterInterest
+    { &ACPIBatteryUserClient::sUnregisterInterest, 1, 0, 0, 0 },
+};
+
+bool ACPIBatteryUserClient::start(IOService* provider)
+{
+    fProvider = OSDynamicCast(AppleSmartBatteryManager, provider);
+    if (!fProvider)
+        return false;
+    fInterestLock = IOLockAlloc();
+    if (!fInterestLock || !super::start(provider))
+    {
+        if (fInterestLock)
+        {
+            IOLockFree(fInterestLock);
+            fInterestLock = NULL;
+        }
+        return false;
+    }
+    fProvider->retain();
+    return true;
+}
+
+void ACPIBatteryUserClient::stop(IOService* provider)
+{
+    dropInterest();
+    OSSafeReleaseNULL(fProvider);
+    if (fInterestLock)
+    {
+        IOLockFree(fInterestLock);
+        fInterestLock = NULL;
+    }
+    super::stop(provider);
+}
+
+IOReturn ACPIBatteryUserClient::clientClose(void)
+{
+    // also reached through clientDied when the owning task exits
+    dropInterest();
+    terminate();
+    return kIOReturnSuccess;
+}
+
+IOReturn ACPIBatteryUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments* arguments,
+                                               IOExternalMethodDispatch* dispatch, OSObject* target, void* reference)
+{
+    if (selector >= kBatteryUserClientMethodCount)
+        return kIOReturnUnsupported;
+
+    dispatch = const_cast<IOExternalMethodDispatch*>(&sMethods[selector]);
+    return super::externalMethod(selector, arguments, dispatch, this, NULL);
+}
+
+/******************************************************************************
+ * ACPIBatteryUserClient::sReadWithMaxAge
+ * Battery state no older than scalarInput[0] ms (0 = always read ACPI)
+ ******************************************************************************/
+
+IOReturn ACPIBatteryUserClient::sReadWithMaxAge(OSObject* target, void* reference, IOExternalMethodArguments* arguments)
+{
+    ACPIBatteryUserClient* client = OSDynamicCast(ACPIBatteryUserClient, target);
+    if (!client || !client->fProvider)
+        return kIOReturnNoDevice;
+
+    uint64_t maxAge = arguments->scalarInput[0];
+    if (maxAge > UINT32_MAX)
+        maxAge = UINT32_MAX;
+    return client->fProvider->readBatteryWithMaxAge((uint32_t)maxAge, (BatterySnapshot*)arguments->structureOutput);
+}
+
+/******************************************************************************
+ * ACPIBatteryUserClient::sRegisterInterest/sUnregisterInterest
+ * (Un)register interest in field group scalarInput[0] (kInterestGroup*)
+ ******************************************************************************/
+
+IOReturn ACPIBatteryUserClient::sRegisterInterest(OSObject* target, void* reference, IOExternalMethodArguments* arguments)
+{
+    ACPIBatteryUserClient* client = OSDynamicCast(ACPIBatteryUserClient, target);
+    if (!client)
+        return kIOReturnNoDevice;
+    return client->updateInterest(arguments->scalarInput[0], true);
+}
+
+IOReturn ACPIBatteryUserClient::sUnregisterInterest(OSObject* target, void* reference, IOExternalMethodArguments* arguments)
+{
+    ACPIBatteryUserClient* client = OSDynamicCast(ACPIBatteryUserClient, target);
+    if (!client)
+        return kIOReturnNoDevice;
+    return client->updateInterest(arguments->scalarInput[0], false);
+}
+
+/******************************************************************************
+ * ACPIBatteryUserClient::updateInterest
+ *
+ * The battery counts registrations per group; this connection counts its
+ * own, so an unregister can only release what it registered and whatever
+ * is left is released when it closes or its task dies.
+ ******************************************************************************/
+
+IOReturn ACPIBatteryUserClient::updateInterest(uint64_t group, bool registering)
+{
+    if (group >= kInterestGroupCount)
+        return kIOReturnBadArgument;
+    if (!fProvider || !fInterestLock)
+        return kIOReturnNoDevice;
+
+    IOLockLock(fInterestLock);
+    IOReturn result = kIOReturnNotFound;
+    if (registering || fInterest[group])
+    {
+        result = fProvider->updateBatteryInterest((int)group, registering);
+        if (kIOReturnSuccess == result)
+            fInterest[group] += registering ? 1 : -1;
+    }
+    IOLockUnlock(fInterestLock);
+    return result;
+}
+
+void ACPIBatteryUserClient::dropInterest(void)
+{
+    if (!fProvider || !fInterestLock)
+        return;
+
+    IOLockLock(fInterestLock);
+    for (int i = 0; i < kInterestGroupCount; i++)
+    {
+        for (; fInterest[i]; fInterest[i]--)
+            fProvider->updateBatteryInterest(i, false);
+    }
+    IOLockUnlock(fInterestLock);
+}
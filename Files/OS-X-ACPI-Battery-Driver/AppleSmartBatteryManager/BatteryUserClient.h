@@ -0,0 +1,37 @@
+//
+//  BatteryUserClient.h
+//  ACPIBatteryManager
+//
+//  User space access to the battery manager (IOServiceOpen on AppleSmartBatteryManager).
+//
+
+#ifndef ACPIBatteryManager_BatteryUserClient_h
+#define ACPIBatteryManager_BatteryUserClient_h
+
+#include <IOKit/IOUserClient.h>
+#include "AppleSmartBatteryManager.h"
+
+class EXPORT ACPIBatteryUserClient : public IOUserClient
+{
+    OSDeclareDefaultStructors(ACPIBatteryUserClient)
+
+private:
+    AppleSmartBatteryManager*   fProvider;
+    IOLock*                     fInterestLock;
+    uint32_t                    fInterest[kInterestGroupCount];    // registrations held by this connection
+
+    static const IOExternalMethodDispatch sMethods[kBatteryUserClientMethodCount];
+    static IOReturn         sReadWithMaxAge(OSObject* target, void* reference, IOExternalMethodArguments* arguments);
+    static IOReturn         sRegisterInterest(OSObject* target, void* reference, IOExternalMethodArguments* arguments);
+    static IOReturn         sUnregisterInterest(OSObject* target, void* reference, IOExternalMethodArguments* arguments);
+    IOReturn                updateInterest(uint64_t group, bool registering);
+    void                    dropInterest(void);
+public:
+    virtual bool            start(IOService* provider);
+    virtual void            stop(IOService* provider);
+    virtual IOReturn        clientClose(void);
+    virtual IOReturn        externalMethod(uint32_t selector, IOExternalMethodArguments* arguments,
+                                           IOExternalMethodDispatch* dispatch, OSObject* target, void* reference);
+};
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * ECRegisterMap.h
+ *
+ * _BST fields read straight from EC address space (ECRegisterMap). Byte
+ * access comes from the caller, so the kext and the host tests (see Tests/)
+ * decode the same way.
+ */
+
+#ifndef __ECRegisterMap__
+#define __ECRegisterMap__
+
+#include <stdint.h>
+
+#include "BatteryPolicy.h"
+
+// One _BST field in EC address space (see setECRegisterMap)
+struct ECRegister
+{
+    uint16_t    offset;         // bytes
+    uint8_t     width;          // bytes: 1, 2 or 4
+    bool        bigEndian;
+    bool        isSigned;       // two's complement, magnitude is used
+    uint32_t    scale;          // to _BST units
+    // Status only: EC bits for the _BST state bits, used instead of the raw
+    // value when any is set (EC status bytes rarely match the _BST layout)
+    uint32_t    dischargingMask;
+    uint32_t    chargingMask;
+    uint32_t    criticalMask;
+};
+
+enum
+{
+    kECReadAttempts         = 3,        // extra passes allowed to get two that agree
+};
+
+enum
+{
+    kECReadSuccess = 0,
+    kECReadIOError,             // a byte access failed
+    kECReadUnstable,            // the EC kept updating the field while it was read
+};
+
+/******************************************************************************
+ * decodeECField
+ * Raw field value to _BST units: all ones is unknown, as in _BST
+ ******************************************************************************/
+
+static inline uint32_t decodeECField(const ECRegister& reg, uint32_t raw)
+{
+    if (reg.dischargingMask | reg.chargingMask | reg.criticalMask)
+    {
+        return ((raw & reg.dischargingMask) ? BATTERY_DISCHARGING : 0)
+             | ((raw & reg.chargingMask) ? BATTERY_CHARGING : 0)
+             | ((raw & reg.criticalMask) ? BATTERY_CRITICAL : 0);
+    }
+
+    int bits = reg.width * 8;
+    uint32_t mask = bits < 32 ? (1U << bits) - 1 : 0xffffffff;
+    if (raw == mask)
+        return ACPI_UNKNOWN;
+    if (reg.isSigned && (raw & (1U << (bits - 1))))
+        raw = (~raw + 1) & mask;
+    return raw * reg.scale;
+}
+
+/******************************************************************************
+ * readECField
+ *
+ * One field, a byte at a time (EC space handlers only promise byte access).
+ * The EC may update a multi-byte field between two of those accesses, so it
+ * is read again until two passes agree, giving up after kECReadAttempts more.
+ *
+ * Space provides readByte(offset, &value), 0 on success.
+ ******************************************************************************/
+
+template <class Space>
+static inline int readECFieldBytes(Space* ec, const ECRegister& reg, uint32_t* raw)
+{
+    *raw = 0;
+    for (int i = 0; i < reg.width; i++)
+    {
+        uint8_t byte = 0;
+        if (0 != ec->readByte((uint16_t)(reg.offset + i), &byte))
+            return kECReadIOError;
+        if (reg.bigEndian)
+            *raw = *raw << 8 | byte;
+        else
+            *raw |= (uint32_t)byte << (8 * i);
+    }
+    return kECReadSuccess;
+}
+
+template <class Space>
+static inline int readECField(Space* ec, const ECRegister& reg, uint32_t* value)
+{
+    uint32_t raw;
+    if (kECReadSuccess != readECFieldBytes(ec, reg, &raw))
+        return kECReadIOError;
+
+    // a single byte can't tear
+    bool stable = 1 == reg.width;
+    for (int attempt = 0; !stable && attempt < kECReadAttempts; attempt++)
+    {
+        uint32_t again;
+        if (kECReadSuccess != readECFieldBytes(ec, reg, &again))
+            return kECReadIOError;
+        stable = again == raw;
+        raw = again;
+    }
+    if (!stable)
+        return kECReadUnstable;
+
+    *value = decodeECField(reg, raw);
+    return kECReadSuccess;
+}
+
+#endif
@@ -23,6 +23,7 @@
 #define _IOKIT_IOPMPRIVATE_H
 
 #include <IOKit/pwr_mgt/IOPM.h>
+#include <IOKit/IOMessage.h>
 
 // Private power commands issued to root domain
 // bits 0-7 in IOPM.h
@@ -35,4 +36,34 @@ enum {
     kIOPMSetACAdaptorConnected	= (1<<18),
 };
 
+// Root domain property holding the current system capabilities
+#define kIOPMSystemCapabilitiesKey  "System Capabilities"
+
+enum {
+    kIOPMSystemCapabilityCPU        = 0x01,
+    kIOPMSystemCapabilityGraphics   = 0x02,
+    kIOPMSystemCapabilityAudio      = 0x04,
+    kIOPMSystemCapabilityNetwork    = 0x08
+};
+
+// Argument of kIOMessageSystemCapabilityChange (registerPrioritySleepWakeInterest)
+struct IOPMSystemCapabilityChangeParameters {
+    uint32_t    notifyRef;
+    uint32_t    maxWaitForReply;
+    uint32_t    changeFlags;
+    uint32_t    __reserved1;
+    uint32_t    fromCapabilities;
+    uint32_t    toCapabilities;
+    uint32_t    __reserved2[4];
+};
+
+enum {
+    kIOPMSystemCapabilityWillChange = 0x01,
+    kIOPMSystemCapabilityDidChange  = 0x02
+};
+
+#ifndef kIOMessageSystemCapabilityChange
+#define kIOMessageSystemCapabilityChange    iokit_common_msg(0x340)
+#endif
+
 #endif /* ! _IOKIT_IOPMPRIVATE_H */
@@ -0,0 +1,137 @@
+/*
+ * SMBusProtocol.h
+ *
+ * SMBus transactions through the register block of an ACPI SMBus host
+ * controller (ACPI spec, SMB-HC via the EC). Register access, waiting and
+ * locking come from the caller, so the kext and the host tests (see Tests/)
+ * run the same sequence.
+ */
+
+#ifndef __SMBusProtocol__
+#define __SMBusProtocol__
+
+#include <stdint.h>
+
+// SMB-HC registers, as offsets from the base the _EC method reports
+enum
+{
+    kSMBProtocol            = 0x00,
+    kSMBStatus              = 0x01,
+    kSMBAddress             = 0x02,
+    kSMBCommand             = 0x03,
+    kSMBData                = 0x04,
+};
+
+enum
+{
+    kSMBProtocolReadWord    = 0x09,
+    kSMBStatusDone          = 0x80,
+    kSMBStatusCodeMask      = 0x1f,
+    kSMBPollAttempts        = 100,      // kSMBPollDelay apart
+    kSMBPollDelay           = 1,        // ms
+};
+
+enum
+{
+    kSMBusSuccess = 0,
+    kSMBusIOError,              // register access failed
+    kSMBusBusy,                 // lock not taken, or firmware has (or took over) the SMB-HC
+    kSMBusTimeout,              // no DONE within kSMBPollAttempts
+    kSMBusDeviceError,          // DONE with a status code (NAK, bus error...)
+};
+
+/******************************************************************************
+ * smbusReadWord
+ *
+ * One Read Word transaction to the slave at address (7-bit). The bus lock
+ * (bus->acquire, the ACPI global lock in the kext) is held only to start the
+ * transaction and to collect its result, not while the EC runs it, so AML and
+ * the EC firmware are never locked out for the kSMBPollAttempts waits.
+ * SMB_STS is cleared before SMB_PRTCL starts the transaction: a DONE left over
+ * from the previous one would otherwise end the wait at once.
+ *
+ * Bus provides acquire()/release() (true if taken), readRegister(reg, &value)
+ * and writeRegister(reg, value) (0 on success), and wait(ms).
+ ******************************************************************************/
+
+// with the bus held: idle check, then start the transaction
+template <class Bus>
+static inline int smbusStartReadWord(Bus* bus, uint8_t address, uint8_t command)
+{
+    uint8_t protocol = 0;
+    if (0 != bus->readRegister(kSMBProtocol, &protocol))
+        return kSMBusIOError;
+    // firmware (AML or the EC itself) has a transaction running
+    if (protocol)
+        return kSMBusBusy;
+
+    if (0 != bus->writeRegister(kSMBStatus, 0)
+        || 0 != bus->writeRegister(kSMBCommand, command)
+        || 0 != bus->writeRegister(kSMBAddress, (uint8_t)(address << 1))
+        || 0 != bus->writeRegister(kSMBProtocol, kSMBProtocolReadWord))
+        return kSMBusIOError;
+    return kSMBusSuccess;
+}
+
+// without the bus: poll SMB_STS for DONE
+template <class Bus>
+static inline int smbusWaitDone(Bus* bus, uint8_t* status)
+{
+    *status = 0;
+    for (int i = 0; i < kSMBPollAttempts; i++)
+    {
+        if (0 != bus->readRegister(kSMBStatus, status))
+            return kSMBusIOError;
+        if (*status & kSMBStatusDone)
+            return kSMBusSuccess;
+        bus->wait(kSMBPollDelay);
+    }
+    return kSMBusTimeout;
+}
+
+// with the bus held again: the registers may belong to a transaction firmware
+// started after ours completed, so they must still be ours (DONE, our address
+// and command) before the data is taken
+template <class Bus>
+static inline int smbusFinishReadWord(Bus* bus, uint8_t address, uint8_t command, uint16_t* value, uint8_t* status)
+{
+    uint8_t slave = 0, issued = 0;
+    if (0 != bus->readRegister(kSMBStatus, status)
+        || 0 != bus->readRegister(kSMBAddress, &slave)
+        || 0 != bus->readRegister(kSMBCommand, &issued))
+        return kSMBusIOError;
+    if (!(*status & kSMBStatusDone) || slave != (uint8_t)(address << 1) || issued != command)
+        return kSMBusBusy;
+    if (*status & kSMBStatusCodeMask)
+        return kSMBusDeviceError;
+
+    uint8_t low = 0, high = 0;
+    if (0 != bus->readRegister(kSMBData, &low) || 0 != bus->readRegister(kSMBData + 1, &high))
+        return kSMBusIOError;
+    *value = (uint16_t)(high << 8 | low);
+    return kSMBusSuccess;
+}
+
+template <class Bus>
+static inline int smbusReadWord(Bus* bus, uint8_t address, uint8_t command, uint16_t* value, uint8_t* status)
+{
+    *status = 0;
+    if (!bus->acquire())
+        return kSMBusBusy;
+    int result = smbusStartReadWord(bus, address, command);
+    bus->release();
+    if (kSMBusSuccess != result)
+        return result;
+
+    result = smbusWaitDone(bus, status);
+    if (kSMBusSuccess != result)
+        return result;
+
+    if (!bus->acquire())
+        return kSMBusBusy;
+    result = smbusFinishReadWord(bus, address, command, value, status);
+    bus->release();
+    return result;
+}
+
+#endif
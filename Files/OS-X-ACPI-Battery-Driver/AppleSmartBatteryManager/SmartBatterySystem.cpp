@@ -0,0 +1,127 @@
+//
+//  SmartBatterySystem.cpp
+//  ACPIBatteryManager
+//
+//  Smart Battery System registers read directly through the ACPI SMBus host
+//  controller (ACPI0001) that the EC exposes in its address space.
+//
+
+#include "SmartBatterySystem.h"
+#include "AppleSmartBatteryManager.h"
+
+#define super OSObject
+
+OSDefineMetaClassAndStructors(ACPISmartBatterySystem, OSObject)
+
+enum
+{
+    kSmartBatteryAddress    = 0x0b,
+    kSMBLockTimeout         = 100,      // ms to wait for the ACPI global lock
+};
+
+/******************************************************************************
+ * ACPISmartBatterySystem::smartBatterySystem
+ * NULL unless there is an SMBus host controller with a usable _EC
+ ******************************************************************************/
+
+ACPISmartBatterySystem* ACPISmartBatterySystem::smartBatterySystem(void)
+{
+    IOACPIPlatformDevice* device = NULL;
+    if (OSIterator* i = IOService::getMatchingServices(IOService::nameMatching("ACPI0001")))
+    {
+        device = OSDynamicCast(IOACPIPlatformDevice, i->getNextObject());
+        if (device)
+            device->retain();
+        i->release();
+    }
+    if (!device)
+        return NULL;
+
+    // _EC: query value in bits 0-7, SMB-HC base offset in bits 8-15
+    UInt32 ec = 0;
+    if (kIOReturnSuccess != device->evaluateInteger("_EC", &ec))
+    {
+        AlwaysLog("SMBus host controller has no _EC\n");
+        device->release();
+        return NULL;
+    }
+
+    ACPISmartBatterySystem* me = new ACPISmartBatterySystem;
+    if (!me || !me->init())
+    {
+        OSSafeReleaseNULL(me);
+        device->release();
+        return NULL;
+    }
+    me->fDevice = device;
+    me->fBase = (ec >> 8) & 0xff;
+    me->fAddress = kSmartBatteryAddress;
+    me->fLockToken = 0;
+    return me;
+}
+
+void ACPISmartBatterySystem::free(void)
+{
+    OSSafeReleaseNULL(fDevice);
+    super::free();
+}
+
+IOReturn ACPISmartBatterySystem::readRegister(UInt8 reg, UInt8* value)
+{
+    IOACPIAddress address;
+    address.addr64 = fBase + reg;
+    UInt64 result = 0;
+    IOReturn ret = fDevice->readAddressSpace(&result, kIOACPIAddressSpaceIDEmbeddedController, address, 8);
+    *value = (UInt8)result;
+    return ret;
+}
+
+IOReturn ACPISmartBatterySystem::writeRegister(UInt8 reg, UInt8 value)
+{
+    IOACPIAddress address;
+    address.addr64 = fBase + reg;
+    return fDevice->writeAddressSpace(value, kIOACPIAddressSpaceIDEmbeddedController, address, 8);
+}
+
+/******************************************************************************
+ * ACPISmartBatterySystem::acquire/release
+ * The ACPI global lock, which AML and the EC firmware also take before using
+ * the SMB-HC, held to start a transaction and to collect its result
+ ******************************************************************************/
+
+bool ACPISmartBatterySystem::acquire(void)
+{
+    mach_timespec_t timeout = { 0, kSMBLockTimeout * 1000000 };
+    return kIOReturnSuccess == fDevice->acquireGlobalLock(&fLockToken, &timeout);
+}
+
+void ACPISmartBatterySystem::release(void)
+{
+    fDevice->releaseGlobalLock(fLockToken);
+    fLockToken = 0;
+}
+
+/******************************************************************************
+ * ACPISmartBatterySystem::readWord
+ * One SMBus Read Word transaction to the battery (see smbusReadWord). Sleeps
+ * while the EC runs it, so not for use under a gate with async reads off
+ * for long.
+ ******************************************************************************/
+
+IOReturn ACPISmartBatterySystem::readWord(UInt8 command, UInt16* value)
+{
+    UInt8 status = 0;
+    switch (smbusReadWord(this, fAddress, command, value, &status))
+    {
+        case kSMBusSuccess:
+            return kIOReturnSuccess;
+        case kSMBusBusy:
+            return kIOReturnBusy;
+        case kSMBusTimeout:
+            return kIOReturnTimeout;
+        case kSMBusDeviceError:
+            DebugLog("SMBus read word 0x%x status 0x%x\n", command, status);
+            return kIOReturnIOError;
+    }
+    return kIOReturnIOError;
+}
@@ -0,0 +1,52 @@
+//
+//  SmartBatterySystem.h
+//  ACPIBatteryManager
+//
+//  Smart Battery System registers read directly through the ACPI SMBus host
+//  controller (ACPI0001) that the EC exposes in its address space.
+//
+
+#ifndef ACPIBatteryManager_SmartBatterySystem_h
+#define ACPIBatteryManager_SmartBatterySystem_h
+
+#include <IOKit/IOService.h>
+#include <IOKit/acpi/IOACPIPlatformDevice.h>
+#include "SMBusProtocol.h"
+
+// Smart Battery Data Specification commands (word registers)
+enum
+{
+    kSBSTemperature         = 0x08,     // 0.1K
+    kSBSVoltage             = 0x09,     // mV
+    kSBSCurrent             = 0x0a,     // mA, signed
+    kSBSAverageCurrent      = 0x0b,     // mA, signed
+    kSBSRunTimeToEmpty      = 0x11,     // min
+    kSBSCycleCount          = 0x17,
+};
+
+class ACPISmartBatterySystem : public OSObject
+{
+    OSDeclareDefaultStructors(ACPISmartBatterySystem)
+
+private:
+    IOACPIPlatformDevice*   fDevice;        // SMBus host controller
+    UInt8                   fBase;          // SMB-HC registers in EC space (from _EC)
+    UInt8                   fAddress;       // smart battery slave address
+    UInt32                  fLockToken;     // ACPI global lock, while acquired
+public:
+    static ACPISmartBatterySystem* smartBatterySystem(void);
+
+    virtual void            free(void);
+
+    IOReturn                readWord(UInt8 command, UInt16* value);
+    UInt8                   getBase(void) { return fBase; }
+
+    // SMB-HC access for smbusReadWord (SMBusProtocol.h)
+    bool                    acquire(void);
+    void                    release(void);
+    IOReturn                readRegister(UInt8 reg, UInt8* value);
+    IOReturn                writeRegister(UInt8 reg, UInt8 value);
+    void                    wait(uint32_t ms) { IOSleep(ms); }
+};
+
+#endif
@@ -0,0 +1,215 @@
+/*
+ * AveragingTest.cpp
+ *
+ * _BMA/_BMS negotiation against a mock battery provider, and the _BST
+ * evaluations saved when the firmware averages the rate over a bursty load.
+ */
+
+#include <math.h>
+
+#include "TestHarness.h"
+#include "BatteryTrace.h"
+
+/*
+ * Firmware model: _BMA/_BMS accept values inside the bounds it implements
+ * (0, like a _BMA returning 1, otherwise). Once _BMA is set, _BST reports
+ * the rate averaged over the interval instead of the instantaneous one.
+ */
+struct MockBatteryProvider
+{
+    bool        hasBMA, hasBMS;
+    uint32_t    minInterval, maxInterval;
+    uint32_t    averagingInterval;
+    uint32_t    samplingTime;
+    uint32_t    bmaCalls, bmsCalls;
+
+    MockBatteryProvider(bool bma, bool bms, uint32_t min, uint32_t max)
+        : hasBMA(bma), hasBMS(bms), minInterval(min), maxInterval(max),
+          averagingInterval(0), samplingTime(0), bmaCalls(0), bmsCalls(0) {}
+
+    int setBatteryBMA(uint32_t interval)
+    {
+        ++bmaCalls;
+        if (!hasBMA || interval < minInterval || interval > maxInterval)
+            return 1;
+        averagingInterval = interval;
+        return 0;
+    }
+
+    int setBatteryBMS(uint32_t sampling)
+    {
+        ++bmsCalls;
+        if (!hasBMS)
+            return 1;
+        samplingTime = sampling;
+        return 0;
+    }
+
+    // _BST as this firmware reports it over the load in raw
+    BatteryTrace bst(const BatteryTrace& raw) const
+    {
+        BatteryTrace trace = raw;
+        if (!averagingInterval)
+            return trace;
+        uint64_t sum = 0;
+        size_t first = 0;
+        for (size_t i = 0; i < raw.samples.size(); i++)
+        {
+            sum += raw.samples[i].rate;
+            while (raw.samples[i].time - raw.samples[first].time >= averagingInterval)
+                sum -= raw.samples[first++].rate;
+            trace.samples[i].rate = (uint32_t)(sum / (i - first + 1));
+        }
+        return trace;
+    }
+};
+
+static void testNegotiation(void)
+{
+    uint32_t interval, sampling;
+
+    // inside the _BIX bounds: accepted as configured
+    MockBatteryProvider full(true, true, 1000, 60000);
+    AveragingRequest request = { 20000, 1000, 60000, 2000, 500, 5000 };
+    negotiateFirmwareAveraging(&full, request, interval, sampling);
+    CHECK_EQ(interval, 20000);
+    CHECK_EQ(sampling, 2000);
+    CHECK_EQ(full.averagingInterval, 20000);
+
+    // outside them: clamped before the firmware sees it
+    MockBatteryProvider clamped(true, true, 1000, 60000);
+    AveragingRequest wide = { 90000, 1000, 60000, 100, 500, 5000 };
+    negotiateFirmwareAveraging(&clamped, wide, interval, sampling);
+    CHECK_EQ(interval, 60000);
+    CHECK_EQ(sampling, 500);
+
+    // firmware refuses: nothing is assumed
+    MockBatteryProvider refusing(true, false, 30000, 60000);
+    AveragingRequest low = { 20000, 0, 0, 2000, 0, 0 };
+    negotiateFirmwareAveraging(&refusing, low, interval, sampling);
+    CHECK_EQ(interval, 0);
+    CHECK_EQ(sampling, 0);
+
+    // nothing configured: no evaluation at all
+    MockBatteryProvider idle(true, true, 1000, 60000);
+    AveragingRequest none = {};
+    negotiateFirmwareAveraging(&idle, none, interval, sampling);
+    CHECK_EQ(idle.bmaCalls + idle.bmsCalls, 0);
+}
+
+/*
+ * What AvgTimeToEmpty should follow: the load averaged over the window.
+ * Estimates are compared with it at every read, as RMS error in mA.
+ */
+static uint32_t windowAverage(const BatteryTrace& raw, uint64_t t, uint32_t window)
+{
+    uint64_t sum = 0, count = 0;
+    for (size_t i = 0; i < raw.samples.size() && raw.samples[i].time <= t; i++)
+    {
+        if (raw.samples[i].time + window > t)
+        {
+            sum += raw.samples[i].rate;
+            ++count;
+        }
+    }
+    return count ? (uint32_t)(sum / count) : 0;
+}
+
+static double rmsError(const BatteryTrace& raw, const std::vector<uint64_t>& times,
+                       const std::vector<uint32_t>& estimates, uint32_t window)
+{
+    double sum = 0;
+    for (size_t i = 0; i < times.size(); i++)
+    {
+        double error = (double)estimates[i] - windowAverage(raw, times[i], window);
+        sum += error * error;
+    }
+    return times.empty() ? 0 : sqrt(sum / times.size());
+}
+
+/*
+ * Without _BMA the kext has to average the instantaneous _BST itself, from
+ * every read inside the window: stable only if it reads often.
+ */
+static double softwareAveragingError(const BatteryTrace& raw, uint32_t interval, uint32_t window, uint64_t& reads)
+{
+    std::vector<uint64_t> times;
+    std::vector<uint32_t> estimates;
+    for (uint64_t t = raw.start() + window; t < raw.end(); t += interval)
+    {
+        uint64_t sum = 0, count = 0;
+        for (uint64_t s = t; s + window > t && s >= raw.start() + interval; s -= interval)
+        {
+            sum += raw.at(s).rate;
+            ++count;
+        }
+        times.push_back(t);
+        estimates.push_back(count ? (uint32_t)(sum / count) : 0);
+    }
+    reads = times.size();
+    return rmsError(raw, times, estimates, window);
+}
+
+static void testFewerBSTEvaluations(void)
+{
+    // bursty load: an hour of 4-10 second spikes over a light baseline
+    TraceLoad loads[514];
+    for (int i = 0; i < 514; i++)
+    {
+        loads[i].duration = 4000 + (i % 3) * 3000;
+        loads[i].rate = (i & 1) ? 2600 : 700;
+    }
+    BatteryTrace raw = makeTrace(loads, sizeof(loads) / sizeof(loads[0]), 1000, 300);
+
+    MockBatteryProvider plain(false, false, 0, 0);
+    MockBatteryProvider averaging(true, true, 1000, 60000);
+    AveragingRequest request = { 20000, 1000, 60000, 0, 0, 0 };
+    uint32_t interval, sampling;
+    negotiateFirmwareAveraging(&plain, request, interval, sampling);
+    CHECK_EQ(interval, 0);
+    ReplayConfig config;
+    config.averagingInterval = interval;
+    ReplayResult without = replay(plain.bst(raw), config);
+
+    negotiateFirmwareAveraging(&averaging, request, interval, sampling);
+    CHECK_EQ(interval, 20000);
+    config.averagingInterval = interval;
+    BatteryTrace reported = averaging.bst(raw);
+    ReplayResult with = replay(reported, config);
+
+    // the firmware's average, read when the scheduler polls
+    std::vector<uint32_t> estimates;
+    for (size_t i = 0; i < with.times.size(); i++)
+        estimates.push_back(reported.at(with.times[i]).rate);
+    double target = rmsError(raw, with.times, estimates, interval);
+
+    // the slowest polling that matches it by averaging in software, within 5% of the mean load
+    double tolerance = (700 + 2600) / 2 * 0.05;
+    static const uint32_t intervals[] = { 1000, 2000, 3000, 5000, 10000, 20000 };
+    uint64_t needed = 0;
+    for (unsigned i = 0; i < sizeof(intervals) / sizeof(intervals[0]); i++)
+    {
+        uint64_t reads;
+        double error = softwareAveragingError(raw, intervals[i], interval, reads);
+        printf("  software average of %5u ms reads: %5.0f mA RMS error, %6.0f _BST/hour\n",
+               intervals[i], error, with.perHour(reads));
+        if (error <= target + tolerance)
+            needed = reads;
+    }
+
+    printf("_BST evaluations/hour for the same stability: %.0f averaging in software, %.0f with a %u ms _BMA window "
+           "(%.0f mA RMS error; %.0f/hour with neither)\n",
+           with.perHour(needed), with.perHour(with.polls), (unsigned)interval, target, without.perHour(without.polls));
+
+    CHECK(needed);
+    CHECK(with.polls < needed);
+    CHECK(target < tolerance);
+    CHECK(with.maxGap <= config.intervalMax);
+}
+
+int main(void)
+{
+    testNegotiation();
+    testFewerBSTEvaluations();
+    return testSummary("AveragingTest");
+}
@@ -0,0 +1,242 @@
+/*
+ * BatteryTrace.h
+ *
+ * _BST traces for the host tests and a replay of the kext's poll scheduler
+ * (BatteryPolicy.h) against them.
+ *
+ * A trace is what the EC reports: one sample per EC refresh, held until the
+ * next, so a poll between two refreshes reads a duplicate. Traces are either
+ * synthesized (makeTrace, with a known refresh period and phase) or loaded
+ * from a recording, one "time_ms,status,rate,capacity,voltage" line per
+ * _BST that changed.
+ */
+
+#ifndef __BatteryTrace__
+#define __BatteryTrace__
+
+#include <stdio.h>
+#include <vector>
+
+#include "BatteryPolicy.h"
+
+struct TraceSample
+{
+    uint64_t    time;           // ms
+    uint32_t    status;
+    uint32_t    rate;           // mA
+    uint32_t    capacity;       // mAh
+    uint32_t    voltage;        // mV
+};
+
+struct BatteryTrace
+{
+    std::vector<TraceSample> samples;
+    uint32_t    maxCapacity;
+    uint32_t    capacityWarning;
+    uint32_t    lowWarning;
+
+    uint64_t start(void) const { return samples.empty() ? 0 : samples.front().time; }
+    uint64_t end(void) const { return samples.empty() ? 0 : samples.back().time; }
+
+    // what _BST returns at time t: the last refresh at or before it
+    const TraceSample& at(uint64_t t) const
+    {
+        size_t lo = 0, hi = samples.size();
+        while (hi - lo > 1)
+        {
+            size_t mid = (lo + hi) / 2;
+            if (samples[mid].time <= t)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        return samples[lo];
+    }
+};
+
+// One stretch of constant load: rate in mA, negative while charging
+struct TraceLoad
+{
+    uint32_t    duration;       // ms
+    int32_t     rate;
+};
+
+/*
+ * EC model: refreshes every period ms starting at phase, reporting the
+ * load's rate with a little deterministic noise and the capacity integrated
+ * from it. Enough refreshes, enough noise that consecutive refreshes differ.
+ */
+static inline BatteryTrace makeTrace(const TraceLoad* loads, int count, uint32_t period, uint32_t phase,
+                              uint32_t fullCapacity = 5000, uint32_t startCapacity = 4800)
+{
+    BatteryTrace trace;
+    trace.maxCapacity = fullCapacity;
+    trace.capacityWarning = fullCapacity / 20;
+    trace.lowWarning = fullCapacity * 3 / 100;
+
+    uint32_t seed = 12345;
+    double capacity = startCapacity;
+    uint64_t t = phase;
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t end = t + loads[i].duration;
+        for (; t < end; t += period)
+        {
+            seed = seed * 1103515245 + 12345;
+            int32_t noise = (int32_t)((seed >> 16) % 21) - 10;
+            int32_t rate = loads[i].rate + (loads[i].rate ? noise : 0);
+            capacity -= (double)rate * period / kMilliSecondsPerHour;
+            if (capacity < 0)
+                capacity = 0;
+            if (capacity > fullCapacity)
+                capacity = fullCapacity;
+
+            TraceSample sample;
+            sample.time = t;
+            sample.status = rate > 0 ? BATTERY_DISCHARGING : rate < 0 ? BATTERY_CHARGING : BATTERY_CHARGED;
+            sample.rate = rate < 0 ? -rate : rate;
+            sample.capacity = (uint32_t)capacity;
+            sample.voltage = 11000 + (uint32_t)(capacity * 1500 / fullCapacity);
+            trace.samples.push_back(sample);
+        }
+    }
+    return trace;
+}
+
+// A recorded trace; false if the file can't be read or has no samples
+static inline bool loadTrace(const char* path, BatteryTrace& trace, uint32_t fullCapacity)
+{
+    FILE* file = fopen(path, "r");
+    if (!file)
+        return false;
+    trace.samples.clear();
+    trace.maxCapacity = fullCapacity;
+    trace.capacityWarning = fullCapacity / 20;
+    trace.lowWarning = fullCapacity * 3 / 100;
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        unsigned long long time;
+        unsigned status, rate, capacity, voltage;
+        if (5 == sscanf(line, "%llu,%u,%u,%u,%u", &time, &status, &rate, &capacity, &voltage))
+        {
+            TraceSample sample = { time, status, rate, capacity, voltage };
+            trace.samples.push_back(sample);
+        }
+    }
+    fclose(file);
+    return !trace.samples.empty();
+}
+
+/******************************************************************************
+ * Replay
+ ******************************************************************************/
+
+// ACPI evaluations of one poll; static info (_STA, _BIX) every refresh interval
+struct ReplayConfig
+{
+    uint32_t    intervalMin;
+    uint32_t    intervalMax;
+    uint32_t    minSamplingTime;        // _BIX
+    uint32_t    averagingInterval;      // accepted by _BMA, 0 if none
+    uint32_t    staticInfoInterval;     // ms between _STA/_BIX reads
+    uint32_t    callsPerPoll;           // _BST, plus BBIX when read every poll
+    bool        trackECRefresh;
+    bool        quickPoll;              // poll at the floor, as in Quick Poll
+
+    ReplayConfig()
+        : intervalMin(1000), intervalMax(30000), minSamplingTime(0), averagingInterval(0),
+          staticInfoInterval(600000), callsPerPoll(1), trackECRefresh(true), quickPoll(false) {}
+};
+
+struct ReplayResult
+{
+    uint32_t    polls;                  // _BST reads
+    uint32_t    duplicates;             // _BST identical to the previous read
+    uint64_t    calls;                  // ACPI evaluations
+    uint64_t    duration;               // ms
+    uint32_t    maxGap;                 // longest interval, ms
+    uint32_t    belowFloor;             // intervals shorter than the floor at the time
+    uint32_t    period;                 // learned EC refresh period, 0 if not locked
+    std::vector<uint64_t> times;        // when each poll read _BST
+
+    double perHour(uint64_t count) const
+    {
+        return duration ? (double)count * kMilliSecondsPerHour / duration : 0;
+    }
+};
+
+/*
+ * The kext's scheduling path (nextPollingInterval without the startup and
+ * notify driven cases): decaying average rate as in setBatteryBST,
+ * pollIntervalForState (or just the floor for Quick Poll), then EC refresh
+ * alignment.
+ */
+static inline ReplayResult replay(const BatteryTrace& trace, const ReplayConfig& config)
+{
+    ReplayResult result = ReplayResult();
+    ECRefreshTracker tracker;
+    tracker.reset();
+    PollSample last = {};
+    uint32_t status = ACPI_UNKNOWN, averageRate = 0;
+    uint64_t staticTime = 0;
+    bool haveStatic = false;
+
+    for (uint64_t t = trace.start(); t < trace.end(); )
+    {
+        const TraceSample& s = trace.at(t);
+        ++result.polls;
+        result.times.push_back(t);
+        result.calls += config.callsPerPoll;
+        if (!haveStatic || t - staticTime >= config.staticInfoInterval)
+        {
+            result.calls += 2;
+            staticTime = t;
+            haveStatic = true;
+        }
+        if (tracker.valid && s.status == tracker.lastStatus && s.rate == tracker.lastRate
+            && s.capacity == tracker.lastCapacity && s.voltage == tracker.lastVoltage)
+            ++result.duplicates;
+        if (config.trackECRefresh)
+            tracker.track(t, s.status, s.rate, s.capacity, s.voltage);
+        else
+        {
+            tracker.valid = true;
+            tracker.lastStatus = s.status;
+            tracker.lastRate = s.rate;
+            tracker.lastCapacity = s.capacity;
+            tracker.lastVoltage = s.voltage;
+        }
+
+        if (s.status != status)
+        {
+            status = s.status;
+            averageRate = 0;
+        }
+        if (!averageRate || config.averagingInterval)
+            averageRate = s.rate;
+        averageRate = (averageRate + s.rate) / 2;
+
+        PollState state = { s.status, s.rate, averageRate, s.capacity, trace.maxCapacity,
+                            trace.capacityWarning, trace.lowWarning, 0 };
+        uint64_t interval = pollIntervalForState(state, last, t, config.intervalMax);
+        last.time = t;
+        last.capacity = s.capacity;
+        last.rate = s.rate;
+
+        uint32_t floor = pollIntervalFloor(config.intervalMin, config.intervalMax, config.minSamplingTime,
+                                           config.averagingInterval, tracker.lockedPeriod());
+        uint32_t next = config.quickPoll ? floor : clampPollInterval(interval, floor, config.intervalMax);
+        next = tracker.align(t, next, floor, config.intervalMax);
+        if (next > result.maxGap)
+            result.maxGap = next;
+        if (next < floor)
+            ++result.belowFloor;
+        t += next;
+    }
+    result.duration = trace.end() - trace.start();
+    result.period = tracker.lockedPeriod();
+    return result;
+}
+
+#endif
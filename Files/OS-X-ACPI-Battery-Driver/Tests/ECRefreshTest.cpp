@@ -0,0 +1,86 @@
+/*
+ * ECRefreshTest.cpp
+ *
+ * EC refresh period learning and poll alignment, replayed over traces with
+ * known refresh periods and phases.
+ */
+
+#include "TestHarness.h"
+#include "BatteryTrace.h"
+
+static ECRefreshTracker lockedTracker(uint32_t period, uint64_t refreshTime, uint32_t margin)
+{
+    ECRefreshTracker tracker;
+    tracker.reset();
+    tracker.valid = true;
+    tracker.period = period;
+    tracker.confidence = kECRefreshConfidence;
+    tracker.refreshTime = refreshTime;
+    tracker.phaseMargin = margin;
+    return tracker;
+}
+
+static void testAlign(void)
+{
+    // refreshes at 10000 + n*5000, read 500 ms after each
+    ECRefreshTracker tracker = lockedTracker(5000, 10000, 500);
+
+    // the last refresh before the poll is due
+    CHECK_EQ(tracker.align(12000, 12000, 5000, 30000), 8500);
+
+    // that one is sooner than the floor: the first one at or after it
+    CHECK_EQ(tracker.align(12000, 5000, 5000, 30000), 8500);
+    CHECK_EQ(tracker.align(15600, 5000, 5000, 30000), 9900);
+
+    // and never past the maximum
+    CHECK_EQ(tracker.align(12000, 29000, 29000, 30000), 30000);
+
+    // not locked: left alone
+    ECRefreshTracker learning = lockedTracker(5000, 10000, 500);
+    learning.confidence = 0;
+    CHECK_EQ(learning.align(12000, 5000, 5000, 30000), 5000);
+}
+
+static void testKnownPeriods(void)
+{
+    // an hour of changing load, read at the floor (Quick Poll): the only
+    // polling fast enough to learn from, and the one that gains most
+    TraceLoad loads[180];
+    for (int i = 0; i < 180; i++)
+    {
+        loads[i].duration = 10000 + (i % 3) * 10000;
+        loads[i].rate = (i & 1) ? 2400 : 800;
+    }
+    static const struct { uint32_t period, phase; } ecs[] = {
+        { 2000, 700 }, { 3000, 100 }, { 5000, 2300 }, { 7000, 6100 },
+    };
+
+    for (unsigned i = 0; i < sizeof(ecs) / sizeof(ecs[0]); i++)
+    {
+        BatteryTrace trace = makeTrace(loads, sizeof(loads) / sizeof(loads[0]), ecs[i].period, ecs[i].phase);
+
+        ReplayConfig config;
+        config.quickPoll = true;
+        ReplayResult aligned = replay(trace, config);
+        config.trackECRefresh = false;
+        ReplayResult blind = replay(trace, config);
+
+        printf("EC refresh %4u ms (phase %4u): learned %4u ms, duplicate reads %4.1f%% aligned vs %4.1f%% unaligned, %.0f vs %.0f _BST/hour\n",
+               ecs[i].period, ecs[i].phase, aligned.period,
+               100.0 * aligned.duplicates / aligned.polls, 100.0 * blind.duplicates / blind.polls,
+               aligned.perHour(aligned.polls), blind.perHour(blind.polls));
+
+        CHECK(valueDelta(aligned.period, ecs[i].period) * 20 <= ecs[i].period);
+        CHECK_EQ(aligned.belowFloor, 0);
+        CHECK(aligned.maxGap <= config.intervalMax);
+        CHECK(aligned.duplicates * 10 <= aligned.polls);
+        CHECK(aligned.duplicates < blind.duplicates);
+    }
+}
+
+int main(void)
+{
+    testAlign();
+    testKnownPeriods();
+    return testSummary("ECRefreshTest");
+}
@@ -0,0 +1,216 @@
+/*
+ * ECRegisterTest.cpp
+ *
+ * ECRegisterMap decoding and double reads against a stand-in EC that updates
+ * the battery fields while they are read, and the per-read latency the
+ * double read costs.
+ */
+
+#include <string.h>
+#include <vector>
+
+#include "TestHarness.h"
+#include "ECRegisterMap.h"
+
+/*
+ * EC model: byte access costs byteCost us of EC time. The rate field (16-bit
+ * at kRateOffset) takes its next value at every update time, between any
+ * two byte accesses, moving across a byte boundary each time.
+ */
+enum
+{
+    kStatusOffset   = 0x20,
+    kRateOffset     = 0x22,
+    kCapacityOffset = 0x24,
+    kVoltageOffset  = 0x26,
+};
+
+struct MockEC
+{
+    uint8_t                 mem[0x100];
+    uint64_t                now;            // us
+    uint32_t                byteCost;       // us per byte access
+    uint64_t                nextUpdate;     // us, 0 = never
+    uint32_t                updatePeriod;   // us, 0 = once
+    uint32_t                accesses;
+    int                     failAfter;      // accesses until an I/O error, -1 = never
+    std::vector<uint32_t>   rates;          // every value the rate field held
+
+    MockEC(uint32_t cost)
+        : now(0), byteCost(cost), nextUpdate(0), updatePeriod(0), accesses(0), failAfter(-1)
+    {
+        memset(mem, 0, sizeof(mem));
+        mem[kStatusOffset] = 0x41;
+        setWord(kCapacityOffset, 3200);
+        setWord(kVoltageOffset, 12400);
+        setRate(0x00ff);
+    }
+
+    void setWord(uint16_t offset, uint16_t value)
+    {
+        mem[offset] = value & 0xff;
+        mem[offset + 1] = value >> 8;
+    }
+
+    void setRate(uint16_t value)
+    {
+        setWord(kRateOffset, value);
+        rates.push_back(value);
+    }
+
+    int readByte(uint16_t offset, uint8_t* value)
+    {
+        if (failAfter >= 0 && accesses >= (uint32_t)failAfter)
+            return 1;
+        ++accesses;
+        now += byteCost;
+        while (nextUpdate && now >= nextUpdate)
+        {
+            // 0x00ff, 0x0100, 0x01ff, 0x0200...: every other step carries into the high byte
+            uint16_t rate = (uint16_t)rates.back();
+            setRate((rate & 0xff) == 0xff ? rate + 1 : (uint16_t)(rate + 0xff));
+            nextUpdate = updatePeriod ? nextUpdate + updatePeriod : 0;
+        }
+        *value = mem[offset];
+        return 0;
+    }
+};
+
+static ECRegister field(uint16_t offset, uint8_t width)
+{
+    ECRegister reg = {};
+    reg.offset = offset;
+    reg.width = width;
+    reg.scale = 1;
+    return reg;
+}
+
+static void testDecode(void)
+{
+    ECRegister reg = field(0, 2);
+    CHECK_EQ(decodeECField(reg, 0x1234), 0x1234);
+    CHECK_EQ(decodeECField(reg, 0xffff), ACPI_UNKNOWN);
+
+    reg.isSigned = true;
+    CHECK_EQ(decodeECField(reg, 0xfc18), 1000);
+    reg.isSigned = false;
+    reg.scale = 10;
+    CHECK_EQ(decodeECField(reg, 320), 3200);
+
+    // status bits mapped one by one; other EC bits (AC present...) dropped
+    ECRegister status = field(0, 1);
+    status.dischargingMask = 0x01;
+    status.chargingMask = 0x02;
+    status.criticalMask = 0x40;
+    CHECK_EQ(decodeECField(status, 0x01 | 0x80), BATTERY_DISCHARGING);
+    CHECK_EQ(decodeECField(status, 0x41), BATTERY_DISCHARGING | BATTERY_CRITICAL);
+    CHECK_EQ(decodeECField(status, 0x02), BATTERY_CHARGING);
+    CHECK_EQ(decodeECField(status, 0x80), BATTERY_CHARGED);
+    // without masks the EC byte is taken as the _BST state
+    CHECK_EQ(decodeECField(field(0, 1), 0x02), BATTERY_CHARGING);
+
+    MockEC ec(30);
+    ECRegister big = field(kCapacityOffset, 2);
+    big.bigEndian = true;
+    uint32_t value = 0;
+    CHECK_EQ(readECField(&ec, big, &value), kECReadSuccess);
+    CHECK_EQ(value, (3200 & 0xff) << 8 | 3200 >> 8);
+}
+
+// true if value is one the rate field actually held while it was being read
+static bool heldDuring(const MockEC& ec, size_t first, uint32_t value)
+{
+    for (size_t i = first; i < ec.rates.size(); i++)
+    {
+        if (ec.rates[i] == value)
+            return true;
+    }
+    return false;
+}
+
+static void testTornReads(void)
+{
+    ECRegister rate = field(kRateOffset, 2);
+
+    // an update landing between every pair of byte accesses in turn
+    unsigned torn = 0, tornSingle = 0, reads = 0;
+    for (uint32_t at = 1; at <= 6; at++)
+    {
+        MockEC ec(30);
+        ec.nextUpdate = at * ec.byteCost;
+        size_t first = ec.rates.size() - 1;
+        uint32_t raw = 0;
+        CHECK_EQ(readECFieldBytes(&ec, rate, &raw), kECReadSuccess);
+        tornSingle += !heldDuring(ec, first, raw);
+
+        MockEC again(30);
+        again.nextUpdate = at * again.byteCost;
+        first = again.rates.size() - 1;
+        uint32_t value = 0;
+        CHECK_EQ(readECField(&again, rate, &value), kECReadSuccess);
+        torn += !heldDuring(again, first, value);
+        ++reads;
+    }
+    printf("rate field read across an EC update: %u/%u torn with one pass, %u/%u with double reads\n",
+           tornSingle, reads, torn, reads);
+    CHECK(tornSingle > 0);
+    CHECK_EQ(torn, 0);
+
+    // updating faster than it can be read twice: reported, not guessed
+    MockEC busy(30);
+    busy.nextUpdate = 30;
+    busy.updatePeriod = 60;
+    uint32_t value = 0xbeef;
+    CHECK_EQ(readECField(&busy, rate, &value), kECReadUnstable);
+    CHECK_EQ(value, 0xbeef);
+    CHECK_EQ(busy.accesses, 2 * (1 + kECReadAttempts));
+
+    // an I/O error on the second pass fails the field
+    MockEC failing(30);
+    failing.failAfter = 3;
+    CHECK_EQ(readECField(&failing, rate, &value), kECReadIOError);
+}
+
+static void testLatency(void)
+{
+    // the _BST fields of a typical map: 8-bit status, 16-bit rate/capacity/voltage
+    ECRegister map[4] = { field(kStatusOffset, 1), field(kRateOffset, 2), field(kCapacityOffset, 2), field(kVoltageOffset, 2) };
+    static const uint32_t costs[] = { 10, 30, 100 };
+
+    for (unsigned c = 0; c < sizeof(costs) / sizeof(costs[0]); c++)
+    {
+        // one pass per field vs double reads, EC updating once a second
+        // with a poll per second, every phase of the update against the poll
+        uint64_t singleTime = 0, doubleTime = 0;
+        unsigned polls = 0, retried = 0, failed = 0;
+        for (uint32_t phase = 1; phase < 1000000; phase += 7)
+        {
+            MockEC single(costs[c]);
+            uint32_t raw;
+            for (int i = 0; i < 4; i++)
+                readECFieldBytes(&single, map[i], &raw);
+            singleTime += single.now;
+
+            MockEC twice(costs[c]);
+            twice.nextUpdate = phase;
+            uint32_t value;
+            for (int i = 0; i < 4; i++)
+                failed += kECReadSuccess != readECField(&twice, map[i], &value);
+            doubleTime += twice.now;
+            retried += twice.accesses > 13;
+            ++polls;
+        }
+        printf("EC byte access %3u us: %5.0f us per read with one pass, %5.0f us with double reads (%u of %u polls re-read)\n",
+               costs[c], (double)singleTime / polls, (double)doubleTime / polls, retried, polls);
+        CHECK_EQ(failed, 0);
+        CHECK(doubleTime < 2 * singleTime + polls * 2 * costs[c]);
+    }
+}
+
+int main(void)
+{
+    testDecode();
+    testTornReads();
+    testLatency();
+    return testSummary("ECRegisterTest");
+}
@@ -0,0 +1,215 @@
+/*
+ * PollSchedulerTest.cpp
+ *
+ * Poll interval, trip point, measurement error and ACPI budget checks, and a replay of the
+ * scheduler over battery traces reporting ACPI evaluations per hour against
+ * the fixed-interval polling it replaced.
+ */
+
+#include <stdlib.h>
+
+#include "TestHarness.h"
+#include "BatteryTrace.h"
+
+// The old scheduler: _STA, _BIX, BBIX and _BST every second on battery,
+// every 30 seconds on AC
+static uint64_t fixedIntervalCalls(const BatteryTrace& trace)
+{
+    uint64_t calls = 0;
+    for (uint64_t t = trace.start(); t < trace.end(); )
+    {
+        const TraceSample& s = trace.at(t);
+        calls += 4;
+        t += (s.status & BATTERY_DISCHARGING) ? 1000 : 30000;
+    }
+    return calls;
+}
+
+static void testPollInterval(void)
+{
+    PollState state = { BATTERY_DISCHARGING, 1000, 1000, 4000, 5000, 250, 150, 0 };
+    PollSample none = {};
+
+    // 1% of 5000 mAh at 1000 mA is 3 minutes, capped by intervalMax
+    CHECK_EQ(pollIntervalForState(state, none, 1000, 30000), 30000);
+    CHECK_EQ(pollIntervalForState(state, none, 1000, 600000), 180000);
+
+    // approaching the warning level: get there in two polls
+    state.capacity = 260;
+    CHECK_EQ(pollIntervalForState(state, none, 1000, 600000), 18000);
+
+    // rate swung by more than 25% since the last sample
+    state.capacity = 4000;
+    PollSample last = { 1000, 4000, 500 };
+    CHECK_EQ(pollIntervalForState(state, last, 61000, 600000), 30000);
+
+    // with a trip point armed, only a load change shortens the interval
+    state.tripPoint = 3950;
+    last.rate = 1000;
+    CHECK_EQ(pollIntervalForState(state, last, 61000, 600000), 600000);
+    last.rate = 500;
+    CHECK_EQ(pollIntervalForState(state, last, 61000, 600000), 30000);
+
+    // charged: nothing moves
+    PollState full = { BATTERY_CHARGED, 0, 0, 5000, 5000, 250, 150, 0 };
+    CHECK_EQ(pollIntervalForState(full, none, 1000, 600000), 600000);
+
+    // floor: the slowest of the firmware's sampling limits, never above the max
+    CHECK_EQ(pollIntervalFloor(1000, 30000, 0, 0, 0), 1000);
+    CHECK_EQ(pollIntervalFloor(1000, 30000, 2000, 5000, 4000), 5000);
+    CHECK_EQ(pollIntervalFloor(1000, 30000, 0, 60000, 0), 30000);
+    CHECK_EQ(clampPollInterval(200, 1000, 30000), 1000);
+    CHECK_EQ(clampPollInterval(90000, 1000, 30000), 30000);
+}
+
+static void testTripPoint(void)
+{
+    // discharging: next whole percent below, or a warning level above it
+    CHECK_EQ(batteryTripPoint(BATTERY_DISCHARGING, 4025, 5000, 250, 150), 4000);
+    CHECK_EQ(batteryTripPoint(BATTERY_DISCHARGING, 4000, 5000, 250, 150), 3950);
+    CHECK_EQ(batteryTripPoint(BATTERY_DISCHARGING, 260, 5000, 250, 150), 250);
+    CHECK_EQ(batteryTripPoint(BATTERY_DISCHARGING, 240, 5000, 250, 150), 200);
+    CHECK_EQ(batteryTripPoint(BATTERY_DISCHARGING, 155, 5000, 250, 150), 150);
+
+    // charging: next whole percent above
+    CHECK_EQ(batteryTripPoint(BATTERY_CHARGING, 4025, 5000, 250, 150), 4050);
+    CHECK_EQ(batteryTripPoint(BATTERY_CHARGING, 5000, 5000, 250, 150), 0);
+
+    // nothing to arm without a capacity
+    CHECK_EQ(batteryTripPoint(BATTERY_DISCHARGING, ACPI_UNKNOWN, 5000, 250, 150), 0);
+    CHECK_EQ(batteryTripPoint(BATTERY_DISCHARGING, 4000, 0, 250, 150), 0);
+}
+
+static void testMeasurementError(void)
+{
+    // 1% accuracy on a 5000 mAh battery: a 50 mAh band
+    PublishedBST published = { true, BATTERY_DISCHARGING, 4000, 1000, 5000 };
+    CHECK(isBelowMeasurementError(published, BATTERY_DISCHARGING, 3990, 1005, 5000, ACPI_UNKNOWN, ACPI_UNKNOWN, 99000));
+    CHECK(!isBelowMeasurementError(published, BATTERY_CHARGING, 3990, 1005, 5000, ACPI_UNKNOWN, ACPI_UNKNOWN, 99000));
+    CHECK(!isBelowMeasurementError(published, BATTERY_DISCHARGING, 3990, 1005, 4900, ACPI_UNKNOWN, ACPI_UNKNOWN, 99000));
+    CHECK(!isBelowMeasurementError(published, BATTERY_DISCHARGING, 3990, 1005, 5000, 3995, ACPI_UNKNOWN, 99000));
+
+    // slow drift, 1 mAh per poll: each step is inside the band, but it is
+    // published every time it has moved by more than the band since last
+    unsigned publishes = 0;
+    uint32_t lag = 0;
+    for (uint32_t capacity = 4000; capacity > 3000; capacity--)
+    {
+        if (!isBelowMeasurementError(published, BATTERY_DISCHARGING, capacity, 1000, 5000, ACPI_UNKNOWN, ACPI_UNKNOWN, 99000))
+        {
+            published.capacity = capacity;
+            ++publishes;
+        }
+        if (published.capacity - capacity > lag)
+            lag = published.capacity - capacity;
+    }
+    CHECK_EQ(publishes, 1000 / 51);
+    CHECK_EQ(lag, 50);
+}
+
+static void testBudget(void)
+{
+    ACPIBudget budget;
+    uint32_t retry = 0;
+
+    budget.set(0, 0);
+    CHECK(budget.request(kACPIPriorityTimer, 1000, 0, &retry));
+
+    // 8 per minute: timer polls leave 2 for Notify
+    budget.set(8, 0);
+    CHECK(budget.request(kACPIPriorityTimer, 6, 0, &retry));
+    CHECK(!budget.request(kACPIPriorityTimer, 1, 0, &retry));
+    CHECK_EQ(retry, 7500);
+    CHECK(budget.request(kACPIPriorityNotify, 2, 0, &retry));
+    CHECK(!budget.request(kACPIPriorityNotify, 1, 0, &retry));
+    CHECK_EQ(budget.available(), 0);
+
+    // wake is always admitted; the debt stops at one bucket
+    CHECK(budget.request(kACPIPriorityWake, 100, 0, &retry));
+    CHECK_EQ(budget.available(), -8);
+
+    // refills at perMinute, capped at one bucket
+    budget.refill(kMilliSecondsPerMinute);
+    CHECK_EQ(budget.available(), 0);
+    budget.refill(10 * kMilliSecondsPerMinute);
+    CHECK_EQ(budget.available(), 8);
+
+    // a full poll costs more than 4 per minute less the reserve: admitted
+    // each time the bucket is full instead of never
+    budget.set(4, 0);
+    CHECK(budget.request(kACPIPriorityTimer, 4, 0, &retry));
+    CHECK(!budget.request(kACPIPriorityTimer, 4, 1000, &retry));
+    CHECK_EQ(retry, kMilliSecondsPerMinute - 1000);
+    CHECK(budget.request(kACPIPriorityTimer, 4, kMilliSecondsPerMinute, &retry));
+    CHECK(!budget.request(kACPIPriorityNotify, 5, kMilliSecondsPerMinute, &retry));
+    CHECK(budget.request(kACPIPriorityNotify, 5, 2 * kMilliSecondsPerMinute, &retry));
+}
+
+static void testECRefreshLock(void)
+{
+    // 1 s polls against a 5 s refresh: locks onto the period
+    static const TraceLoad load[] = { { 120000, 1500 } };
+    BatteryTrace trace = makeTrace(load, 1, 5000, 2300);
+    ECRefreshTracker tracker;
+    tracker.reset();
+    for (uint64_t t = trace.start(); t < trace.start() + 60000; t += 1000)
+    {
+        const TraceSample& s = trace.at(t);
+        tracker.track(t, s.status, s.rate, s.capacity, s.voltage);
+    }
+    CHECK(tracker.isLocked());
+    CHECK(valueDelta(tracker.lockedPeriod(), 5000) <= 250);
+    CHECK(tracker.duplicates > tracker.samples / 2);
+}
+
+static void testReplayCalls(void)
+{
+    // a working day: idle, busy, idle, then on AC charging and charged
+    static const TraceLoad day[] = {
+        { 1800000, 900 },
+        { 900000, 2600 },
+        { 1800000, 1100 },
+        { 1200000, -2000 },
+        { 1800000, 0 },
+    };
+    static const uint32_t periods[] = { 1000, 4000, 15000 };
+
+    for (unsigned i = 0; i < sizeof(periods) / sizeof(periods[0]); i++)
+    {
+        BatteryTrace trace = makeTrace(day, sizeof(day) / sizeof(day[0]), periods[i], periods[i] / 3);
+        uint64_t before = fixedIntervalCalls(trace);
+
+        ReplayConfig config;
+        ReplayResult result = replay(trace, config);
+
+        printf("EC refresh %5u ms: %8.0f ACPI calls/hour before, %6.0f after (%u polls, %u duplicates, longest gap %u ms)\n",
+               periods[i], result.perHour(before), result.perHour(result.calls),
+               result.polls, result.duplicates, result.maxGap);
+
+        CHECK(result.calls * 10 < before);
+        CHECK(result.maxGap <= config.intervalMax);
+    }
+
+    // a recorded trace, if one is given: make test TRACE=path/to/trace.csv
+    const char* path = getenv("TRACE");
+    BatteryTrace recorded;
+    if (path && loadTrace(path, recorded, 5000))
+    {
+        ReplayConfig config;
+        ReplayResult result = replay(recorded, config);
+        uint64_t before = fixedIntervalCalls(recorded);
+        printf("%s: %.0f ACPI calls/hour before, %.0f after\n", path, result.perHour(before), result.perHour(result.calls));
+        CHECK(result.calls < before);
+    }
+}
+
+int main(void)
+{
+    testPollInterval();
+    testTripPoint();
+    testMeasurementError();
+    testBudget();
+    testECRefreshLock();
+    testReplayCalls();
+    return testSummary("PollSchedulerTest");
+}
@@ -0,0 +1,197 @@
+/*
+ * SMBusTest.cpp
+ *
+ * SMBus Read Word transactions against a stand-in for the EC's SMBus host
+ * controller: status handling, busy/timeout/error paths and locking.
+ */
+
+#include <string.h>
+
+#include "TestHarness.h"
+#include "SMBusProtocol.h"
+
+/*
+ * SMB-HC model: writing Read Word to SMB_PRTCL starts a transaction, which
+ * completes after completeAfter reads of SMB_STS (DONE plus errorCode, the
+ * word in SMB_DATA, SMB_PRTCL back to 0). SMB_STS is only ever changed by a
+ * completion or by the host writing it, like the EC does it. intrudeCommand
+ * (if not -1) has firmware run a whole Read Word of its own, to another slave,
+ * just before the host takes the lock to collect its result.
+ */
+struct MockSMBusHost
+{
+    uint8_t     regs[0x30];
+    uint16_t    words[0x100];       // battery registers by command
+    unsigned    completeAfter;
+    unsigned    statusReads;
+    bool        running;
+    bool        hang;               // transaction never completes
+    uint8_t     errorCode;
+    bool        lockAvailable;
+    bool        locked;
+    unsigned    unlockedAccesses;
+    unsigned    acquires;
+    unsigned    waits;
+    unsigned    lockedWaits;        // waits with the lock held
+    int         intrudeCommand;
+    uint8_t     writes[16];         // registers written, in order, this transaction
+    unsigned    writeCount;
+
+    MockSMBusHost()
+        : completeAfter(2), statusReads(0), running(false), hang(false), errorCode(0),
+          lockAvailable(true), locked(false), unlockedAccesses(0), acquires(0), waits(0),
+          lockedWaits(0), intrudeCommand(-1), writeCount(0)
+    {
+        memset(regs, 0, sizeof(regs));
+        for (int i = 0; i < 0x100; i++)
+            words[i] = (uint16_t)(0x1000 + i);
+    }
+
+    bool acquire(void)
+    {
+        if (!lockAvailable)
+            return false;
+        if (++acquires == 2 && intrudeCommand >= 0)
+        {
+            uint16_t word = words[intrudeCommand];
+            regs[kSMBAddress] = 0x0a << 1;
+            regs[kSMBCommand] = (uint8_t)intrudeCommand;
+            regs[kSMBData] = word & 0xff;
+            regs[kSMBData + 1] = word >> 8;
+            regs[kSMBStatus] = kSMBStatusDone;
+        }
+        locked = true;
+        return true;
+    }
+
+    void release(void)
+    {
+        locked = false;
+    }
+
+    int readRegister(uint8_t reg, uint8_t* value)
+    {
+        if (!locked)
+            ++unlockedAccesses;
+        if (kSMBStatus == reg && running && ++statusReads >= completeAfter && !hang)
+        {
+            running = false;
+            regs[kSMBProtocol] = 0;
+            regs[kSMBStatus] = kSMBStatusDone | errorCode;
+            if (!errorCode)
+            {
+                uint16_t word = words[regs[kSMBCommand]];
+                regs[kSMBData] = word & 0xff;
+                regs[kSMBData + 1] = word >> 8;
+            }
+        }
+        *value = regs[reg];
+        return 0;
+    }
+
+    int writeRegister(uint8_t reg, uint8_t value)
+    {
+        if (!locked)
+            ++unlockedAccesses;
+        if (writeCount < sizeof(writes))
+            writes[writeCount++] = reg;
+        regs[reg] = value;
+        if (kSMBProtocol == reg && kSMBProtocolReadWord == value)
+        {
+            running = true;
+            statusReads = 0;
+        }
+        return 0;
+    }
+
+    void wait(uint32_t ms)
+    {
+        ++waits;
+        if (locked)
+            ++lockedWaits;
+    }
+};
+
+static void testReadWord(void)
+{
+    MockSMBusHost host;
+    uint16_t value = 0;
+    uint8_t status = 0;
+
+    CHECK_EQ(smbusReadWord(&host, 0x0b, 0x09, &value, &status), kSMBusSuccess);
+    CHECK_EQ(value, 0x1009);
+    CHECK_EQ(host.regs[kSMBAddress], 0x0b << 1);
+    CHECK_EQ(status, kSMBStatusDone);
+
+    // SMB_STS is cleared before SMB_PRTCL starts the transaction
+    CHECK_EQ(host.writes[0], kSMBStatus);
+    CHECK_EQ(host.writes[host.writeCount - 1], kSMBProtocol);
+
+    // the previous DONE is not taken for this transaction's: a slow second
+    // read still gets its own word, not the first one's
+    host.completeAfter = 5;
+    CHECK_EQ(smbusReadWord(&host, 0x0b, 0x0a, &value, &status), kSMBusSuccess);
+    CHECK_EQ(value, 0x100a);
+    CHECK_EQ(host.statusReads, 5);
+
+    // only the DONE polls (2, then 5) run without the lock, which is never
+    // held across a wait and is released after
+    CHECK_EQ(host.unlockedAccesses, 2 + 5);
+    CHECK_EQ(host.lockedWaits, 0);
+    CHECK(!host.locked);
+}
+
+static void testFirmwareInBetween(void)
+{
+    // firmware ran its own transaction between our DONE and collecting the
+    // result: its word is not taken for ours
+    MockSMBusHost host;
+    uint16_t value = 0xbeef;
+    uint8_t status = 0;
+    host.intrudeCommand = 0x0d;
+    CHECK_EQ(smbusReadWord(&host, 0x0b, 0x09, &value, &status), kSMBusBusy);
+    CHECK_EQ(value, 0xbeef);
+    CHECK(!host.locked);
+}
+
+static void testFailures(void)
+{
+    uint16_t value = 0xbeef;
+    uint8_t status = 0;
+
+    // lock held elsewhere: nothing is touched
+    MockSMBusHost contended;
+    contended.lockAvailable = false;
+    CHECK_EQ(smbusReadWord(&contended, 0x0b, 0x09, &value, &status), kSMBusBusy);
+    CHECK_EQ(contended.writeCount, 0);
+
+    // firmware has a transaction running
+    MockSMBusHost busy;
+    busy.regs[kSMBProtocol] = kSMBProtocolReadWord;
+    CHECK_EQ(smbusReadWord(&busy, 0x0b, 0x09, &value, &status), kSMBusBusy);
+    CHECK_EQ(busy.writeCount, 0);
+    CHECK(!busy.locked);
+
+    // device NAK: DONE with a status code, the data is not read
+    MockSMBusHost nak;
+    nak.errorCode = 0x10;
+    CHECK_EQ(smbusReadWord(&nak, 0x0b, 0x09, &value, &status), kSMBusDeviceError);
+    CHECK_EQ(status, kSMBStatusDone | 0x10);
+    CHECK_EQ(value, 0xbeef);
+
+    // never completes: gives up after kSMBPollAttempts, releasing the lock
+    MockSMBusHost hung;
+    hung.hang = true;
+    CHECK_EQ(smbusReadWord(&hung, 0x0b, 0x09, &value, &status), kSMBusTimeout);
+    CHECK_EQ(hung.waits, kSMBPollAttempts);
+    CHECK(!hung.locked);
+    CHECK_EQ(hung.lockedWaits, 0);
+}
+
+int main(void)
+{
+    testReadWord();
+    testFailures();
+    testFirmwareInBetween();
+    return testSummary("SMBusTest");
+}
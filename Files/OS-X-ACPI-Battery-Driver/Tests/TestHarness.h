@@ -0,0 +1,41 @@
+/*
+ * TestHarness.h
+ *
+ * Minimal checks for the host tests: each test is its own executable
+ * (see "make test"), prints what it measured and exits non-zero on failure.
+ */
+
+#ifndef __TestHarness__
+#define __TestHarness__
+
+#include <stdio.h>
+
+static int gChecks;
+static int gFailures;
+
+#define CHECK(cond) \
+    do { \
+        ++gChecks; \
+        if (!(cond)) { \
+            ++gFailures; \
+            printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { \
+        ++gChecks; \
+        long long _a = (long long)(a), _b = (long long)(b); \
+        if (_a != _b) { \
+            ++gFailures; \
+            printf("%s:%d: CHECK_EQ failed: %s == %lld, expected %s == %lld\n", __FILE__, __LINE__, #a, _a, #b, _b); \
+        } \
+    } while (0)
+
+static inline int testSummary(const char* name)
+{
+    printf("%s: %d checks, %d failed\n", name, gChecks, gFailures);
+    return gFailures ? 1 : 0;
+}
+
+#endif